@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "bitpack.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_RUNTIME_DISPATCH 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+static void
+bitpack_portable(uint32_t *out, const uint32_t *samples, size_t n_words, int bit)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < n_words; i++) {
+		uint32_t word = 0;
+
+		for (j = 0; j < 32; j++) {
+			word = (word << 1) | ((samples[j] >> bit) & 1);
+		}
+
+		out[i] = word;
+		samples += 32;
+	}
+}
+
+#if defined(__SSE2__)
+static void
+bitpack_sse2(uint32_t *out, const uint32_t *samples, size_t n_words, int bit)
+{
+	/* Move the wanted bit into the sign bit so movemask can collect it */
+	__m128i count = _mm_cvtsi32_si128(31 - bit);
+	size_t i;
+	int j;
+
+	for (i = 0; i < n_words; i++) {
+		uint32_t word = 0;
+
+		for (j = 0; j < 32; j += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *) &samples[j]);
+			v = _mm_sll_epi32(v, count);
+			/* movemask puts lane 0 in bit 0, we want the first sample
+			 * in the most significant position */
+			v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+			word = (word << 4) | _mm_movemask_ps(_mm_castsi128_ps(v));
+		}
+
+		out[i] = word;
+		samples += 32;
+	}
+}
+#endif
+
+#if defined(HAVE_X86_RUNTIME_DISPATCH)
+__attribute__((target("avx2")))
+static void
+bitpack_avx2(uint32_t *out, const uint32_t *samples, size_t n_words, int bit)
+{
+	__m128i count = _mm_cvtsi32_si128(31 - bit);
+	__m256i reverse = _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	size_t i;
+	int j;
+
+	for (i = 0; i < n_words; i++) {
+		uint32_t word = 0;
+
+		for (j = 0; j < 32; j += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *) &samples[j]);
+			v = _mm256_sll_epi32(v, count);
+			v = _mm256_permutevar8x32_epi32(v, reverse);
+			word = (word << 8) | _mm256_movemask_ps(_mm256_castsi256_ps(v));
+		}
+
+		out[i] = word;
+		samples += 32;
+	}
+}
+#endif
+
+#if defined(HAVE_NEON)
+static void
+bitpack_neon(uint32_t *out, const uint32_t *samples, size_t n_words, int bit)
+{
+	/* NEON has no movemask. Each lane accumulates its share of the word
+	 * at its final position, then a pairwise add folds the lanes (the
+	 * bits are disjoint so adding is the same as or-ing).
+	 */
+	static const int32_t lane_pos[4] = { 3, 2, 1, 0 };
+	int32x4_t shift_pos = vld1q_s32(lane_pos);
+	int32x4_t shift_bit = vdupq_n_s32(-bit);
+	uint32x4_t one = vdupq_n_u32(1);
+	size_t i;
+	int j;
+
+	for (i = 0; i < n_words; i++) {
+		uint32x4_t acc = vdupq_n_u32(0);
+
+		for (j = 0; j < 32; j += 4) {
+			uint32x4_t v = vld1q_u32(&samples[j]);
+			v = vandq_u32(vshlq_u32(v, shift_bit), one);
+			acc = vorrq_u32(vshlq_n_u32(acc, 4), vshlq_u32(v, shift_pos));
+		}
+
+		uint32x2_t p = vpadd_u32(vget_low_u32(acc), vget_high_u32(acc));
+		p = vpadd_u32(p, p);
+		out[i] = vget_lane_u32(p, 0);
+		samples += 32;
+	}
+}
+#endif
+
+bitpack_fn bitpack = bitpack_portable;
+
+/* Four 32-bit lanes; gcc lowers this to SSE2 or NEON registers */
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+/* Transposes four independent 32x32 bit matrices at once (Hacker's Delight
+ * transpose32, with every row widened to a vector). Lane l of rows[k] is row k
+ * of matrix l. Bits are numbered from the most significant one.
+ */
+static inline void
+transpose32x4(v4u32 rows[32])
+{
+	uint32_t m = 0x0000FFFF;
+	int j, k;
+
+	for (j = 16; j != 0; j >>= 1, m ^= m << j) {
+		for (k = 0; k < 32; k = (k + j + 1) & ~j) {
+			v4u32 t = (rows[k] ^ (rows[k + j] >> j)) & m;
+			rows[k] ^= t;
+			rows[k + j] ^= t << j;
+		}
+	}
+}
+
+void
+bitpack_planes(uint32_t *out, const uint32_t *samples, size_t n_groups,
+		uint32_t mask)
+{
+	size_t g;
+	int k, l;
+
+	if (__builtin_popcount(mask) == 1) {
+		bitpack(out, samples, n_groups, __builtin_ctz(mask));
+		return;
+	}
+
+	/* Whatever the number of channels, the cost is one transpose per group */
+	for (g = 0; g < n_groups; g += 4) {
+		v4u32 rows[32];
+		int n_lanes = n_groups - g < 4 ? n_groups - g : 4;
+
+		for (k = 0; k < 32; k++) {
+			v4u32 row = { 0, 0, 0, 0 };
+			for (l = 0; l < n_lanes; l++) {
+				row[l] = samples[l * 32 + k];
+			}
+			rows[k] = row;
+		}
+
+		transpose32x4(rows);
+
+		/* After the transpose, rows[31 - c] holds the samples of bit c
+		 * with the first sample in the most significant bit. */
+		for (l = 0; l < n_lanes; l++) {
+			uint32_t m;
+			for (m = mask; m; m &= m - 1) {
+				*out++ = rows[31 - __builtin_ctz(m)][l];
+			}
+		}
+
+		samples += 32 * n_lanes;
+	}
+}
+
+const char *
+bitpack_init(void)
+{
+#if defined(HAVE_NEON)
+	bitpack = bitpack_neon;
+	return "neon";
+#else
+#if defined(HAVE_X86_RUNTIME_DISPATCH)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		bitpack = bitpack_avx2;
+		return "avx2";
+	}
+#endif
+#if defined(__SSE2__)
+	bitpack = bitpack_sse2;
+	return "sse2";
+#endif
+	bitpack = bitpack_portable;
+	return "portable";
+#endif
+}
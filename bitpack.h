@@ -0,0 +1,28 @@
+#ifndef BITPACK_H
+#define BITPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Gathers bit number `bit` of 32 * n_words consecutive samples into n_words
+ * packed words. The first sample of each group of 32 ends up in the most
+ * significant bit, which is the order bit_output_add() has always used.
+ */
+typedef void (*bitpack_fn)(uint32_t *out, const uint32_t *samples,
+		size_t n_words, int bit);
+
+extern bitpack_fn bitpack;
+
+/* Packs every channel (bit) selected in mask out of 32 * n_groups samples.
+ * For each group of 32 samples one word per channel is written, in ascending
+ * bit order, so a mask with a single bit gives the same output as bitpack().
+ */
+void bitpack_planes(uint32_t *out, const uint32_t *samples, size_t n_groups,
+		uint32_t mask);
+
+/* Selects the fastest implementation supported by the build and the CPU.
+ * Returns its name, for display purposes.
+ */
+const char *bitpack_init(void);
+
+#endif /* BITPACK_H */
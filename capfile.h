@@ -0,0 +1,120 @@
+#ifndef CAPFILE_H
+#define CAPFILE_H
+
+#include <stdint.h>
+
+/* Capture container written by iorec (unless --bare is given).
+ *
+ *   cap_header
+ *   chunk*          cap_chunk_header followed by payload_len bytes
+ *   cap_index       cap_index_header followed by n_entries cap_index_entry
+ *   cap_anchors     cap_anchor_header followed by n_entries cap_anchor
+ *   cap_footer      always the last sizeof(struct cap_footer) bytes
+ *
+ * Chunks hold samples_per_chunk samples, except the last one and those
+ * around gaps (see below), so the chunk holding a sample is found by binary
+ * search over the index, which is sorted by first sample, rather than by a
+ * division. The index and the footer are only written when the capture ends
+ * cleanly; readers fall back to walking the chunks, which are self-delimiting.
+ *
+ * The payload of a chunk is either packed words (one word per channel per 32
+ * samples, as in bare captures) or one edge block (see edges.h).
+ *
+ * When iorec resynchronizes after an overrun (--resync), the samples it lost
+ * are recorded as a chunk with CAP_CHUNK_GAP set, n_samples lost samples and
+ * no payload. Gap chunks are not in the index, and the chunks around a gap
+ * hold fewer than samples_per_chunk samples.
+ *
+ * With iorec --compress, chunk payloads may be compressed. The codec is in
+ * bits 8-15 of the chunk flags (see codec.h), and payload_len is the
+ * compressed length. Chunks that don't get smaller are stored as they are.
+ *
+ * The sample clock is only known through anchors: at regular intervals
+ * iorec records which sample the PRU was writing together with both clocks.
+ * Times in between are interpolated linearly. Anchors are written as they
+ * come in chunks with CAP_CHUNK_ANCHORS set, n_samples 0 and an array of
+ * cap_anchor as payload, and again all together after the index. Anchor
+ * chunks are not in the index and don't start a gap.
+ *
+ * A file may hold only part of a capture (iorec --segment-size, see
+ * segments.h): its first chunk is then at first_sample rather than 0, and
+ * sample numbers and clocks stay those of the whole capture. Headers written
+ * before first_sample existed are shorter, which header_size tells.
+ */
+
+#define CAP_FILE_MAGIC "IORECCAP"
+#define CAP_FOOTER_MAGIC "IORECEND"
+#define CAP_FILE_VERSION 1
+#define CAP_CHUNK_MAGIC 0x4b4e4843 /* "CHNK" */
+#define CAP_INDEX_MAGIC 0x58444e49 /* "INDX" */
+#define CAP_ANCHOR_MAGIC 0x48434e41 /* "ANCH" */
+
+enum cap_payload_format {
+	CAP_PAYLOAD_PACKED = 0,
+	CAP_PAYLOAD_EDGES = 1,
+};
+
+struct cap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size; /* sizeof(struct cap_header) when written */
+	uint32_t payload_format;
+	uint32_t channel_mask;
+	uint32_t capture_choke;
+	uint32_t samples_per_chunk;
+	double sample_rate; /* nominal or from --profile, in samples per second */
+
+	/* Clocks when the PRU was started, i.e. at sample 0 */
+	uint64_t start_monotonic_ns;
+	uint64_t start_realtime_ns;
+
+	uint64_t first_sample; /* of the first chunk */
+};
+
+#define CAP_CHUNK_GAP 0x1
+#define CAP_CHUNK_ANCHORS 0x2
+#define CAP_CHUNK_CODEC_SHIFT 8
+#define CAP_CHUNK_CODEC(flags) (((flags) >> CAP_CHUNK_CODEC_SHIFT) & 0xff)
+
+struct cap_chunk_header {
+	uint32_t magic;
+	uint32_t payload_len;
+	uint64_t first_sample;
+	uint32_t n_samples;
+	uint32_t flags;
+};
+
+struct cap_index_header {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t n_entries;
+};
+
+struct cap_index_entry {
+	uint64_t first_sample;
+	uint64_t offset; /* of the chunk header, from the start of the file */
+};
+
+struct cap_anchor_header {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t n_entries;
+};
+
+struct cap_anchor {
+	uint64_t sample; /* the PRU's write counter / 4, lost samples included */
+	uint64_t monotonic_ns;
+	uint64_t realtime_ns;
+};
+
+struct cap_footer {
+	uint64_t index_offset;
+	uint64_t n_samples; /* samples stored in the file */
+	uint64_t end_sample; /* samples produced by the PRU, stored or not */
+	uint64_t end_monotonic_ns; /* when the capture stopped */
+	uint32_t n_overruns;
+	uint32_t n_gaps; /* gap chunks in the file, from overruns and triggers alike */
+	char magic[8];
+};
+
+#endif /* CAPFILE_H */
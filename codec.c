@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "codec.h"
+#include "edges.h"
+
+/* Room for a varint and the byte after it */
+#define VARINT_MAX 10
+
+size_t
+codec_bitrun_compress(uint8_t *out, size_t cap, const uint32_t *planes,
+		size_t n_groups, int n_channels)
+{
+	uint8_t *p = out;
+	uint8_t *end = out + cap;
+	int c;
+	size_t g;
+
+	for (c = 0; c < n_channels; c++) {
+		if (n_groups == 0) {
+			break;
+		}
+
+		/* Bits equal to the current value are 0 in x */
+		int cur = planes[c] >> 31;
+		uint64_t run = 0;
+
+		if (p + 1 > end) {
+			return 0;
+		}
+		*p++ = cur;
+
+		for (g = 0; g < n_groups; g++) {
+			uint32_t x = planes[g * n_channels + c] ^ (cur ? ~0u : 0);
+			int rem = 32; /* bits of x left, at the top */
+
+			while (x) {
+				int n = __builtin_clz(x);
+				run += n;
+				if (p + VARINT_MAX > end) {
+					return 0;
+				}
+				p = edge_put_varint(p, run);
+				run = 0;
+				cur ^= 1;
+
+				/* What's left, compared with the new value */
+				rem -= n;
+				x = ~x << n;
+				x &= rem == 32 ? ~0u : ~(~0u >> rem);
+			}
+			run += rem;
+		}
+
+		if (p + VARINT_MAX > end) {
+			return 0;
+		}
+		p = edge_put_varint(p, run);
+	}
+
+	return p - out;
+}
+
+static inline uint32_t
+lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz4_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - CODEC_LZ4_HASH_BITS);
+}
+
+static inline uint8_t *
+lz4_put_length(uint8_t *p, size_t len)
+{
+	while (len >= 255) {
+		*p++ = 255;
+		len -= 255;
+	}
+	*p++ = len;
+
+	return p;
+}
+
+/* Writes literals and, if match_len isn't 0, a match. NULL if out of room. */
+static uint8_t *
+lz4_put_sequence(uint8_t *p, uint8_t *end, const uint8_t *lit, size_t lit_len,
+		size_t offset, size_t match_len)
+{
+	size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+	if (worst > (size_t) (end - p)) {
+		return NULL;
+	}
+
+	uint8_t *token = p++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15) {
+		p = lz4_put_length(p, lit_len - 15);
+	}
+	memcpy(p, lit, lit_len);
+	p += lit_len;
+
+	if (match_len) {
+		*p++ = offset;
+		*p++ = offset >> 8;
+		match_len -= 4;
+		*token |= match_len < 15 ? match_len : 15;
+		if (match_len >= 15) {
+			p = lz4_put_length(p, match_len - 15);
+		}
+	}
+
+	return p;
+}
+
+size_t
+codec_lz4_compress(uint8_t *out, size_t cap, const uint8_t *in, size_t len,
+		uint32_t *table)
+{
+	const uint8_t *ip = in;
+	const uint8_t *anchor = in;
+	const uint8_t *end = in + len;
+	uint8_t *p = out;
+
+	memset(table, 0, sizeof(table[0]) << CODEC_LZ4_HASH_BITS);
+
+	if (len >= CODEC_LZ4_MIN_LENGTH) {
+		const uint8_t *match_start_limit = end - CODEC_LZ4_MATCH_LIMIT;
+		const uint8_t *match_end_limit = end - CODEC_LZ4_LAST_LITERALS;
+
+		while (ip < match_start_limit) {
+			uint32_t seq = lz4_read32(ip);
+			uint32_t h = lz4_hash(seq);
+			const uint8_t *ref = in + table[h];
+			table[h] = ip - in;
+
+			if (ref >= ip || ip - ref > 65535 || lz4_read32(ref) != seq) {
+				ip++;
+				continue;
+			}
+
+			size_t match_len = 4;
+			while (ip + match_len < match_end_limit && ref[match_len] == ip[match_len]) {
+				match_len++;
+			}
+
+			p = lz4_put_sequence(p, out + cap, anchor, ip - anchor, ip - ref, match_len);
+			if (p == NULL) {
+				return 0;
+			}
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	p = lz4_put_sequence(p, out + cap, anchor, end - anchor, 0, 0);
+	if (p == NULL) {
+		return 0;
+	}
+
+	return p - out;
+}
@@ -0,0 +1,64 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Chunk compression (iorec --compress). A compressed chunk has the codec in
+ * its flags (see capfile.h) and its payload is a codec_header followed by the
+ * compressed bytes. Chunks are compressed independently, so they can be
+ * decompressed in any order, and the index still gives their offsets.
+ *
+ * CAP_CODEC_BITRUN only applies to packed payloads. Every channel's samples
+ * are stored in turn as the value of its first sample (one byte) then the
+ * lengths of its runs of equal samples as LEB128 varints, until they add up
+ * to the chunk's n_samples.
+ *
+ * CAP_CODEC_LZ4 is the LZ4 block format, for any payload: sequences of a
+ * token (literal length << 4 | match length - 4, 15 meaning more bytes of
+ * 255 follow), literals, and a 2-byte little-endian match offset. The last
+ * sequence is literals only.
+ */
+
+enum cap_codec {
+	CAP_CODEC_NONE = 0,
+	CAP_CODEC_BITRUN = 1,
+	CAP_CODEC_LZ4 = 2,
+};
+
+struct codec_header {
+	uint32_t raw_len; /* of the payload once decompressed */
+	uint32_t reserved;
+};
+
+#define CODEC_LZ4_HASH_BITS 12
+#define CODEC_LZ4_MIN_LENGTH 13 /* shorter inputs are all literals */
+#define CODEC_LZ4_LAST_LITERALS 5
+#define CODEC_LZ4_MATCH_LIMIT 12 /* no match starts in the last bytes */
+
+static inline const char *
+codec_name(uint32_t codec)
+{
+	switch (codec) {
+	case CAP_CODEC_BITRUN:
+		return "bitrun";
+	case CAP_CODEC_LZ4:
+		return "lz4";
+	default:
+		return "none";
+	}
+}
+
+/* Compresses n_groups groups of n_channels planes into at most cap bytes.
+ * Returns the size, or 0 if it doesn't fit.
+ */
+size_t codec_bitrun_compress(uint8_t *out, size_t cap, const uint32_t *planes,
+		size_t n_groups, int n_channels);
+
+/* Compresses len bytes into at most cap bytes. table has
+ * 1 << CODEC_LZ4_HASH_BITS entries. Returns the size, or 0 if it doesn't fit.
+ */
+size_t codec_lz4_compress(uint8_t *out, size_t cap, const uint8_t *in, size_t len,
+		uint32_t *table);
+
+#endif /* CODEC_H */
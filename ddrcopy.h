@@ -0,0 +1,17 @@
+#ifndef DDRCOPY_H
+#define DDRCOPY_H
+
+#include <stddef.h>
+
+/* Copies len bytes out of the PRU's ring into cached memory. The ring is
+ * mapped uncached, where every load goes out to DDR on its own, so this reads
+ * it in bursts as wide as the CPU allows and everything else then works on
+ * the copy. src, dst and len must be multiples of 4: the ring may be mapped
+ * as device memory, which doesn't take unaligned accesses.
+ */
+void ddr_copy(void *dst, const void *src, size_t len);
+
+/* How ddr_copy() reads the ring in this build, for display purposes */
+const char *ddr_copy_method(void);
+
+#endif /* DDRCOPY_H */
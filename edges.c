@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "edges.h"
+
+size_t
+edge_encode_max_size(size_t n_groups, int n_channels)
+{
+	/* Every sample can be an edge: a one byte delta, plus up to 5 bytes
+	 * for the set of channels. The first delta can be larger. */
+	return sizeof(struct edge_block_header) + 10
+		+ n_groups * 32 * (1 + (n_channels > 1 ? 5 : 0));
+}
+
+size_t
+edge_encode_block(uint8_t *out, const uint32_t *planes, size_t n_groups,
+		int n_channels, uint64_t first_sample)
+{
+	struct edge_block_header hdr;
+	uint8_t *p = out + sizeof(hdr);
+	uint32_t diffs[32];
+	uint32_t initial = 0;
+	uint64_t last_edge = 0;
+	size_t g;
+	int c;
+
+	if (n_groups == 0) {
+		return 0;
+	}
+
+	for (c = 0; c < n_channels; c++) {
+		initial |= (planes[c] >> 31) << c;
+	}
+
+	for (g = 0; g < n_groups; g++) {
+		const uint32_t *cur = &planes[g * n_channels];
+		uint32_t any = 0;
+
+		/* Bit i of diffs[c] is set when sample i differs from sample
+		 * i - 1. The sample before the first one is the last sample of
+		 * the previous group, or the first sample itself. */
+		for (c = 0; c < n_channels; c++) {
+			uint32_t prev = g ? cur[c - n_channels] << 31 : cur[c] & 0x80000000;
+			diffs[c] = cur[c] ^ ((cur[c] >> 1) | prev);
+			any |= diffs[c];
+		}
+
+		while (any) {
+			int pos = __builtin_clz(any);
+			uint64_t idx = g * 32 + pos;
+
+			p = edge_put_varint(p, idx - last_edge);
+			last_edge = idx;
+
+			if (n_channels > 1) {
+				uint32_t changed = 0;
+				for (c = 0; c < n_channels; c++) {
+					changed |= ((diffs[c] >> (31 - pos)) & 1) << c;
+				}
+				p = edge_put_varint(p, changed);
+			}
+
+			any &= ~(0x80000000u >> pos);
+		}
+	}
+
+	hdr.magic = EDGE_BLOCK_MAGIC;
+	hdr.payload_len = p - out - sizeof(hdr);
+	hdr.first_sample = first_sample;
+	hdr.n_samples = n_groups * 32;
+	hdr.initial = initial;
+	memcpy(out, &hdr, sizeof(hdr));
+
+	return p - out;
+}
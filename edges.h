@@ -0,0 +1,58 @@
+#ifndef EDGES_H
+#define EDGES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Edge-encoded capture files (iorec --format=edges) only record the samples
+ * where one of the channels changes. The file starts with an
+ * edge_file_header and is followed by independent blocks.
+ */
+
+#define EDGE_FILE_MAGIC "IORECEDG"
+#define EDGE_FILE_VERSION 1
+#define EDGE_BLOCK_MAGIC 0x42474445 /* "EDGB" */
+
+struct edge_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t channel_mask;
+};
+
+/* A block covers n_samples samples starting at first_sample. initial holds
+ * the channels of its first sample, as bits in channel order (lowest r31 bit
+ * first). It is followed by payload_len bytes of LEB128 varints: for every
+ * sample where a channel changes, its distance from the previous change (from
+ * first_sample for the first one), then, only if the file has more than one
+ * channel, the set of channels that changed as bits in channel order.
+ */
+struct edge_block_header {
+	uint32_t magic;
+	uint32_t payload_len;
+	uint64_t first_sample;
+	uint32_t n_samples;
+	uint32_t initial;
+};
+
+static inline uint8_t *
+edge_put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+/* Largest block edge_encode_block() can produce for n_groups groups */
+size_t edge_encode_max_size(size_t n_groups, int n_channels);
+
+/* Encodes n_groups groups of bit-planes, as produced by bitpack_planes(),
+ * into one block (header included). Returns the size of the block.
+ */
+size_t edge_encode_block(uint8_t *out, const uint32_t *planes, size_t n_groups,
+		int n_channels, uint64_t first_sample);
+
+#endif /* EDGES_H */
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include "filter.h"
+#include "log.h"
+
+#define FILTER_UNKNOWN UINT64_MAX
+
+/* Four output groups at a time; gcc lowers this to SSE2 or NEON registers */
+typedef uint32_t v4u __attribute__((vector_size(16)));
+
+struct filter {
+	struct filter_config cfg;
+	int n_channels;
+	int log2_decimate;
+
+	/* Deglitcher state per channel, carried from one group to the next */
+	uint64_t expected; /* first sample of the next group if there's no gap */
+	uint32_t *last_in; /* the previous input word */
+	uint32_t *level; /* the output level of the last sample, 0 or 1 */
+
+	uint64_t samples_in;
+	uint64_t samples_out;
+	uint64_t samples_changed; /* by the deglitcher */
+};
+
+struct filter *
+filter_create(const struct filter_config *cfg, uint32_t channel_mask)
+{
+	if (cfg->decimate < 1 || cfg->decimate > 32 || (cfg->decimate & (cfg->decimate - 1))) {
+		ERROR("can only decimate by 1, 2, 4, 8, 16 or 32");
+		return NULL;
+	}
+	if (cfg->min_pulse < 1 || cfg->min_pulse > FILTER_MAX_PULSE) {
+		ERROR("the deglitcher's minimum pulse is 1 to %d samples", FILTER_MAX_PULSE);
+		return NULL;
+	}
+
+	struct filter *f = malloc(sizeof(*f));
+	if (f == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(f, 0, sizeof(*f));
+	f->cfg = *cfg;
+	f->n_channels = __builtin_popcount(channel_mask);
+	f->log2_decimate = __builtin_ctz(cfg->decimate);
+	f->expected = FILTER_UNKNOWN;
+	f->last_in = calloc(f->n_channels, sizeof(f->last_in[0]));
+	f->level = calloc(f->n_channels, sizeof(f->level[0]));
+	if (f->last_in == NULL || f->level == NULL) {
+		ERROR("out of memory");
+		filter_destroy(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+/* One word of the deglitcher. Earlier samples are in higher bits, with the
+ * previous word above this one: bit p of `high` ends up set where the
+ * min_pulse samples up to p were all high. Where the input is steady either
+ * way, that is the output; elsewhere the level carries on from the last
+ * steady sample, or from *level across words.
+ */
+static inline uint32_t
+deglitch_word(int min_pulse, uint32_t prev, uint32_t in, uint32_t *level)
+{
+	uint64_t high = (uint64_t) prev << 32 | in;
+	uint64_t low = ~high;
+	int len = 1;
+	int s;
+
+	while (len * 2 <= min_pulse) {
+		high &= high >> len;
+		low &= low >> len;
+		len *= 2;
+	}
+	if (len < min_pulse) {
+		high &= high >> (min_pulse - len);
+		low &= low >> (min_pulse - len);
+	}
+
+	uint32_t known = (uint32_t) (high | low);
+	uint32_t out = (uint32_t) high;
+	for (s = 1; s < 32; s *= 2) {
+		out |= (out >> s) & ~known;
+		known |= known >> s;
+	}
+
+	/* Only a leading run can be left unknown */
+	out |= *level ? ~known : 0;
+	*level = out & 1;
+
+	return out;
+}
+
+static void
+deglitch(struct filter *f, uint32_t *planes, size_t n_groups)
+{
+	size_t g;
+	int c;
+
+	for (c = 0; c < f->n_channels; c++) {
+		uint32_t prev = f->last_in[c];
+		uint32_t level = f->level[c];
+
+		for (g = 0; g < n_groups; g++) {
+			uint32_t *p = &planes[g * f->n_channels + c];
+			uint32_t in = *p;
+
+			*p = deglitch_word(f->cfg.min_pulse, prev, in, &level);
+			f->samples_changed += __builtin_popcount(in ^ *p);
+			prev = in;
+		}
+
+		f->last_in[c] = prev;
+		f->level[c] = level;
+	}
+}
+
+/* Gathers the bits at multiples of 2^log2_n into the low bits, in order */
+static inline v4u
+compact_bits(v4u x, int log2_n)
+{
+	int i;
+
+	for (i = 0; i < log2_n; i++) {
+		x &= 0x55555555;
+		x = (x | (x >> 1)) & 0x33333333;
+		x = (x | (x >> 2)) & 0x0f0f0f0f;
+		x = (x | (x >> 4)) & 0x00ff00ff;
+		x = (x | (x >> 8)) & 0x0000ffff;
+	}
+
+	return x;
+}
+
+/* The majority of every field of n = 2^log2_n bits, in the field's lowest
+ * bit, the field's first sample (its highest bit) counting twice to break
+ * ties. The fields' populations are added up in place, then compared to
+ * n / 2 + 1 by adding what carries a population that large into bit
+ * log2_n + 1.
+ */
+static inline v4u
+majority_fields(v4u x, int log2_n)
+{
+	int n = 1 << log2_n;
+
+	if (n == 2) {
+		/* A tie or agreement: the first sample either way */
+		return (x >> 1) & 0x55555555;
+	}
+
+	uint32_t lsb = 0x11111111;
+	v4u count = x - ((x >> 1) & 0x55555555);
+	count = (count & 0x33333333) + ((count >> 2) & 0x33333333);
+	if (n >= 8) {
+		count = (count & 0x0f0f0f0f) + ((count >> 4) & 0x0f0f0f0f);
+		lsb = 0x01010101;
+	}
+	if (n >= 16) {
+		count = (count & 0x00ff00ff) + ((count >> 8) & 0x00ff00ff);
+		lsb = 0x00010001;
+	}
+	if (n == 32) {
+		count = (count & 0x0000ffff) + ((count >> 16) & 0x0000ffff);
+		lsb = 1;
+	}
+	count += (x >> (n - 1)) & lsb;
+
+	int b = log2_n + 1;
+	count += ((1u << b) - (n / 2 + 1)) * lsb;
+
+	return (count >> b) & lsb;
+}
+
+/* Replaces every n groups by one, in place: output group j only reads input
+ * groups from j * n on.
+ */
+static size_t
+decimate(struct filter *f, uint32_t *planes, size_t n_groups)
+{
+	int log2_n = f->log2_decimate;
+	size_t n = f->cfg.decimate;
+	size_t s = f->n_channels;
+	size_t n_out = n_groups / n;
+	int bits = 32 / n; /* output bits per input word */
+	size_t j, i, l;
+	int c;
+
+	for (j = 0; j < n_out; j += 4) {
+		size_t lanes = n_out - j < 4 ? n_out - j : 4;
+
+		for (c = 0; c < f->n_channels; c++) {
+			v4u out = { 0, 0, 0, 0 };
+
+			for (i = 0; i < n; i++) {
+				v4u x = { 0, 0, 0, 0 };
+				for (l = 0; l < lanes; l++) {
+					x[l] = planes[((j + l) * n + i) * s + c];
+				}
+				out = (out << bits)
+					| compact_bits(majority_fields(x, log2_n), log2_n);
+			}
+
+			for (l = 0; l < lanes; l++) {
+				planes[(j + l) * s + c] = out[l];
+			}
+		}
+	}
+
+	return n_out;
+}
+
+size_t
+filter_apply(struct filter *f, uint32_t *planes, size_t n_groups,
+		uint64_t first_sample, uint64_t *out_first_sample)
+{
+	size_t c;
+
+	f->samples_in += 32 * n_groups;
+
+	if (f->cfg.min_pulse > 1 && n_groups) {
+		if (first_sample != f->expected) {
+			/* Start steady at the first sample's level */
+			for (c = 0; c < (size_t) f->n_channels; c++) {
+				f->level[c] = planes[c] >> 31;
+				f->last_in[c] = f->level[c] ? ~0u : 0;
+			}
+		}
+		deglitch(f, planes, n_groups);
+		f->expected = first_sample + 32 * n_groups;
+	}
+
+	*out_first_sample = first_sample >> f->log2_decimate;
+	if (f->cfg.decimate > 1) {
+		n_groups = decimate(f, planes, n_groups);
+	}
+	f->samples_out += 32 * n_groups;
+
+	return n_groups;
+}
+
+void
+filter_print_summary(struct filter *f)
+{
+	printf("         Filter: deglitched below %d samples (%" PRIu64 " samples changed), decimated by %d: %" PRIu64 " -> %" PRIu64 " samples\n",
+		f->cfg.min_pulse, f->samples_changed, f->cfg.decimate, f->samples_in,
+		f->samples_out);
+}
+
+void
+filter_destroy(struct filter *f)
+{
+	free(f->last_in);
+	free(f->level);
+	free(f);
+}
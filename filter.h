@@ -0,0 +1,47 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Filter stage, between packing and everything downstream of it (trigger,
+ * encoding, live readers, the file). Works on packed planes (see
+ * bitpack_planes()), 32 samples per word operation.
+ *
+ * Deglitching (min_pulse > 1) makes a channel change only once its new level
+ * has held for min_pulse samples, so shorter pulses are dropped. Edges that
+ * are kept come out min_pulse - 1 samples late.
+ *
+ * Decimation by N keeps one sample per N, the majority of the N, the first
+ * of them breaking ties. Samples are then numbered at the lower rate
+ * everywhere: chunks, anchors, trigger windows, the header's sample rate.
+ *
+ * The deglitcher carries state from one block to the next, so blocks have to
+ * go through filter_apply() in order. A gap resets it.
+ */
+
+#define FILTER_MAX_PULSE 32
+
+struct filter_config {
+	int decimate; /* 1, 2, 4, 8, 16 or 32 */
+	int min_pulse; /* 1 to FILTER_MAX_PULSE samples, 1 for no deglitching */
+};
+
+struct filter;
+
+struct filter *filter_create(const struct filter_config *cfg, uint32_t channel_mask);
+
+/* Filters the planes of n_groups groups starting at first_sample, in place.
+ * Returns how many groups are left, and their first sample through
+ * out_first_sample. Groups that don't make up a whole decimated group at the
+ * end are dropped.
+ */
+size_t filter_apply(struct filter *f, uint32_t *planes, size_t n_groups,
+		uint64_t first_sample, uint64_t *out_first_sample);
+
+void filter_print_summary(struct filter *f);
+
+void filter_destroy(struct filter *f);
+
+#endif /* FILTER_H */
@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#ifndef NO_PRUSSDRV
 #include <prussdrv.h>
 #include <pruss_intc_mapping.h>
+#endif
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -14,74 +16,78 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <getopt.h>
-
-#define ERROR(msg, args...) fprintf(stderr, "error: " msg "\n", ##args)
-#define SIGSAFE_MSG(msg) write(STDERR_FILENO, msg, sizeof(msg))
+#include <poll.h>
+#include <sys/wait.h>
+#include "bitpack.h"
+#include "ddrcopy.h"
+#include "sim.h"
+#include "pipeline.h"
+#include "trigger.h"
+#include "telemetry.h"
+#include "codec.h"
+#include "realtime.h"
+#include "profile.h"
+#include "segments.h"
+#include "log.h"
+
+#define SIGSAFE_MSG(msg) write(STDERR_FILENO, msg, sizeof(msg) - 1)
 
 #define PRU_NUM 0 /* which of the two PRUs are we using? */
+#define DEFAULT_CHANNEL_MASK (1 << 15) /* the bit of r31 we used to hard-code */
+
+/* How the polling thread waits for new data */
+enum wait_mode {
+	WAIT_SPIN = 0, /* poll the counters continuously */
+	WAIT_EVENT, /* sleep until the producer signals a watermark */
+	WAIT_TIMED, /* sleep for the time the producer takes to reach a watermark */
+};
+
+const char *wait_mode_names[] = { "spin", "event", "timed" };
 
 bool flag_test_mode = 0;
 int flag_capture_choke = 23;
+uint32_t flag_channel_mask = DEFAULT_CHANNEL_MASK;
 const char *flag_out_file = NULL;
+bool flag_simulate = false;
+double flag_sim_rate = 0; /* samples/second, 0 means derive it from the choke */
+uint32_t flag_sim_ring_size = 8388608;
+int flag_duration = 0; /* seconds, 0 means until interrupted */
+int flag_workers = 1;
+int flag_queue_blocks = 8; /* per worker */
+size_t flag_block_size = 1048576;
+enum wait_mode flag_wait_mode = WAIT_SPIN;
+enum output_format flag_format = OUTPUT_PACKED;
+bool flag_bare = false;
+bool flag_resync = false;
+enum writer_backend flag_writer = WRITER_AUTO;
+int flag_writer_threads = 2;
+int flag_write_buffers = 4;
+size_t flag_write_buffer_size = 4194304;
+bool flag_direct = false;
+uint64_t flag_preallocate = 0;
+struct trigger_config flag_trigger = { .pre = 65536, .post = 65536 };
+const char *flag_stats = NULL;
+uint32_t flag_stats_interval = 1000; /* ms */
+const char *flag_live = NULL;
+int flag_live_slots = 32;
+enum cap_codec flag_compress = CAP_CODEC_NONE;
+bool flag_realtime = false;
+int flag_rt_cpu = -1; /* the last one */
+int flag_rt_priority = 80;
+const char *flag_calibrate = NULL; /* profile to write */
+int flag_calibrate_min = 1;
+int flag_calibrate_max = 64;
+int flag_calibrate_duration = 5; /* seconds per trial */
+uint32_t flag_anchor_interval = 100; /* ms, 0 for none */
+uint64_t flag_segment_size = 0;
+uint32_t flag_segment_duration = 0; /* seconds */
+uint64_t flag_disk_budget = 0;
+struct filter_config flag_filter = { .decimate = 1, .min_pulse = 1 };
+bool flag_have_profile = false;
+struct capture_profile flag_profile;
+uint32_t flag_watermark = 65536;
 sig_atomic_t interrupt_requested = 0;
 
-struct bit_output {
-	uint32_t buf[4096];
-	size_t next_idx;
-	size_t next_bit;
-	uint32_t cur_word;
-	int fd;
-};
-
-struct bit_output *
-bit_output_create(const char *filename)
-{
-	struct bit_output *bo = malloc(sizeof(*bo));
-	if (bo == NULL) {
-		ERROR("out of memory");
-		return NULL;
-	}
-
-	memset(bo, 0, sizeof(*bo));
-
-	bo->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (bo->fd == -1) {
-		free(bo);
-		return NULL;
-	}
-
-	return bo;
-}
-
-static inline int
-bit_output_add(struct bit_output *bo, int b)
-{
-	int result;
-
-	bo->cur_word <<= 1;
-	bo->cur_word |= b;
-	bo->next_bit++;
-
-	if (bo->next_bit == 32) {
-		bo->buf[bo->next_idx] = bo->cur_word;
-		bo->next_idx++;
-		if (bo->next_idx == 4096) {
-			result = write(bo->fd, bo->buf, 4096 * sizeof(bo->buf[0]));
-			if (result == -1 || result == 0) {
-				perror("write");
-				return -1;
-			}
-
-			bo->next_idx = 0;
-		}
-
-		bo->cur_word = 0;
-		bo->next_bit = 0;
-	}
-
-	return 0;
-}
-
 void
 signal_handler(int sig)
 {
@@ -106,6 +112,12 @@ int setup_signal_handler(void)
 		return -1;
 	}
 
+	/* Used by --duration */
+	if (sigaction(SIGALRM, &sa, NULL) == -1) {
+		perror("sigaction");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -207,11 +219,12 @@ int get_extmem_address_from_module(void **addr_out, uint32_t *size_out)
 	if (hex2void(&buf[2], &size_out_void) == -1) {
 		return -1;
 	}
-	*size_out = (uint32_t) size_out_void;
+	*size_out = (uint32_t) (uintptr_t) size_out_void;
 
 	return 0;
 }
 
+#ifndef NO_PRUSSDRV
 static int pru_setup(const char * const path)
 {
 	int rtn;
@@ -258,7 +271,10 @@ static void *get_pru_mem(void)
 	return mem;
 }
 
-static void *get_designated_ddr(void *extram)
+/* Maps the ring the PRU writes to. It comes out uncached, so the poller
+ * only ever reads it through ddr_copy().
+ */
+static void *get_designated_ddr(void *extram, uint32_t size)
 {
 	void *mem;
 	int fd;
@@ -269,60 +285,146 @@ static void *get_designated_ddr(void *extram)
 		exit(1);
 	}
 
-	mem = mmap(0, 0x0FFFFFFF, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)extram);
-	if (mem == NULL) {
+	mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)extram);
+	if (mem == MAP_FAILED) {
 		printf("Failed to map the device (%s)\n", strerror(errno));
 		close(fd);
 		exit(1);
 	}
 
+	/* The mapping stays valid */
+	close(fd);
+
 	return mem;
 }
+#endif /* NO_PRUSSDRV */
 
 int send_extmem_addr_to_pru(void *pru0_priv_mem, void *addr, size_t sz)
 {
-	void **pru_priv_mem = (void **) pru0_priv_mem;
+	uint32_t *pru_priv_mem = (uint32_t *) pru0_priv_mem;
 
-	/* We are sending data to the PRU in two 32 bit slots at its address
-	 * 0x0 (the beginning of its address space) The first slot (0x0) is the address
-	 * of the buffer space, the second is the size of the buffer space (0x4).  The
-	 * size of the buffer space is expressed as a power of 2.
+	/* We are sending data to the PRU in 32 bit slots at its address
+	 * 0x8: the address of the buffer space, the size of the buffer space (0xc),
+	 * expressed as a power of 2, the delay (0x10) and the number of bytes
+	 * between two events to the host (0x14), 0 when we spin instead.
 	 */
-	pru_priv_mem[2] = addr;
-	((uint32_t *)pru_priv_mem)[3] = sz;
-	((uint32_t *)pru_priv_mem)[4] = flag_capture_choke;
+	pru_priv_mem[2] = (uint32_t) (uintptr_t) addr;
+	pru_priv_mem[3] = sz;
+	pru_priv_mem[4] = flag_capture_choke;
+	pru_priv_mem[5] = flag_wait_mode == WAIT_EVENT ? flag_watermark : 0;
 
 	return 0;
 }
 
 void usage(const char *progname)
 {
-	fprintf(stderr, "Usage: %s [ --test-mode ] [ --capture-choke=CHOKE ] [ OUTPUT_FILE ]\n", progname);
+	fprintf(stderr, "Usage: %s [ --test-mode ] [ --capture-choke=CHOKE ] [ --channels=MASK ]\n", progname);
+	fprintf(stderr, "       [ --simulate [ --sim-rate=SAMPLES_PER_SEC ] [ --sim-ring-size=BYTES ] ]\n");
+	fprintf(stderr, "       [ --workers=N ] [ --queue-blocks=N ] [ --block-size=BYTES ]\n");
+	fprintf(stderr, "       [ --wait=spin|event|timed ] [ --watermark=BYTES ]\n");
+	fprintf(stderr, "       [ --format=packed|edges|raw ] [ --bare ] [ --resync ]\n");
+	fprintf(stderr, "       [ --writer=auto|uring|threads ] [ --writer-threads=N ] [ --direct ]\n");
+	fprintf(stderr, "       [ --write-buffers=N ] [ --write-buffer-size=BYTES ] [ --preallocate=BYTES ]\n");
+	fprintf(stderr, "       [ --trigger=SPEC [ --pre-trigger=SAMPLES ] [ --post-trigger=SAMPLES ] ]\n");
+	fprintf(stderr, "       [ --stats=FILE|unix:PATH|- [ --stats-interval=MS ] ]\n");
+	fprintf(stderr, "       [ --live=SOCKET [ --live-slots=N ] ] [ --compress=bitrun|lz4 ]\n");
+	fprintf(stderr, "       [ --realtime [ --rt-cpu=N ] [ --rt-priority=N ] ] [ --profile=PROFILE ]\n");
+	fprintf(stderr, "       [ --anchor-interval=MS ]\n");
+	fprintf(stderr, "       [ --segment-size=BYTES ] [ --segment-duration=SECONDS ] [ --disk-budget=BYTES ]\n");
+	fprintf(stderr, "       [ --decimate=N ] [ --deglitch=SAMPLES ]\n");
+	fprintf(stderr, "       [ --duration=SECONDS ] [ OUTPUT_FILE ]\n");
+	fprintf(stderr, "       %s --calibrate=PROFILE [ --calibrate-range=MIN:MAX ]\n", progname);
+	fprintf(stderr, "       [ --calibrate-duration=SECONDS ] [ capture options ]\n");
 	fprintf(stderr, "       %s -h | --help\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Sample data from the GPIO and it to OUTPUT_FILE\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "MASK selects which bits of r31 are kept (default 0x%x). With several\n", DEFAULT_CHANNEL_MASK);
+	fprintf(stderr, "channels, every 32 samples give one packed word per channel, lowest bit first.\n");
+	fprintf(stderr, "--format=edges only stores the samples where a channel changes (see edges.h).\n");
+	fprintf(stderr, "--format=raw stores whole r31 words, as tools/pru2raw reads them, without\n");
+	fprintf(stderr, "packing or checking them (see rawout.h); MASK doesn't apply and it is always bare.\n");
+	fprintf(stderr, "The output is wrapped in a seekable container recording the capture settings\n");
+	fprintf(stderr, "and start time (see capfile.h); --bare writes the payload alone. Every\n");
+	fprintf(stderr, "--anchor-interval ms (default %" PRIu32 ", 0 for never), the container records which\n",
+		flag_anchor_interval);
+	fprintf(stderr, "sample the PRU is at, so that the tools can tell the time of any sample.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--simulate replaces the PRU by a thread running the same protocol, at the rate\n");
+	fprintf(stderr, "the PRU would reach with CHOKE unless --sim-rate is given.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The ring is copied into --queue-blocks blocks of --block-size bytes per worker\n");
+	fprintf(stderr, "thread; the workers pack and write them while the main thread keeps polling.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "By default the main thread spins on the PRU counters. --wait=event makes the\n");
+	fprintf(stderr, "PRU raise PRU_EVTOUT_0 every --watermark bytes and sleeps until then;\n");
+	fprintf(stderr, "--wait=timed sleeps for the time the PRU should take to write that much.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "An overrun of the ring ends the capture, unless --resync is given: the\n");
+	fprintf(stderr, "capture then resumes at the PRU's current position and the lost samples are\n");
+	fprintf(stderr, "recorded as a gap.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The output goes through --write-buffers buffers of --write-buffer-size bytes,\n");
+	fprintf(stderr, "written in the background through io_uring or --writer-threads threads.\n");
+	fprintf(stderr, "--direct bypasses the page cache; --preallocate reserves disk space up front.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--trigger only keeps the samples around events, from --pre-trigger samples\n");
+	fprintf(stderr, "before each (default %" PRIu64 ") to --post-trigger samples after it (default %" PRIu64 "),\n",
+		flag_trigger.pre, flag_trigger.post);
+	fprintf(stderr, "and re-arms once they are stored. SPEC is one of:\n");
+	fprintf(stderr, "  edge:BIT[:rising|falling|both]  an edge on r31 bit BIT (default rising)\n");
+	fprintf(stderr, "  pattern:MASK:VALUE               the bits in MASK becoming equal to VALUE\n");
+	fprintf(stderr, "  pulse:BIT:high|low:MIN:MAX       a pulse shorter than MIN or longer than MAX\n");
+	fprintf(stderr, "                                   samples; MAX 0 means no upper limit\n");
+	fprintf(stderr, "Samples that aren't kept are recorded as gaps.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--stats writes live statistics as one JSON object per line, every\n");
+	fprintf(stderr, "--stats-interval ms (default %" PRIu32 "), to FILE, to the Unix stream socket\n",
+		flag_stats_interval);
+	fprintf(stderr, "listening at PATH, or to stdout.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--live publishes the packed capture in a shared memory ring of --live-slots\n");
+	fprintf(stderr, "blocks, which decode --live=SOCKET and display --live=SOCKET attach to while\n");
+	fprintf(stderr, "it runs. Readers that fall behind lose blocks; the capture never waits.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--compress compresses every container chunk in the workers: bitrun stores the\n");
+	fprintf(stderr, "run lengths of each channel (packed format only), lz4 is the LZ4 block format.\n");
+	fprintf(stderr, "Chunks that don't get smaller are stored as they are (see codec.h).\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--realtime pins the polling thread to --rt-cpu (default the last CPU), runs it\n");
+	fprintf(stderr, "at SCHED_FIFO --rt-priority (default %d) and locks and pre-faults all memory,\n",
+		flag_rt_priority);
+	fprintf(stderr, "the ring included. The summary gives the longest gap between two polls and\n");
+	fprintf(stderr, "the smallest ring that would have absorbed it at the CHOKE's rate.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--calibrate looks for the smallest CHOKE between MIN and MAX (default %d:%d)\n",
+		flag_calibrate_min, flag_calibrate_max);
+	fprintf(stderr, "with which test-pattern captures of --calibrate-duration seconds (default %d)\n",
+		flag_calibrate_duration);
+	fprintf(stderr, "run without overruns, given the other options, and saves it with the sample\n");
+	fprintf(stderr, "rate it measured to PROFILE. --profile loads CHOKE from PROFILE and records the\n");
+	fprintf(stderr, "measured rate rather than the nominal one; --capture-choke after it wins.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--segment-size and --segment-duration split the capture into containers\n");
+	fprintf(stderr, "OUTPUT_FILE.000000, OUTPUT_FILE.000001... of about that size or duration,\n");
+	fprintf(stderr, "listed in the manifest OUTPUT_FILE (see segments.h) which decode --manifest\n");
+	fprintf(stderr, "and display --manifest read. --disk-budget deletes the oldest segments to keep\n");
+	fprintf(stderr, "them all within BYTES.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--deglitch drops pulses shorter than SAMPLES (up to %d), delaying the edges\n",
+		FILTER_MAX_PULSE);
+	fprintf(stderr, "it keeps by SAMPLES - 1. --decimate keeps the majority of every N samples\n");
+	fprintf(stderr, "(2, 4, 8, 16 or 32) before anything is stored; the trigger, the live ring and\n");
+	fprintf(stderr, "the file all count samples at the lower rate (see filter.h).\n");
 }
 
-bool
-test_valid(void *mem, size_t len, size_t start_val)
-{
-	size_t i;
-	for (i = 0; i < len; i += 4) {
-		uint32_t *cur = (uint32_t *)(((uint8_t *) mem) + i);
-		if (*cur != start_val + i) {
-			ERROR("failed test - at offset %zu got %zu", start_val+i, *cur);
-			/* Don't exit yet, this could be due to an overrun */
-			return false;
-		}
-	}
-
-	return true;
-}
-
-int run(void)
+#ifndef NO_PRUSSDRV
+/* Brings up the PRU and maps its memories. The firmware is started later by
+ * pru_setup(), once the output is ready.
+ */
+static int pru_init(void **priv_mem_out, void **ddrmem_out, uint32_t *size_out,
+		int *event_fd_out)
 {
-	bool overrun = false;
-
 	if(geteuid()) {
 		ERROR("must be run as root in order to access PRU");
 		return -1;
@@ -354,14 +456,14 @@ int run(void)
 	}
 
 	void *extmem_addr;
-	size_t extmem_size;
+	uint32_t extmem_size;
 	if (get_extmem_address_from_module(&extmem_addr, &extmem_size) == -1) {
 		ERROR("failed to obtain extmem address");
 		return -1;
 	}
 
 	if (extmem_size < 8388608) {
-		ERROR("Buffer size is %zu, which is smaller than 8388608 bytes. Performance would suck.", extmem_size);
+		ERROR("Buffer size is %" PRIu32 ", which is smaller than 8388608 bytes. Performance would suck.", extmem_size);
 		return -1;
 	}
 
@@ -371,38 +473,318 @@ int run(void)
 		return -1;
 	}
 
-	void *ddrmem = get_designated_ddr(extmem_addr);
+	void *ddrmem = get_designated_ddr(extmem_addr, extmem_size);
 	if (ddrmem == NULL) {
 		ERROR("failed to get designated ddr memory");
 		return -1;
 	}
 
-	/* Open outfile */
-	struct bit_output *bitout = NULL;
-	if (flag_out_file) {
-		bitout = bit_output_create(flag_out_file);
-		if (bitout == NULL) {
-			perror("open");
-			return -1;
-		}
-	}
+	*priv_mem_out = pru0_priv_mem;
+	*ddrmem_out = ddrmem;
+	*size_out = extmem_size;
+	*event_fd_out = prussdrv_pru_event_fd(PRU_EVTOUT_0);
 
+	return 0;
+}
+
+/* The caller cleans up with pru_cleanup() if it fails */
+static int pru_start(void)
+{
 	/* initialize the library, PRU and interrupt; launch our PRU program */
 	if (flag_test_mode) {
 		if(pru_setup("./iorec-test.bin")) {
-			pru_cleanup();
 			return -1;
 		}
 	} else {
 		if(pru_setup("./iorec.bin")) {
-			pru_cleanup();
 			return -1;
 		}
 	}
 
+	return 0;
+}
+#endif /* NO_PRUSSDRV */
+
+/* Blocks until the producer signals that it crossed a watermark, or until
+ * timeout_ms expires in case an event got lost. The PRU's uio device hands out
+ * a 4 byte event count and the event must then be cleared in the INTC; the
+ * simulator's eventfd hands out 8 bytes.
+ */
+static void
+wait_for_event(int event_fd, bool is_sim, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = event_fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, timeout_ms) <= 0) {
+		return;
+	}
+
+	if (is_sim) {
+		uint64_t count;
+		if (read(event_fd, &count, sizeof(count)) == -1) {
+			perror("read");
+		}
+	} else {
+#ifndef NO_PRUSSDRV
+		uint32_t count;
+		if (read(event_fd, &count, sizeof(count)) == -1) {
+			perror("read");
+		}
+		prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+#endif
+	}
+}
+
+static uint64_t
+thread_cpu_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1) {
+		return 0;
+	}
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Records that the PRU had written `sample` samples by now */
+static void
+take_anchor(struct pipeline *pl, uint64_t sample)
+{
+	struct cap_anchor a = { .sample = sample };
+	struct timespec ts;
+
+	/* As close as possible to the counter read */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	a.monotonic_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	a.realtime_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	pipeline_anchor(pl, &a);
+}
+
+/* How a capture went, for --calibrate */
+struct run_result {
+	bool ok; /* no overruns, test pattern failures or write errors */
+	uint32_t n_overruns;
+	double sample_rate; /* measured */
+	uint64_t max_poll_gap_ns;
+	uint32_t ring_size;
+};
+
+/* Gives up on a capture once its pipeline exists, whether the producer has
+ * been started or not: stops them and closes the output without the index
+ * and footer.
+ */
+static void
+abandon_capture(struct pipeline *pl, struct segments *segments, int out_fd,
+		struct sim_pru *sim)
+{
+	pipeline_finish(pl, NULL);
+	pipeline_destroy(pl);
+	if (segments != NULL) {
+		segments_destroy(segments);
+	} else if (out_fd != -1) {
+		close(out_fd);
+	}
+
+	if (sim) {
+		sim_pru_destroy(sim);
+	} else {
+#ifndef NO_PRUSSDRV
+		if (pru_cleanup() < 0) {
+			ERROR("failure to cleanup PRU");
+		}
+#endif
+	}
+}
+
+/* Runs a capture. With res, fills it in instead of printing the summary. */
+int run(struct run_result *res)
+{
+	uint32_t n_overruns = 0;
+	void *pru0_priv_mem;
+	void *ddrmem;
+	uint32_t extmem_size;
+	int event_fd = -1;
+	struct sim_pru *sim = NULL;
+
+	/* Expected sample rate, used to pace the timed wait mode */
+	double rate = sim_pru_rate_for_choke(flag_capture_choke);
+	if (flag_have_profile && flag_profile.capture_choke == flag_capture_choke
+		&& flag_profile.sample_rate > 0)
+	{
+		rate = flag_profile.sample_rate;
+	}
+
+	if (flag_simulate) {
+		if (flag_sim_rate > 0) {
+			rate = flag_sim_rate;
+		}
+
+		sim = sim_pru_create(flag_sim_ring_size, rate, flag_test_mode);
+		if (sim == NULL) {
+			return -1;
+		}
+
+		pru0_priv_mem = sim_pru_get_priv_mem(sim);
+		ddrmem = sim_pru_get_ring(sim);
+		extmem_size = flag_sim_ring_size;
+		event_fd = sim_pru_event_fd(sim);
+
+		if (send_extmem_addr_to_pru(pru0_priv_mem, NULL, extmem_size) == -1) {
+			return -1;
+		}
+	} else {
+#ifdef NO_PRUSSDRV
+		ERROR("built without prussdrv, only --simulate is available");
+		return -1;
+#else
+		if (pru_init(&pru0_priv_mem, &ddrmem, &extmem_size, &event_fd) == -1) {
+			return -1;
+		}
+#endif
+	}
+
+	/* Open outfile */
+	int out_fd = -1;
+	struct segments *segments = NULL;
+	if (flag_out_file && (flag_segment_size || flag_segment_duration)) {
+		struct segment_config sc = {
+			.path = flag_out_file,
+			.max_bytes = flag_segment_size,
+			.max_seconds = flag_segment_duration,
+			.budget = flag_disk_budget,
+		};
+		segments = segments_create(&sc);
+		if (segments == NULL || (out_fd = segments_open(segments, 0)) == -1) {
+			return -1;
+		}
+	} else if (flag_out_file) {
+		out_fd = open(flag_out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd == -1) {
+			perror("open");
+			return -1;
+		}
+	}
+
+	const char *bitpack_impl = bitpack_init();
+
+	struct pipeline_config plc = {
+		.fd = out_fd,
+		.format = flag_format,
+		.container = !flag_bare && flag_format != OUTPUT_RAW,
+		.compress = flag_compress,
+		.channel_mask = flag_channel_mask,
+		.test_mode = flag_test_mode,
+		.n_workers = flag_workers,
+		.n_blocks = flag_queue_blocks,
+		.block_size = flag_block_size,
+		.writer = {
+			.backend = flag_writer,
+			.n_buffers = flag_write_buffers,
+			.buffer_size = flag_write_buffer_size,
+			.n_threads = flag_writer_threads,
+			.direct = flag_direct,
+			.preallocate = flag_preallocate,
+		},
+		.filter = flag_filter,
+		.trigger = flag_trigger,
+		.live_path = flag_live,
+		.live_slots = flag_live_slots,
+		.segments = segments,
+	};
+	struct pipeline *pl = pipeline_create(&plc);
+	if (pl == NULL) {
+		return -1;
+	}
+
+	struct telemetry *telemetry = NULL;
+	struct poll_counters *pc = NULL;
+	if (flag_stats) {
+		struct telemetry_config tc = {
+			.dest = flag_stats,
+			.interval_ms = flag_stats_interval,
+			.ring_size = extmem_size,
+			.byte_rate = rate * 4,
+			.pl = pl,
+		};
+		telemetry = telemetry_create(&tc);
+		if (telemetry == NULL) {
+			abandon_capture(pl, segments, out_fd, sim);
+			return -1;
+		}
+		pc = telemetry_counters(telemetry);
+	}
+
+	int start_result = 0;
+	if (sim) {
+		start_result = sim_pru_start(sim);
+	} else {
+#ifndef NO_PRUSSDRV
+		start_result = pru_start();
+#endif
+	}
+	if (start_result == -1) {
+		if (telemetry != NULL) {
+			telemetry_destroy(telemetry);
+		}
+		abandon_capture(pl, segments, out_fd, sim);
+		return -1;
+	}
+
+	/* Time the producer takes to write a watermark's worth of samples */
+	uint64_t watermark_ns = flag_watermark / 4 / rate * 1e9;
+	int event_timeout_ms = watermark_ns * 4 / 1000000;
+	if (event_timeout_ms < 10) {
+		event_timeout_ms = 10;
+	}
+
 	uint64_t t1,t2;
+	uint64_t cpu1,cpu2;
 
 	t1 = clock_get_rel_time();
+	cpu1 = thread_cpu_time();
+
+	struct capture_info info;
+	struct timespec realtime;
+	memset(&info, 0, sizeof(info));
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	info.capture_choke = flag_capture_choke;
+	info.sample_rate = rate;
+	info.start_monotonic_ns = t1;
+	info.start_realtime_ns = (uint64_t) realtime.tv_sec * 1000000000 + realtime.tv_nsec;
+	if (pipeline_start(pl, &info) == -1) {
+		ERROR("failed to write the capture header");
+		if (telemetry != NULL) {
+			telemetry_destroy(telemetry);
+		}
+		abandon_capture(pl, segments, out_fd, sim);
+		return -1;
+	}
+
+	if (flag_duration > 0) {
+		alarm(flag_duration);
+	}
+
+	/* Last, so that none of the other threads inherit it */
+	int rt_cpu = -1;
+	if (flag_realtime) {
+		struct realtime_config rc = {
+			.cpu = flag_rt_cpu,
+			.priority = flag_rt_priority,
+		};
+		rt_cpu = realtime_enter(&rc);
+		if (rt_cpu == -1) {
+			if (telemetry != NULL) {
+				telemetry_destroy(telemetry);
+			}
+			abandon_capture(pl, segments, out_fd, sim);
+			return -1;
+		}
+		realtime_prefault(ddrmem, extmem_size);
+	}
+	uint64_t faults_start = realtime_thread_faults();
 
 	/* Address of the write counter which will be updated by the PRU
 	 * Its value is in bytes.
@@ -411,123 +793,208 @@ int run(void)
 	volatile uint32_t *after_write_counter_raw = &((volatile uint32_t *)pru0_priv_mem)[1];
 	*after_write_counter_raw = 0;
 
-	/* Do the acquisition */
-	uint32_t read_counter = 0;
-	uint32_t last_write_counter = 0;
-	uint32_t polls = 0;
+	/* Do the acquisition. The loop only copies ring data into the
+	 * pipeline; packing and writing happen in the worker threads.
+	 */
+	uint32_t read_counter = 0; /* write counter value of the next byte to copy */
+	uint64_t bytes_read = 0;
+	uint64_t bytes_lost = 0;
+	uint64_t polls = 0;
 	uint32_t max_buffer_use = 0;
+	uint64_t last_poll = 0, max_poll_gap = 0; /* ns */
+	/* How far the producer got between the first and last polls */
+	uint64_t first_poll = 0, counter_advance = 0;
+	uint32_t last_write_counter = 0;
+	uint64_t next_anchor = 0; /* ns */
+	double available_sum = 0, available_sq_sum = 0;
+	bool caught_up = false;
 	for (;;) {
-		if (interrupt_requested) {
+		if (interrupt_requested || pipeline_failed(pl)) {
 			break;
 		}
 
+		/* Only sleep when the last poll left nothing in the ring */
+		if (caught_up) {
+			if (flag_wait_mode == WAIT_EVENT) {
+				wait_for_event(event_fd, sim != NULL, event_timeout_ms);
+			} else if (flag_wait_mode == WAIT_TIMED) {
+				struct timespec ts = {
+					watermark_ns / 1000000000,
+					watermark_ns % 1000000000
+				};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		telemetry_poll_begin(pc);
+		uint64_t now = clock_get_rel_time();
+		if (polls && now - last_poll > max_poll_gap) {
+			max_poll_gap = now - last_poll;
+		}
+		last_poll = now;
 		polls++;
 
 		uint32_t write_counter;
 		write_counter = *after_write_counter_raw;
-
-
-		/* Offsets, in bytes */
-		off_t read_begin1 = last_write_counter % extmem_size;
-		off_t read_end1 = write_counter % extmem_size;
-		off_t read_begin2;
-		off_t read_end2;
-		if (read_begin1 > read_end1) {
-			read_begin2 = 0;
-			read_end2 = read_end1;
-			read_end1 = extmem_size;
+		if (polls == 1) {
+			first_poll = now;
 		} else {
-			read_begin2 = read_end1;
-			read_end2 = read_end1;
+			counter_advance += write_counter - last_write_counter;
+		}
+		last_write_counter = write_counter;
+		if (flag_anchor_interval && now >= next_anchor) {
+			/* read_counter is at byte bytes_read + bytes_lost */
+			take_anchor(pl, (bytes_read + bytes_lost + (write_counter - read_counter)) / 4);
+			next_anchor = now + flag_anchor_interval * 1000000ull;
 		}
 
-		bool test_succeeded = true;
-		int i;
-
-		if (read_end1 - read_begin1) {
-			if (bitout != NULL) {
-				/* FIXME: look for partial write()s */
-				for (i = read_begin1; i < read_end1; i+=4) {
-					uint32_t v1 = *(uint32_t *) (((uint8_t *)ddrmem) + i);
-					uint32_t v2 = (v1 >> 15) & 1;
-					if (bit_output_add(bitout, v2) == -1) {
-						perror("write");
-						return -1;
-					}
-				}
-			}
-
-			if (flag_test_mode) {
-				if (!test_valid(
-					((uint8_t *)ddrmem) + read_begin1,
-					read_end1 - read_begin1,
-					read_counter))
-				{
-					test_succeeded = false;
-				}
-			}
+		uint32_t available = write_counter - read_counter;
+		if (available > max_buffer_use) {
+			max_buffer_use = available;
 		}
-		if (read_end2 - read_begin2) {
-			if (bitout != NULL) {
-				for (i = read_begin2; i < read_end2; i+=4) {
-					uint32_t v1 = *(uint32_t *) (((uint8_t *)ddrmem) + i);
-					uint32_t v2 = (v1 >> 15) & 1;
-					if (bit_output_add(bitout, v2) == -1) {
-						perror("write");
-						return -1;
-					}
-				}
+		available_sum += available;
+		available_sq_sum += (double) available * available;
+
+		/* At most two parts, when the data wraps around the ring. If
+		 * every block is busy, what doesn't fit stays in the ring. */
+		uint32_t copied = 0;
+		while (copied < available) {
+			uint32_t begin = (read_counter + copied) % extmem_size;
+			uint32_t len = available - copied;
+			if (len > extmem_size - begin) {
+				len = extmem_size - begin;
 			}
 
-			if (flag_test_mode) {
-				if (!test_valid(
-					((uint8_t *)ddrmem) + read_begin2,
-					read_end2 - read_begin2,
-					read_counter + read_end1 - read_begin1))
-				{
-					test_succeeded = false;
-				}
+			size_t taken = pipeline_push(pl, ((uint8_t *)ddrmem) + begin,
+				len, read_counter + copied);
+			copied += taken;
+			if (taken < len) {
+				break;
 			}
 		}
 
-		if (write_counter - last_write_counter > max_buffer_use) {
-			max_buffer_use = write_counter - last_write_counter;
-		}
-
 		asm volatile("" ::: "memory");
 		uint32_t before_write_counter = *before_write_counter_raw;
 
-		if (before_write_counter > last_write_counter + extmem_size) {
-			ERROR("buffer overrun, diff is %" PRIu32, write_counter - last_write_counter);
-			overrun = true;
-			break;
-		}
+		/* The PRU must not have started writing over what we copied.
+		 * before_write trails read_counter by 4 when we are caught up,
+		 * hence the signed difference. */
+		if ((int32_t)(before_write_counter - read_counter) >= (int32_t)extmem_size) {
+			ERROR("buffer overrun, diff is %" PRIu32, before_write_counter - read_counter);
+			n_overruns++;
+			/* What was copied during this poll can't be trusted */
+			pipeline_discard(pl);
+			if (!flag_resync) {
+				telemetry_overrun(pc, 0);
+				telemetry_poll_end(pc, available, 0);
+				break;
+			}
 
-		if (!test_succeeded) {
-			ERROR("well the before write counter is %" PRIu32 ", the last_write_counter is %" PRIu32 " and extmem_size is %" PRIu32, write_counter, last_write_counter, extmem_size);
-			exit(1);
+			/* Start again from where the PRU is now */
+			uint32_t resume_counter = *after_write_counter_raw;
+			ERROR("resynchronizing, %" PRIu32 " samples lost",
+				(resume_counter - read_counter) / 4);
+			pipeline_skip(pl, resume_counter - read_counter);
+			bytes_lost += resume_counter - read_counter;
+			telemetry_overrun(pc, resume_counter - read_counter);
+			telemetry_poll_end(pc, available, 0);
+			read_counter = resume_counter;
+			caught_up = false;
+			continue;
 		}
-		
-		last_write_counter = write_counter;
 
-		read_counter = last_write_counter;
+		pipeline_commit(pl);
 
+		read_counter += copied;
+		bytes_read += copied;
+		caught_up = copied == available;
+		telemetry_poll_end(pc, available, copied);
 	}
 
 	t2 = clock_get_rel_time();
+	cpu2 = thread_cpu_time();
+	if (flag_anchor_interval) {
+		take_anchor(pl, (bytes_read + bytes_lost + (*after_write_counter_raw - read_counter)) / 4);
+	}
+	uint64_t faults = realtime_thread_faults() - faults_start;
 
-	printf("Summary: %" PRIu32 " bytes read in %f sec\n", read_counter, ((double)(t2-t1))/1000000000);
-	printf("         That's %.2f MB/second transferred from the PRU\n", ((double)read_counter)/(((double)(t2-t1))/1000));
-	printf("         That's %" PRIu32 " bytes/poll\n", read_counter/polls);
-	printf("         The max amount of buffer required was %" PRIu32 " bytes\n", max_buffer_use);
+	if (telemetry != NULL) {
+		telemetry_destroy(telemetry);
+	}
 
-	/* clear the event, disable the PRU and let the library clean up */
-	if (pru_cleanup() < 0) {
-		ERROR("failure to cleanup PRU");
-		return -1;
+	/* A byte waits in the ring from when it is written until the next poll.
+	 * Weighting each poll by the data it found, the mean wait is half of
+	 * sum(available^2)/sum(available), converted to time at the data rate.
+	 */
+	double byte_rate = bytes_read / ((double)(t2-t1) / 1e9);
+	double mean_latency_us = 0, max_latency_us = 0;
+	if (available_sum > 0 && byte_rate > 0) {
+		mean_latency_us = available_sq_sum / available_sum / 2 / byte_rate * 1e6;
+		max_latency_us = max_buffer_use / byte_rate * 1e6;
+	}
+
+	info.end_sample = (bytes_read + bytes_lost) / 4;
+	info.end_monotonic_ns = t2;
+	info.n_overruns = n_overruns;
+
+	bool pipeline_ok = pipeline_finish(pl, &info) == 0;
+	if (!pipeline_ok) {
+		ERROR("capture failed while processing the data");
+	}
+
+	if (res != NULL) {
+		res->ok = pipeline_ok && n_overruns == 0;
+		res->n_overruns = n_overruns;
+		res->sample_rate = last_poll > first_poll ?
+			counter_advance / 4 / ((last_poll - first_poll) / 1e9) : 0;
+		res->max_poll_gap_ns = max_poll_gap;
+		res->ring_size = extmem_size;
+	}
+
+	if (res == NULL) {
+		printf("Summary: %" PRIu64 " bytes read in %f sec\n", bytes_read, ((double)(t2-t1))/1000000000);
+		printf("         That's %.2f MB/second transferred from the PRU\n", ((double)bytes_read)/(((double)(t2-t1))/1000));
+		printf("         That's %" PRIu64 " bytes/poll\n", bytes_read/polls);
+		printf("         The max amount of buffer required was %" PRIu32 " bytes\n", max_buffer_use);
+		printf("         Bits were packed with the %s kernel\n", bitpack_impl);
+		printf("         The ring was read with %s\n", ddr_copy_method());
+		printf("         Wait mode %s: the polling thread used %.1f%% of a CPU\n",
+			wait_mode_names[flag_wait_mode], 100.0 * (cpu2 - cpu1) / (t2 - t1));
+		printf("         Data waited in the ring for %.1f us on average, %.1f us at most\n",
+			mean_latency_us, max_latency_us);
+		/* What the producer writes during the longest gap has to fit in the ring */
+		uint64_t min_ring = (uint64_t) (max_poll_gap / 1e9 * rate * 4);
+		printf("         The longest gap between two polls was %.1f us: at this choke, a ring of\n",
+			max_poll_gap / 1e3);
+		printf("         at least %" PRIu64 " bytes (this one is %" PRIu32 ") absorbs it\n",
+			min_ring, extmem_size);
+		if (flag_realtime) {
+			printf("         Realtime: polled on CPU %d at SCHED_FIFO priority %d, memory locked, %" PRIu64 " page faults while polling\n",
+				rt_cpu, flag_rt_priority, faults);
+		}
+		pipeline_print_summary(pl);
+	}
+
+	pipeline_destroy(pl);
+	if (segments != NULL) {
+		segments_destroy(segments);
+	} else if (out_fd != -1) {
+		close(out_fd);
+	}
+
+	if (sim) {
+		sim_pru_destroy(sim);
+	} else {
+#ifndef NO_PRUSSDRV
+		/* clear the event, disable the PRU and let the library clean up */
+		if (pru_cleanup() < 0) {
+			ERROR("failure to cleanup PRU");
+			return -1;
+		}
+#endif
 	}
 
-	if (overrun) {
+	if ((n_overruns && !flag_resync) || !pipeline_ok) {
 		return -1;
 	} else {
 		return 0;
@@ -540,6 +1007,46 @@ parse_opt(int argc, char **argv)
 	struct option opts[] = {
 		{ "test-mode", 0, NULL, 1 },
 		{ "capture-choke", 1, NULL, 2 },
+		{ "channels", 1, NULL, 3 },
+		{ "simulate", 0, NULL, 4 },
+		{ "sim-rate", 1, NULL, 5 },
+		{ "sim-ring-size", 1, NULL, 6 },
+		{ "duration", 1, NULL, 7 },
+		{ "workers", 1, NULL, 8 },
+		{ "queue-blocks", 1, NULL, 9 },
+		{ "block-size", 1, NULL, 10 },
+		{ "wait", 1, NULL, 11 },
+		{ "watermark", 1, NULL, 12 },
+		{ "format", 1, NULL, 13 },
+		{ "bare", 0, NULL, 14 },
+		{ "resync", 0, NULL, 15 },
+		{ "writer", 1, NULL, 16 },
+		{ "writer-threads", 1, NULL, 17 },
+		{ "write-buffers", 1, NULL, 18 },
+		{ "write-buffer-size", 1, NULL, 19 },
+		{ "direct", 0, NULL, 20 },
+		{ "preallocate", 1, NULL, 21 },
+		{ "trigger", 1, NULL, 22 },
+		{ "pre-trigger", 1, NULL, 23 },
+		{ "post-trigger", 1, NULL, 24 },
+		{ "stats", 1, NULL, 25 },
+		{ "stats-interval", 1, NULL, 26 },
+		{ "live", 1, NULL, 27 },
+		{ "live-slots", 1, NULL, 28 },
+		{ "compress", 1, NULL, 29 },
+		{ "realtime", 0, NULL, 30 },
+		{ "rt-cpu", 1, NULL, 31 },
+		{ "rt-priority", 1, NULL, 32 },
+		{ "calibrate", 1, NULL, 33 },
+		{ "calibrate-range", 1, NULL, 34 },
+		{ "calibrate-duration", 1, NULL, 35 },
+		{ "profile", 1, NULL, 36 },
+		{ "anchor-interval", 1, NULL, 37 },
+		{ "segment-size", 1, NULL, 38 },
+		{ "segment-duration", 1, NULL, 39 },
+		{ "disk-budget", 1, NULL, 40 },
+		{ "decimate", 1, NULL, 41 },
+		{ "deglitch", 1, NULL, 42 },
 		{ "help", 0, NULL, 'h' },
 		{ NULL, 0, NULL, 0 },
 	};
@@ -559,6 +1066,173 @@ parse_opt(int argc, char **argv)
 		case 2: /* test-mode */
 			flag_capture_choke = atoi(optarg);
 			break;
+		case 3: /* channels */
+			flag_channel_mask = strtoul(optarg, NULL, 0);
+			if (flag_channel_mask == 0) {
+				ERROR("channel mask must select at least one bit");
+				return false;
+			}
+			break;
+		case 4: /* simulate */
+			flag_simulate = true;
+			break;
+		case 5: /* sim-rate */
+			flag_sim_rate = atof(optarg);
+			break;
+		case 6: /* sim-ring-size */
+			flag_sim_ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 7: /* duration */
+			flag_duration = atoi(optarg);
+			break;
+		case 8: /* workers */
+			flag_workers = atoi(optarg);
+			break;
+		case 9: /* queue-blocks */
+			flag_queue_blocks = atoi(optarg);
+			break;
+		case 10: /* block-size */
+			flag_block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 11: /* wait */
+			if (strcmp(optarg, "spin") == 0) {
+				flag_wait_mode = WAIT_SPIN;
+			} else if (strcmp(optarg, "event") == 0) {
+				flag_wait_mode = WAIT_EVENT;
+			} else if (strcmp(optarg, "timed") == 0) {
+				flag_wait_mode = WAIT_TIMED;
+			} else {
+				ERROR("unknown wait mode %s", optarg);
+				return false;
+			}
+			break;
+		case 12: /* watermark */
+			flag_watermark = strtoul(optarg, NULL, 0);
+			break;
+		case 13: /* format */
+			if (strcmp(optarg, "packed") == 0) {
+				flag_format = OUTPUT_PACKED;
+			} else if (strcmp(optarg, "edges") == 0) {
+				flag_format = OUTPUT_EDGES;
+			} else if (strcmp(optarg, "raw") == 0) {
+				flag_format = OUTPUT_RAW;
+			} else {
+				ERROR("unknown output format %s", optarg);
+				return false;
+			}
+			break;
+		case 14: /* bare */
+			flag_bare = true;
+			break;
+		case 15: /* resync */
+			flag_resync = true;
+			break;
+		case 16: /* writer */
+			if (strcmp(optarg, "auto") == 0) {
+				flag_writer = WRITER_AUTO;
+			} else if (strcmp(optarg, "uring") == 0) {
+				flag_writer = WRITER_URING;
+			} else if (strcmp(optarg, "threads") == 0) {
+				flag_writer = WRITER_THREADS;
+			} else {
+				ERROR("unknown writer %s", optarg);
+				return false;
+			}
+			break;
+		case 17: /* writer-threads */
+			flag_writer_threads = atoi(optarg);
+			break;
+		case 18: /* write-buffers */
+			flag_write_buffers = atoi(optarg);
+			break;
+		case 19: /* write-buffer-size */
+			flag_write_buffer_size = strtoul(optarg, NULL, 0);
+			break;
+		case 20: /* direct */
+			flag_direct = true;
+			break;
+		case 21: /* preallocate */
+			flag_preallocate = strtoull(optarg, NULL, 0);
+			break;
+		case 22: /* trigger */
+			if (!trigger_parse(&flag_trigger, optarg)) {
+				return false;
+			}
+			break;
+		case 23: /* pre-trigger */
+			flag_trigger.pre = strtoull(optarg, NULL, 0);
+			break;
+		case 24: /* post-trigger */
+			flag_trigger.post = strtoull(optarg, NULL, 0);
+			break;
+		case 25: /* stats */
+			flag_stats = optarg;
+			break;
+		case 26: /* stats-interval */
+			flag_stats_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 27: /* live */
+			flag_live = optarg;
+			break;
+		case 28: /* live-slots */
+			flag_live_slots = atoi(optarg);
+			break;
+		case 29: /* compress */
+			if (strcmp(optarg, "bitrun") == 0) {
+				flag_compress = CAP_CODEC_BITRUN;
+			} else if (strcmp(optarg, "lz4") == 0) {
+				flag_compress = CAP_CODEC_LZ4;
+			} else {
+				ERROR("unknown codec %s", optarg);
+				return false;
+			}
+			break;
+		case 30: /* realtime */
+			flag_realtime = true;
+			break;
+		case 31: /* rt-cpu */
+			flag_rt_cpu = atoi(optarg);
+			break;
+		case 32: /* rt-priority */
+			flag_rt_priority = atoi(optarg);
+			break;
+		case 33: /* calibrate */
+			flag_calibrate = optarg;
+			break;
+		case 34: /* calibrate-range */
+			if (sscanf(optarg, "%d:%d", &flag_calibrate_min, &flag_calibrate_max) != 2) {
+				ERROR("--calibrate-range takes MIN:MAX");
+				return false;
+			}
+			break;
+		case 35: /* calibrate-duration */
+			flag_calibrate_duration = atoi(optarg);
+			break;
+		case 36: /* profile */
+			if (profile_load(optarg, &flag_profile) == -1) {
+				return false;
+			}
+			flag_have_profile = true;
+			flag_capture_choke = flag_profile.capture_choke;
+			break;
+		case 37: /* anchor-interval */
+			flag_anchor_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 38: /* segment-size */
+			flag_segment_size = strtoull(optarg, NULL, 0);
+			break;
+		case 39: /* segment-duration */
+			flag_segment_duration = strtoul(optarg, NULL, 0);
+			break;
+		case 40: /* disk-budget */
+			flag_disk_budget = strtoull(optarg, NULL, 0);
+			break;
+		case 41: /* decimate */
+			flag_filter.decimate = atoi(optarg);
+			break;
+		case 42: /* deglitch */
+			flag_filter.min_pulse = atoi(optarg);
+			break;
 		case 'h':
 			usage(argv[0]);
 			exit(0);
@@ -571,9 +1245,186 @@ parse_opt(int argc, char **argv)
 		flag_out_file = argv[optind];
 	}
 
+	if (flag_resync && flag_bare && flag_format == OUTPUT_PACKED) {
+		ERROR("bare packed output can't record gaps, --resync needs a container or --format=edges");
+		return false;
+	}
+	if (flag_format == OUTPUT_RAW && (flag_resync || flag_trigger.type != TRIGGER_NONE)) {
+		ERROR("raw output can't record gaps, it doesn't go with --resync or --trigger");
+		return false;
+	}
+	if (flag_format == OUTPUT_RAW && flag_live) {
+		ERROR("raw output isn't packed, it can't be published with --live");
+		return false;
+	}
+	if (flag_trigger.type != TRIGGER_NONE && flag_bare && flag_format == OUTPUT_PACKED) {
+		ERROR("bare packed output can't record gaps, --trigger needs a container or --format=edges");
+		return false;
+	}
+	if (flag_compress != CAP_CODEC_NONE && (flag_bare || flag_format == OUTPUT_RAW)) {
+		ERROR("only container chunks can be compressed, --compress doesn't go with --bare or --format=raw");
+		return false;
+	}
+	if (flag_compress == CAP_CODEC_BITRUN && flag_format != OUTPUT_PACKED) {
+		ERROR("--compress=bitrun only applies to the packed format");
+		return false;
+	}
+	if ((flag_segment_size || flag_segment_duration || flag_disk_budget)
+		&& (flag_bare || flag_format == OUTPUT_RAW || !flag_out_file))
+	{
+		ERROR("segments are containers in files, --segment-size and --segment-duration need an OUTPUT_FILE and don't go with --bare or --format=raw");
+		return false;
+	}
+	if (flag_disk_budget && !flag_segment_size && !flag_segment_duration) {
+		ERROR("--disk-budget needs --segment-size or --segment-duration");
+		return false;
+	}
+	if (flag_disk_budget && flag_disk_budget < 2 * flag_segment_size) {
+		ERROR("--disk-budget has to hold at least two segments");
+		return false;
+	}
+	if (flag_format == OUTPUT_RAW && (flag_filter.decimate != 1 || flag_filter.min_pulse != 1)) {
+		ERROR("raw output isn't packed, it can't be filtered");
+		return false;
+	}
+	if (flag_calibrate && (flag_out_file || flag_sim_rate > 0)) {
+		ERROR("--calibrate only runs test captures at the CHOKE's rate, without output");
+		return false;
+	}
+	if (flag_calibrate && (flag_calibrate_min < 1 || flag_calibrate_max < flag_calibrate_min
+		|| flag_calibrate_duration < 1))
+	{
+		ERROR("bad --calibrate-range or --calibrate-duration");
+		return false;
+	}
+	if (flag_wait_mode != WAIT_SPIN) {
+		/* pru_init() takes no ring smaller than 8388608 bytes */
+		uint32_t ring_size = flag_simulate ? flag_sim_ring_size : 8388608;
+		if (flag_watermark == 0 || flag_watermark % 4 || flag_watermark >= ring_size) {
+			ERROR("watermark must be a non-zero multiple of 4 smaller than the ring");
+			return false;
+		}
+	}
+	if (flag_realtime && (flag_rt_priority < 1 || flag_rt_priority > 99)) {
+		ERROR("--rt-priority must be between 1 and 99");
+		return false;
+	}
+	if (flag_realtime && flag_wait_mode == WAIT_SPIN && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+		/* A SCHED_FIFO thread that never sleeps would starve the workers */
+		ERROR("with a single CPU, --realtime needs --wait=event or --wait=timed");
+		return false;
+	}
+
 	return true;
 }
 
+/* Runs a test-pattern capture at the given choke in a child process, so that
+ * every trial starts from scratch: threads, realtime settings and the PRU.
+ */
+static int
+calibration_trial(int choke, struct run_result *res)
+{
+	int fds[2];
+	int status;
+
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		return -1;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		flag_capture_choke = choke;
+		flag_test_mode = true;
+		flag_duration = flag_calibrate_duration;
+		memset(res, 0, sizeof(*res));
+		run(res);
+		_exit(write(fds[1], res, sizeof(*res)) == sizeof(*res) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	ssize_t got = read(fds[0], res, sizeof(*res));
+	close(fds[0]);
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+	}
+
+	/* The child got the SIGINT too */
+	if (interrupt_requested) {
+		ERROR("calibration interrupted");
+		return -1;
+	}
+
+	if (got != sizeof(*res)) {
+		/* The trial bailed out before capturing anything */
+		memset(res, 0, sizeof(*res));
+	}
+
+	printf("choke %3d: %s, %.0f samples/s measured (%.0f nominal), longest poll gap %.1f us\n",
+		choke, res->ok ? "ok" : res->n_overruns ? "overrun" : "failed",
+		res->sample_rate, sim_pru_rate_for_choke(choke), res->max_poll_gap_ns / 1e3);
+
+	return 0;
+}
+
+/* Smaller chokes sample faster. Looks for the smallest one that passes,
+ * assuming that every larger one passes too.
+ */
+static int
+calibrate(void)
+{
+	struct run_result res, best;
+	int lo = flag_calibrate_min, hi = flag_calibrate_max;
+
+	if (calibration_trial(hi, &best) == -1) {
+		return -1;
+	}
+	if (!best.ok) {
+		ERROR("no choke between %d and %d captures without overruns", lo, hi);
+		return -1;
+	}
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (calibration_trial(mid, &res) == -1) {
+			return -1;
+		}
+
+		if (res.ok) {
+			hi = mid;
+			best = res;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	struct capture_profile profile = {
+		.capture_choke = hi,
+		.sample_rate = best.sample_rate,
+		.ring_size = best.ring_size,
+		.max_poll_gap_ns = best.max_poll_gap_ns,
+		.trial_seconds = flag_calibrate_duration,
+		.calibrated_realtime_s = time(NULL),
+	};
+	if (profile_save(flag_calibrate, &profile) == -1) {
+		return -1;
+	}
+
+	printf("Fastest choke without overruns: %d, %.0f samples/s; saved to %s\n",
+		hi, best.sample_rate, flag_calibrate);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	if (!parse_opt(argc, argv)) {
@@ -584,7 +1435,14 @@ int main(int argc, char **argv)
 
 	setup_signal_handler();
 
-	if (run() == -1) {
+	if (flag_calibrate) {
+		if (calibrate() == -1) {
+			exit(1);
+		}
+		return 0;
+	}
+
+	if (run(NULL) == -1) {
 		exit(1);
 	}
 
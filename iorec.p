@@ -4,6 +4,9 @@
 // Address for the Constant table Programmable Pointer Register 0(CTPPR_0)
 #define CTPPR_0         0x22028
 
+// System event raised towards the host, mapped to PRU_EVTOUT_0 by the INTC setup
+#define PRU0_ARM_INTERRUPT 19
+
 START:
     // Activate OCP port
     LBCO r0, C4, 4, 4
@@ -24,6 +27,8 @@ START:
                         // r3 = temporary var for computations in the loop
     LBCO r4, C28, 16, 4 // r4 = delay amount, passed by C code
     MOV r5, 0           // r5 = the relative counter; says the offset in the ddr region we're writing to next
+    MOV r6, 0           // r6 = bytes written since the last event to the host
+    LBCO r7, C28, 20, 4 // r7 = event watermark in bytes, 0 for no events, passed by C code
 
 loop1:
 
@@ -45,6 +50,14 @@ loop1:
 skip_reset:
     SBCO r0, C28, 4, 4  // the cumulative write count at offset 8 of private memory
 
+    // Raise PRU_EVTOUT_0 every r7 bytes so the host can sleep instead of spinning
+    QBEQ skip_event, r7, 0
+    ADD r6, r6, 4
+    QBNE skip_event, r6, r7
+    MOV r6, 0
+    MOV r31.b0, PRU0_ARM_INTERRUPT+16
+skip_event:
+
     // Prepare delay loop
     MOV r3, 0
 delay:
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "live.h"
+#include "livering.h"
+#include "log.h"
+
+struct live {
+	struct live_config cfg;
+	int n_channels;
+	int memfd;
+	struct live_header *hdr;
+	size_t map_len;
+	uint64_t head; /* writer's copy */
+
+	int listen_fd;
+	pthread_t thread;
+	bool started;
+	uint64_t n_readers;
+	uint64_t n_wakes;
+};
+
+/* Hands the memfd to every reader that connects */
+static void *
+live_accept_thread(void *arg)
+{
+	struct live *l = arg;
+
+	for (;;) {
+		int fd = accept4(l->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			/* The listening socket was shut down */
+			break;
+		}
+
+		char byte = 0;
+		struct iovec iov = { &byte, 1 };
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &l->memfd, sizeof(int));
+
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1) {
+			perror("sendmsg");
+		} else {
+			__atomic_add_fetch(&l->n_readers, 1, __ATOMIC_RELAXED);
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+struct live *
+live_create(const struct live_config *cfg)
+{
+	struct sockaddr_un addr;
+
+	if (cfg->n_slots < 2) {
+		ERROR("the live ring needs at least 2 slots");
+		return NULL;
+	}
+	if (strlen(cfg->path) >= sizeof(addr.sun_path)) {
+		ERROR("socket path too long: %s", cfg->path);
+		return NULL;
+	}
+
+	struct live *l = malloc(sizeof(*l));
+	if (l == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(l, 0, sizeof(*l));
+	l->cfg = *cfg;
+	l->n_channels = __builtin_popcount(cfg->channel_mask);
+	l->memfd = -1;
+	l->listen_fd = -1;
+
+	size_t slot_size = sizeof(struct live_slot) + cfg->max_groups * l->n_channels * sizeof(uint32_t);
+	slot_size = (slot_size + 63) / 64 * 64;
+	l->map_len = LIVE_HEADER_SIZE + cfg->n_slots * slot_size;
+
+	l->memfd = memfd_create("iorec-live", MFD_CLOEXEC);
+	if (l->memfd == -1) {
+		perror("memfd_create");
+		live_destroy(l);
+		return NULL;
+	}
+	if (ftruncate(l->memfd, l->map_len) == -1) {
+		perror("ftruncate");
+		live_destroy(l);
+		return NULL;
+	}
+	l->hdr = mmap(NULL, l->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, l->memfd, 0);
+	if (l->hdr == MAP_FAILED) {
+		perror("mmap");
+		l->hdr = NULL;
+		live_destroy(l);
+		return NULL;
+	}
+
+	memcpy(l->hdr->magic, LIVE_MAGIC, sizeof(l->hdr->magic));
+	l->hdr->version = LIVE_VERSION;
+	l->hdr->header_size = LIVE_HEADER_SIZE;
+	l->hdr->channel_mask = cfg->channel_mask;
+	l->hdr->n_slots = cfg->n_slots;
+	l->hdr->slot_size = slot_size;
+	l->hdr->pid = getpid();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, cfg->path);
+
+	l->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (l->listen_fd == -1) {
+		perror("socket");
+		live_destroy(l);
+		return NULL;
+	}
+	/* A socket left over by an earlier run would make bind() fail */
+	unlink(cfg->path);
+	if (bind(l->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+		|| listen(l->listen_fd, 8) == -1)
+	{
+		perror("bind");
+		live_destroy(l);
+		return NULL;
+	}
+
+	if (pthread_create(&l->thread, NULL, live_accept_thread, l) != 0) {
+		ERROR("failed to start live accept thread");
+		live_destroy(l);
+		return NULL;
+	}
+	l->started = true;
+
+	return l;
+}
+
+void
+live_set_start(struct live *l, double sample_rate, uint64_t start_monotonic_ns,
+		uint64_t start_realtime_ns)
+{
+	l->hdr->sample_rate = sample_rate;
+	l->hdr->start_monotonic_ns = start_monotonic_ns;
+	l->hdr->start_realtime_ns = start_realtime_ns;
+}
+
+static void
+live_wake(struct live *l)
+{
+	__atomic_store_n(&l->hdr->futex, (uint32_t) l->head, __ATOMIC_SEQ_CST);
+	/* Readers count themselves before checking the futex word */
+	if (__atomic_load_n(&l->hdr->waiters, __ATOMIC_SEQ_CST)) {
+		live_futex(&l->hdr->futex, FUTEX_WAKE, INT32_MAX, NULL);
+		l->n_wakes++;
+	}
+}
+
+void
+live_publish(struct live *l, const uint32_t *planes, size_t n_groups,
+		uint64_t first_sample)
+{
+	struct live_slot *slot = live_slot(l->hdr, l->head);
+	size_t len = n_groups * l->n_channels * sizeof(uint32_t);
+
+	if (len > l->hdr->slot_size - sizeof(*slot)) {
+		/* Can't happen with max_groups right */
+		ERROR("live slot too small, dropped %zu groups", n_groups);
+		return;
+	}
+
+	__atomic_store_n(&slot->seq, 2 * l->head + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->first_sample = first_sample;
+	slot->n_samples = n_groups * 32;
+	slot->payload_len = len;
+	memcpy(slot + 1, planes, len);
+	__atomic_store_n(&slot->seq, 2 * l->head + 2, __ATOMIC_RELEASE);
+
+	l->head++;
+	__atomic_store_n(&l->hdr->head, l->head, __ATOMIC_RELEASE);
+	live_wake(l);
+}
+
+void
+live_print_summary(struct live *l)
+{
+	printf("         Live: %" PRIu64 " blocks published to %" PRIu64 " reader(s), %" PRIu64 " wake-ups\n",
+		l->head, __atomic_load_n(&l->n_readers, __ATOMIC_RELAXED), l->n_wakes);
+}
+
+void
+live_destroy(struct live *l)
+{
+	if (l->started) {
+		shutdown(l->listen_fd, SHUT_RDWR);
+		pthread_join(l->thread, NULL);
+		unlink(l->cfg.path);
+	}
+	if (l->listen_fd != -1) {
+		close(l->listen_fd);
+	}
+
+	if (l->hdr != NULL) {
+		__atomic_store_n(&l->hdr->closed, 1, __ATOMIC_RELEASE);
+		/* Moves the futex word past what readers wait on */
+		__atomic_store_n(&l->hdr->futex, (uint32_t) l->head + 1, __ATOMIC_SEQ_CST);
+		live_futex(&l->hdr->futex, FUTEX_WAKE, INT32_MAX, NULL);
+		munmap(l->hdr, l->map_len);
+	}
+	if (l->memfd != -1) {
+		close(l->memfd);
+	}
+	free(l);
+}
@@ -0,0 +1,35 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Publishes the capture to local readers while it runs, see livering.h */
+
+struct live_config {
+	const char *path; /* Unix socket handing out the ring */
+	uint32_t channel_mask;
+	int n_slots;
+	size_t max_groups; /* the most groups of 32 samples published at once */
+};
+
+struct live;
+
+struct live *live_create(const struct live_config *cfg);
+
+/* Records what the readers need to convert sample numbers into time */
+void live_set_start(struct live *l, double sample_rate, uint64_t start_monotonic_ns,
+		uint64_t start_realtime_ns);
+
+/* Publishes n_groups groups of packed planes. Never blocks; called by one
+ * thread at a time, in capture order.
+ */
+void live_publish(struct live *l, const uint32_t *planes, size_t n_groups,
+		uint64_t first_sample);
+
+void live_print_summary(struct live *l);
+
+/* Tells the readers the capture is over and removes the socket */
+void live_destroy(struct live *l);
+
+#endif /* LIVE_H */
@@ -0,0 +1,72 @@
+#ifndef LIVERING_H
+#define LIVERING_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Live capture ring, shared between iorec and local readers (iorec --live,
+ * tools/liveinput.h).
+ *
+ * iorec publishes the packed planes it writes (see bitpack_planes()) into a
+ * ring of fixed-size slots in a memfd, which readers get from iorec's Unix
+ * socket. There is a single writer and it never waits for readers: every
+ * slot carries a sequence number, odd while it is written, and a reader
+ * compares it before and after copying a slot out to find out whether it was
+ * overwritten in the meantime. Readers that fall behind skip what they
+ * missed and count it as dropped.
+ *
+ * Readers that caught up sleep on the futex word, which follows the low 32
+ * bits of head. The writer only makes the wake-up call when the waiter count
+ * says someone is sleeping.
+ */
+
+#define LIVE_MAGIC "IORLIVE1"
+#define LIVE_VERSION 1
+
+struct live_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size; /* the first slot starts here */
+	uint32_t channel_mask;
+	uint32_t n_slots;
+	uint32_t slot_size; /* bytes, slot header included */
+	uint32_t pid; /* of the writer */
+	double sample_rate; /* nominal */
+	uint64_t start_monotonic_ns;
+	uint64_t start_realtime_ns;
+
+	/* Updated during the capture */
+	uint64_t head; /* slots published so far */
+	uint32_t futex;
+	uint32_t waiters;
+	uint32_t closed; /* set once the capture is over */
+	uint32_t reserved;
+};
+
+struct live_slot {
+	uint64_t seq; /* 2 * k + 1 while slot number k is written, 2 * k + 2 after */
+	uint64_t first_sample;
+	uint32_t n_samples;
+	uint32_t payload_len;
+	/* Followed by payload_len bytes of packed planes */
+};
+
+#define LIVE_HEADER_SIZE 128
+
+static inline long
+live_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static inline struct live_slot *
+live_slot(struct live_header *hdr, uint64_t k)
+{
+	return (struct live_slot *) ((uint8_t *) hdr + hdr->header_size
+		+ (k % hdr->n_slots) * (uint64_t) hdr->slot_size);
+}
+
+#endif /* LIVERING_H */
@@ -0,0 +1,1130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "pipeline.h"
+#include "bitpack.h"
+#include "spsc.h"
+#include "edges.h"
+#include "capfile.h"
+#include "ddrcopy.h"
+#include "writer.h"
+#include "trigger.h"
+#include "filter.h"
+#include "rawout.h"
+#include "live.h"
+#include "codec.h"
+#include "segments.h"
+#include "log.h"
+
+#define PIPELINE_IDLE_SLEEP_NS 50000
+#define PIPELINE_ANCHOR_SLOTS 64
+
+struct block {
+	uint8_t *data;
+	size_t len;
+	uint32_t counter; /* write counter of the first byte */
+	uint64_t offset; /* bytes captured before the first byte, lost ones included */
+	uint64_t seq;
+};
+
+struct worker {
+	struct pipeline *pl;
+	pthread_t thread;
+	bool started;
+	struct spsc_queue full; /* poller -> worker */
+	struct spsc_queue free; /* worker -> poller */
+	struct block *blocks;
+	uint32_t *out;
+	uint8_t *encoded; /* OUTPUT_EDGES only */
+	struct trigger_segment *segs; /* with a trigger only */
+	uint8_t *compressed; /* with compression only */
+	uint32_t *lz4_table;
+	uint32_t high_water; /* only touched by the poller */
+
+	/* Compression, only touched by this worker */
+	uint64_t codec_in;
+	uint64_t codec_out;
+	uint64_t codec_ns;
+	uint64_t codec_chunks;
+	uint64_t codec_stored; /* chunks that didn't get smaller */
+};
+
+struct pipeline {
+	struct pipeline_config cfg;
+	int n_channels;
+	struct worker *workers;
+	struct writer *writer; /* NULL when fd is -1 */
+	struct filter *filter; /* NULL when there's nothing to filter */
+	struct trigger *trigger; /* NULL to keep everything */
+	struct raw_output *raw; /* OUTPUT_RAW, NULL when fd is -1 */
+	struct live *live; /* NULL without live readers */
+
+	/* Poller side */
+	struct block *cur;
+	uint64_t next_seq;
+	uint64_t bytes_pushed;
+	struct block **pending;
+	int n_pending;
+	uint64_t stalls;
+
+	/* Anchors go from the poller to whoever writes next like blocks do, through
+	 * a free and a full queue */
+	struct cap_anchor *anchor_slots; /* container only */
+	struct spsc_queue anchors_full;
+	struct spsc_queue anchors_free;
+	uint64_t anchors_dropped;
+
+	/* State at the last commit, to roll back to on overruns */
+	uint64_t committed_pushed;
+	struct block *committed_cur;
+	size_t committed_len;
+	uint64_t valid_end; /* bytes, set by pipeline_discard() */
+	uint64_t samples_lost;
+
+	int done;
+	int failed;
+
+	struct capture_info info; /* from pipeline_start(), for segment headers */
+
+	/* Blocks are filtered, then written, in sequence order */
+	pthread_mutex_t write_lock;
+	pthread_cond_t write_cond;
+	uint64_t next_filter_seq;
+	uint64_t next_write_seq;
+
+	/* Only touched by the worker whose turn it is to write. With segments,
+	 * all but write_end and n_anchors_written are for the current one. */
+	uint64_t file_offset;
+	uint64_t samples_written;
+	uint64_t write_end; /* sample after the last one written */
+	uint32_t gaps_written;
+	uint32_t total_gaps_written; /* in all segments */
+	struct cap_index_entry *index;
+	uint64_t n_index;
+	uint64_t index_size;
+	struct cap_anchor *anchors;
+	uint64_t n_anchors;
+	uint64_t anchors_size;
+	uint64_t n_anchors_written;
+};
+
+static bool
+test_valid(void *mem, size_t len, size_t start_val)
+{
+	size_t i;
+	for (i = 0; i < len; i += 4) {
+		uint32_t *cur = (uint32_t *)(((uint8_t *) mem) + i);
+		if (*cur != (uint32_t)(start_val + i)) {
+			ERROR("failed test - at offset %zu got %" PRIu32, start_val+i, *cur);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+pipeline_fail(struct pipeline *pl)
+{
+	__atomic_store_n(&pl->failed, 1, __ATOMIC_RELEASE);
+}
+
+static void
+pipeline_idle(void)
+{
+	struct timespec ts = { 0, PIPELINE_IDLE_SLEEP_NS };
+	nanosleep(&ts, NULL);
+}
+
+/* Records the samples between the last chunk and the next one as lost */
+static int
+write_gap(struct pipeline *pl, uint64_t first_sample)
+{
+	struct cap_chunk_header hdr = {
+		.magic = CAP_CHUNK_MAGIC,
+		.payload_len = 0,
+		.first_sample = pl->write_end,
+		.n_samples = first_sample - pl->write_end,
+		.flags = CAP_CHUNK_GAP,
+	};
+
+	if (writer_append(pl->writer, &hdr, sizeof(hdr)) == -1) {
+		return -1;
+	}
+	pl->file_offset += sizeof(hdr);
+	pl->gaps_written++;
+	pl->total_gaps_written++;
+
+	return 0;
+}
+
+/* Writes the anchors from first on as one chunk */
+static int
+write_anchor_chunk(struct pipeline *pl, uint64_t first)
+{
+	if (pl->n_anchors == first) {
+		return 0;
+	}
+
+	struct cap_chunk_header hdr = {
+		.magic = CAP_CHUNK_MAGIC,
+		.payload_len = (pl->n_anchors - first) * sizeof(pl->anchors[0]),
+		.first_sample = pl->write_end,
+		.n_samples = 0,
+		.flags = CAP_CHUNK_ANCHORS,
+	};
+
+	if (writer_append(pl->writer, &hdr, sizeof(hdr)) == -1
+		|| writer_append(pl->writer, &pl->anchors[first], hdr.payload_len) == -1)
+	{
+		return -1;
+	}
+	pl->file_offset += sizeof(hdr) + hdr.payload_len;
+
+	return 0;
+}
+
+/* Writes the anchors the poller queued since the last call as one chunk,
+ * with the writing turn held
+ */
+static int
+write_anchors(struct pipeline *pl)
+{
+	struct cap_anchor *a;
+	uint64_t first = pl->n_anchors;
+
+	if (pl->anchor_slots == NULL) {
+		return 0;
+	}
+
+	while ((a = spsc_pop(&pl->anchors_full)) != NULL) {
+		if (pl->n_anchors == pl->anchors_size) {
+			uint64_t size = pl->anchors_size ? pl->anchors_size * 2 : 256;
+			struct cap_anchor *anchors = realloc(pl->anchors, size * sizeof(*anchors));
+			if (anchors == NULL) {
+				ERROR("out of memory");
+				return -1;
+			}
+			pl->anchors = anchors;
+			pl->anchors_size = size;
+		}
+		pl->anchors[pl->n_anchors++] = *a;
+		pl->n_anchors_written++;
+		spsc_push(&pl->anchors_free, a);
+	}
+
+	return write_anchor_chunk(pl, first);
+}
+
+/* Decimation divides every sample number downstream of the filter */
+static uint64_t
+filtered_sample(struct pipeline *pl, uint64_t sample)
+{
+	return pl->filter != NULL ? sample / pl->cfg.filter.decimate : sample;
+}
+
+static int
+write_header(struct pipeline *pl, uint64_t first_sample)
+{
+	struct cap_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAP_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAP_FILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.payload_format = pl->cfg.format == OUTPUT_EDGES ?
+		CAP_PAYLOAD_EDGES : CAP_PAYLOAD_PACKED;
+	hdr.channel_mask = pl->cfg.channel_mask;
+	hdr.capture_choke = pl->info.capture_choke;
+	hdr.samples_per_chunk = filtered_sample(pl, pl->cfg.block_size / 4);
+	hdr.sample_rate = pl->info.sample_rate;
+	hdr.start_monotonic_ns = pl->info.start_monotonic_ns;
+	hdr.start_realtime_ns = pl->info.start_realtime_ns;
+	hdr.first_sample = first_sample;
+
+	if (writer_append(pl->writer, &hdr, sizeof(hdr)) == -1) {
+		return -1;
+	}
+	pl->file_offset = sizeof(hdr);
+
+	return 0;
+}
+
+static int write_index(struct pipeline *pl, const struct capture_info *info,
+		uint32_t n_gaps);
+
+/* Ends the current segment where the capture has been written up to and goes
+ * on in the next one, with the writing turn held
+ */
+static int
+next_segment(struct pipeline *pl)
+{
+	struct capture_info info = pl->info;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	info.end_sample = pl->write_end;
+	info.end_monotonic_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	info.n_overruns = 0; /* only the poller knows */
+	if (write_index(pl, &info, pl->gaps_written) == -1) {
+		return -1;
+	}
+
+	int fd = segments_open(pl->cfg.segments, pl->write_end);
+	if (fd == -1 || writer_switch(pl->writer, fd) == -1
+		|| segments_close(pl->cfg.segments, pl->write_end) == -1)
+	{
+		return -1;
+	}
+
+	pl->samples_written = 0;
+	pl->gaps_written = 0;
+	pl->n_index = 0;
+	if (write_header(pl, pl->write_end) == -1) {
+		return -1;
+	}
+
+	/* Each segment keeps the last anchor before it, so that its start can
+	 * be timed on its own */
+	if (pl->n_anchors) {
+		pl->anchors[0] = pl->anchors[pl->n_anchors - 1];
+		pl->n_anchors = 1;
+	}
+
+	return write_anchor_chunk(pl, 0);
+}
+
+/* Called in sequence order, with the writing turn held */
+static int
+write_chunk(struct pipeline *pl, const void *payload, size_t len,
+		uint64_t first_sample, uint32_t n_samples, uint32_t flags)
+{
+	if (pl->cfg.segments != NULL && pl->n_index
+		&& segments_due(pl->cfg.segments, pl->file_offset))
+	{
+		if (next_segment(pl) == -1) {
+			return -1;
+		}
+	}
+
+	/* Bare edge files show gaps through the blocks' first_sample */
+	if (pl->cfg.container && first_sample > pl->write_end) {
+		if (write_gap(pl, first_sample) == -1) {
+			return -1;
+		}
+	}
+	pl->write_end = first_sample + n_samples;
+
+	if (pl->cfg.container) {
+		struct cap_chunk_header hdr = {
+			.magic = CAP_CHUNK_MAGIC,
+			.payload_len = len,
+			.first_sample = first_sample,
+			.n_samples = n_samples,
+			.flags = flags,
+		};
+
+		if (pl->n_index == pl->index_size) {
+			uint64_t size = pl->index_size ? pl->index_size * 2 : 1024;
+			struct cap_index_entry *index = realloc(pl->index, size * sizeof(*index));
+			if (index == NULL) {
+				ERROR("out of memory");
+				return -1;
+			}
+			pl->index = index;
+			pl->index_size = size;
+		}
+		pl->index[pl->n_index].first_sample = first_sample;
+		pl->index[pl->n_index].offset = pl->file_offset;
+		pl->n_index++;
+
+		if (writer_append(pl->writer, &hdr, sizeof(hdr)) == -1) {
+			return -1;
+		}
+		pl->file_offset += sizeof(hdr);
+	}
+
+	if (writer_append(pl->writer, payload, len) == -1) {
+		return -1;
+	}
+	pl->file_offset += len;
+	pl->samples_written += n_samples;
+
+	return 0;
+}
+
+static uint64_t
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ull + end->tv_nsec - start->tv_nsec;
+}
+
+/* Compresses the payload of a chunk of n_groups groups of planes into
+ * w->compressed. Returns the payload to write, and its length and chunk flags
+ * through len and flags: the original one if it didn't get smaller.
+ */
+static const void *
+compress_payload(struct worker *w, const void *payload, size_t *len,
+		const uint32_t *planes, size_t n_groups, uint32_t *flags)
+{
+	struct pipeline *pl = w->pl;
+	struct codec_header hdr = { .raw_len = *len };
+	struct timespec start, end;
+	size_t n;
+
+	*flags = 0;
+	if (pl->cfg.compress == CAP_CODEC_NONE || *len <= sizeof(hdr)) {
+		return payload;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint8_t *dst = w->compressed + sizeof(hdr);
+	size_t room = *len - sizeof(hdr);
+	if (pl->cfg.compress == CAP_CODEC_BITRUN) {
+		n = codec_bitrun_compress(dst, room, planes, n_groups, pl->n_channels);
+	} else {
+		n = codec_lz4_compress(dst, room, payload, *len, w->lz4_table);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	w->codec_ns += elapsed_ns(&start, &end);
+	w->codec_in += *len;
+	w->codec_chunks++;
+	if (n == 0) {
+		w->codec_out += *len;
+		w->codec_stored++;
+		return payload;
+	}
+
+	memcpy(w->compressed, &hdr, sizeof(hdr));
+	*len = sizeof(hdr) + n;
+	*flags = pl->cfg.compress << CAP_CHUNK_CODEC_SHIFT;
+	w->codec_out += *len;
+
+	return w->compressed;
+}
+
+/* Hands n_groups groups of planes to the live readers and their encoded
+ * form, out, to the file. With the writing turn held.
+ */
+static int
+output_groups(struct pipeline *pl, const uint32_t *planes, const void *out,
+		size_t out_len, uint64_t first_sample, size_t n_groups, uint32_t flags)
+{
+	if (pl->live != NULL) {
+		live_publish(pl->live, planes, n_groups, first_sample);
+	}
+
+	if (pl->writer != NULL) {
+		return write_chunk(pl, out, out_len, first_sample, n_groups * 32, flags);
+	}
+
+	return 0;
+}
+
+/* Writes the parts of the block the trigger keeps, with the writing turn held */
+static int
+write_triggered(struct worker *w, size_t n_groups, uint64_t first_sample)
+{
+	struct pipeline *pl = w->pl;
+	size_t n_segs, i;
+
+	n_segs = trigger_feed(pl->trigger, w->out, n_groups, first_sample, w->segs);
+
+	for (i = 0; i < n_segs; i++) {
+		const struct trigger_segment *seg = &w->segs[i];
+		const void *out = seg->planes;
+		size_t out_len = seg->n_groups * pl->n_channels * sizeof(w->out[0]);
+		uint32_t flags = 0;
+
+		if (pl->cfg.format == OUTPUT_EDGES && pl->writer != NULL) {
+			out = w->encoded;
+			out_len = edge_encode_block(w->encoded, seg->planes, seg->n_groups,
+				pl->n_channels, seg->first_sample);
+		}
+		if (pl->writer != NULL) {
+			/* Segments are only known in order, so this one is serial */
+			out = compress_payload(w, out, &out_len, seg->planes, seg->n_groups,
+				&flags);
+		}
+
+		if (output_groups(pl, seg->planes, out, out_len, seg->first_sample,
+				seg->n_groups, flags) == -1)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+worker_process(struct worker *w, struct block *b)
+{
+	struct pipeline *pl = w->pl;
+	size_t n_groups = b->len / 128;
+
+	if (pl->cfg.test_mode && !test_valid(b->data, b->len, b->counter)) {
+		pipeline_fail(pl);
+	}
+
+	if (pl->writer == NULL && pl->live == NULL) {
+		return;
+	}
+
+	bitpack_planes(w->out, (const uint32_t *) b->data, n_groups,
+		pl->cfg.channel_mask);
+
+	uint64_t first_sample = b->offset / 4;
+	if (pl->filter != NULL) {
+		/* The deglitcher carries state from block to block */
+		pthread_mutex_lock(&pl->write_lock);
+		while (pl->next_filter_seq != b->seq) {
+			pthread_cond_wait(&pl->write_cond, &pl->write_lock);
+		}
+		pthread_mutex_unlock(&pl->write_lock);
+
+		n_groups = filter_apply(pl->filter, w->out, n_groups, first_sample,
+			&first_sample);
+
+		pthread_mutex_lock(&pl->write_lock);
+		pl->next_filter_seq++;
+		pthread_cond_broadcast(&pl->write_cond);
+		pthread_mutex_unlock(&pl->write_lock);
+	}
+
+	const void *out = w->out;
+	size_t out_len = n_groups * pl->n_channels * sizeof(w->out[0]);
+	uint32_t flags = 0;
+	if (pl->trigger == NULL && pl->writer != NULL) {
+		if (pl->cfg.format == OUTPUT_EDGES) {
+			out = w->encoded;
+			out_len = edge_encode_block(w->encoded, w->out, n_groups,
+				pl->n_channels, first_sample);
+		}
+		/* Before waiting for the turn, so that workers compress in parallel */
+		out = compress_payload(w, out, &out_len, w->out, n_groups, &flags);
+	}
+
+	pthread_mutex_lock(&pl->write_lock);
+	while (pl->next_write_seq != b->seq) {
+		pthread_cond_wait(&pl->write_cond, &pl->write_lock);
+	}
+	pthread_mutex_unlock(&pl->write_lock);
+
+	if (!pipeline_failed(pl) && write_anchors(pl) == -1) {
+		pipeline_fail(pl);
+	}
+
+	if (pl->trigger != NULL) {
+		/* The trigger needs blocks in order too */
+		if (!pipeline_failed(pl) && write_triggered(w, n_groups, first_sample) == -1) {
+			pipeline_fail(pl);
+		}
+	} else if (!pipeline_failed(pl) && n_groups) {
+		if (output_groups(pl, w->out, out, out_len, first_sample, n_groups,
+				flags) == -1)
+		{
+			pipeline_fail(pl);
+		}
+	}
+
+	pthread_mutex_lock(&pl->write_lock);
+	pl->next_write_seq++;
+	pthread_cond_broadcast(&pl->write_cond);
+	pthread_mutex_unlock(&pl->write_lock);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct pipeline *pl = w->pl;
+
+	for (;;) {
+		struct block *b = spsc_pop(&w->full);
+		if (b == NULL) {
+			if (!__atomic_load_n(&pl->done, __ATOMIC_ACQUIRE)) {
+				pipeline_idle();
+				continue;
+			}
+			/* done is set after the last commit, so look once more */
+			b = spsc_pop(&w->full);
+			if (b == NULL) {
+				break;
+			}
+		}
+
+		worker_process(w, b);
+		spsc_push(&w->free, b);
+	}
+
+	return NULL;
+}
+
+struct pipeline *
+pipeline_create(const struct pipeline_config *cfg)
+{
+	int i, j;
+
+	if (cfg->block_size == 0 || cfg->block_size % 128) {
+		ERROR("block size must be a multiple of 128 bytes");
+		return NULL;
+	}
+	if (cfg->n_workers < 1 || cfg->n_blocks < 1
+		|| (cfg->n_blocks & (cfg->n_blocks - 1)))
+	{
+		ERROR("need at least one worker and a power of 2 number of blocks");
+		return NULL;
+	}
+
+	struct pipeline *pl = malloc(sizeof(*pl));
+	if (pl == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(pl, 0, sizeof(*pl));
+	pl->cfg = *cfg;
+	pl->n_channels = __builtin_popcount(cfg->channel_mask);
+	pthread_mutex_init(&pl->write_lock, NULL);
+	pthread_cond_init(&pl->write_cond, NULL);
+
+	if (cfg->format == OUTPUT_RAW) {
+		/* The poller hands ring data straight to the kernel: no blocks,
+		 * no workers */
+		pl->cfg.n_workers = 0;
+		if (cfg->fd != -1) {
+			pl->raw = raw_output_create(cfg->fd);
+			if (pl->raw == NULL) {
+				pipeline_destroy(pl);
+				return NULL;
+			}
+		}
+		return pl;
+	}
+
+	if (cfg->fd != -1) {
+		struct writer_config wc = cfg->writer;
+		wc.fd = cfg->fd;
+		pl->writer = writer_create(&wc);
+		if (pl->writer == NULL) {
+			pipeline_destroy(pl);
+			return NULL;
+		}
+	}
+
+	if (cfg->fd != -1 && cfg->container) {
+		pl->anchor_slots = calloc(PIPELINE_ANCHOR_SLOTS, sizeof(pl->anchor_slots[0]));
+		if (pl->anchor_slots == NULL
+			|| !spsc_init(&pl->anchors_full, PIPELINE_ANCHOR_SLOTS)
+			|| !spsc_init(&pl->anchors_free, PIPELINE_ANCHOR_SLOTS))
+		{
+			ERROR("out of memory");
+			pipeline_destroy(pl);
+			return NULL;
+		}
+		for (i = 0; i < PIPELINE_ANCHOR_SLOTS; i++) {
+			spsc_push(&pl->anchors_free, &pl->anchor_slots[i]);
+		}
+	}
+
+	size_t max_groups = cfg->block_size / 128;
+	if ((cfg->fd != -1 || cfg->live_path != NULL)
+		&& (cfg->filter.decimate > 1 || cfg->filter.min_pulse > 1))
+	{
+		if (max_groups % cfg->filter.decimate) {
+			ERROR("blocks must hold a multiple of 32 * %d samples to decimate by %d",
+				cfg->filter.decimate, cfg->filter.decimate);
+			pipeline_destroy(pl);
+			return NULL;
+		}
+		pl->filter = filter_create(&cfg->filter, cfg->channel_mask);
+		if (pl->filter == NULL) {
+			pipeline_destroy(pl);
+			return NULL;
+		}
+		max_groups /= cfg->filter.decimate;
+	}
+	size_t max_seg_groups = max_groups;
+	if ((cfg->fd != -1 || cfg->live_path != NULL) && cfg->trigger.type != TRIGGER_NONE) {
+		pl->trigger = trigger_create(&cfg->trigger, cfg->channel_mask, max_groups);
+		if (pl->trigger == NULL) {
+			pipeline_destroy(pl);
+			return NULL;
+		}
+		max_seg_groups = trigger_max_segment_groups(pl->trigger, max_groups);
+	}
+
+	if (cfg->live_path != NULL) {
+		struct live_config lc = {
+			.path = cfg->live_path,
+			.channel_mask = cfg->channel_mask,
+			.n_slots = cfg->live_slots,
+			.max_groups = max_seg_groups,
+		};
+		pl->live = live_create(&lc);
+		if (pl->live == NULL) {
+			pipeline_destroy(pl);
+			return NULL;
+		}
+	}
+
+	pl->pending = calloc(cfg->n_workers * cfg->n_blocks, sizeof(pl->pending[0]));
+	pl->workers = calloc(cfg->n_workers, sizeof(pl->workers[0]));
+	if (pl->pending == NULL || pl->workers == NULL) {
+		ERROR("out of memory");
+		pipeline_destroy(pl);
+		return NULL;
+	}
+
+	for (i = 0; i < cfg->n_workers; i++) {
+		struct worker *w = &pl->workers[i];
+		w->pl = pl;
+
+		if (!spsc_init(&w->full, cfg->n_blocks)
+			|| !spsc_init(&w->free, cfg->n_blocks))
+		{
+			ERROR("out of memory");
+			pipeline_destroy(pl);
+			return NULL;
+		}
+
+		w->out = malloc(cfg->block_size / 128 * pl->n_channels * sizeof(w->out[0]));
+		w->blocks = calloc(cfg->n_blocks, sizeof(w->blocks[0]));
+		if (cfg->format == OUTPUT_EDGES) {
+			w->encoded = malloc(edge_encode_max_size(max_seg_groups,
+				pl->n_channels));
+		}
+		if (pl->trigger != NULL) {
+			w->segs = calloc(trigger_max_segments(max_groups), sizeof(w->segs[0]));
+		}
+		if (cfg->compress != CAP_CODEC_NONE) {
+			/* Only kept when smaller than the payload, whose largest is
+			 * an edge encoding */
+			size_t max_payload = max_seg_groups * pl->n_channels * sizeof(uint32_t);
+			if (cfg->format == OUTPUT_EDGES) {
+				max_payload = edge_encode_max_size(max_seg_groups, pl->n_channels);
+			}
+			w->compressed = malloc(max_payload);
+			w->lz4_table = malloc(sizeof(w->lz4_table[0]) << CODEC_LZ4_HASH_BITS);
+		}
+		if (w->out == NULL || w->blocks == NULL
+			|| (cfg->format == OUTPUT_EDGES && w->encoded == NULL)
+			|| (pl->trigger != NULL && w->segs == NULL)
+			|| (cfg->compress != CAP_CODEC_NONE
+				&& (w->compressed == NULL || w->lz4_table == NULL)))
+		{
+			ERROR("out of memory");
+			pipeline_destroy(pl);
+			return NULL;
+		}
+
+		for (j = 0; j < cfg->n_blocks; j++) {
+			w->blocks[j].data = aligned_alloc(SPSC_CACHE_LINE, cfg->block_size);
+			if (w->blocks[j].data == NULL) {
+				ERROR("out of memory");
+				pipeline_destroy(pl);
+				return NULL;
+			}
+			spsc_push(&w->free, &w->blocks[j]);
+		}
+	}
+
+	for (i = 0; i < cfg->n_workers; i++) {
+		struct worker *w = &pl->workers[i];
+		if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+			ERROR("failed to start worker thread");
+			pipeline_finish(pl, NULL);
+			pipeline_destroy(pl);
+			return NULL;
+		}
+		w->started = true;
+	}
+
+	return pl;
+}
+
+int
+pipeline_start(struct pipeline *pl, const struct capture_info *info)
+{
+	pl->info = *info;
+	if (pl->filter != NULL) {
+		pl->info.sample_rate /= pl->cfg.filter.decimate;
+	}
+
+	if (pl->live != NULL) {
+		live_set_start(pl->live, pl->info.sample_rate, info->start_monotonic_ns,
+			info->start_realtime_ns);
+	}
+
+	if (pl->writer == NULL) {
+		return 0;
+	}
+
+	if (pl->cfg.container) {
+		if (write_header(pl, 0) == -1) {
+			return -1;
+		}
+	} else if (pl->cfg.format == OUTPUT_EDGES) {
+		struct edge_file_header hdr;
+		memcpy(hdr.magic, EDGE_FILE_MAGIC, sizeof(hdr.magic));
+		hdr.version = EDGE_FILE_VERSION;
+		hdr.channel_mask = pl->cfg.channel_mask;
+
+		if (writer_append(pl->writer, &hdr, sizeof(hdr)) == -1) {
+			return -1;
+		}
+		pl->file_offset = sizeof(hdr);
+	}
+
+	return 0;
+}
+
+static int
+write_index(struct pipeline *pl, const struct capture_info *info, uint32_t n_gaps)
+{
+	struct cap_index_header ihdr = {
+		.magic = CAP_INDEX_MAGIC,
+		.n_entries = pl->n_index,
+	};
+	struct cap_anchor_header ahdr = {
+		.magic = CAP_ANCHOR_MAGIC,
+		.n_entries = pl->n_anchors,
+	};
+	struct cap_footer footer;
+
+	memset(&footer, 0, sizeof(footer));
+	footer.index_offset = pl->file_offset;
+	footer.n_samples = pl->samples_written;
+	footer.end_sample = info->end_sample;
+	footer.end_monotonic_ns = info->end_monotonic_ns;
+	footer.n_overruns = info->n_overruns;
+	footer.n_gaps = n_gaps;
+	memcpy(footer.magic, CAP_FOOTER_MAGIC, sizeof(footer.magic));
+
+	if (writer_append(pl->writer, &ihdr, sizeof(ihdr)) == -1
+		|| writer_append(pl->writer, pl->index, pl->n_index * sizeof(pl->index[0])) == -1
+		|| writer_append(pl->writer, &ahdr, sizeof(ahdr)) == -1
+		|| writer_append(pl->writer, pl->anchors, pl->n_anchors * sizeof(pl->anchors[0])) == -1
+		|| writer_append(pl->writer, &footer, sizeof(footer)) == -1)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t
+pipeline_push(struct pipeline *pl, const void *data, size_t len, uint32_t counter)
+{
+	size_t taken = 0;
+
+	if (pl->cfg.format == OUTPUT_RAW) {
+		if (pl->raw != NULL && raw_output_write(pl->raw, data, len) == -1) {
+			pipeline_fail(pl);
+		}
+		pl->bytes_pushed += len;
+		return len;
+	}
+
+	while (taken < len) {
+		if (pl->cur == NULL) {
+			struct worker *w = &pl->workers[pl->next_seq % pl->cfg.n_workers];
+			struct block *b = spsc_pop(&w->free);
+			if (b == NULL) {
+				pl->stalls++;
+				break;
+			}
+
+			b->len = 0;
+			b->counter = counter + taken;
+			b->offset = pl->bytes_pushed + taken;
+			b->seq = pl->next_seq++;
+			pl->cur = b;
+		}
+
+		size_t n = len - taken;
+		if (n > pl->cfg.block_size - pl->cur->len) {
+			n = pl->cfg.block_size - pl->cur->len;
+		}
+
+		ddr_copy(pl->cur->data + pl->cur->len, (const uint8_t *) data + taken, n);
+		pl->cur->len += n;
+		taken += n;
+
+		if (pl->cur->len == pl->cfg.block_size) {
+			pl->pending[pl->n_pending++] = pl->cur;
+			pl->cur = NULL;
+		}
+	}
+
+	pl->bytes_pushed += taken;
+
+	return taken;
+}
+
+void
+pipeline_commit(struct pipeline *pl)
+{
+	int i;
+
+	for (i = 0; i < pl->n_pending; i++) {
+		struct block *b = pl->pending[i];
+		struct worker *w = &pl->workers[b->seq % pl->cfg.n_workers];
+
+		/* Cannot fail: the queue has room for all of the worker's blocks */
+		spsc_push(&w->full, b);
+
+		uint32_t depth = spsc_depth(&w->full);
+		if (depth > w->high_water) {
+			w->high_water = depth;
+		}
+	}
+
+	pl->n_pending = 0;
+	pl->committed_pushed = pl->bytes_pushed;
+	pl->committed_cur = pl->cur;
+	pl->committed_len = pl->cur ? pl->cur->len : 0;
+}
+
+void
+pipeline_discard(struct pipeline *pl)
+{
+	int i;
+
+	if (pl->cur != NULL) {
+		pl->pending[pl->n_pending++] = pl->cur;
+		pl->cur = NULL;
+	}
+
+	/* Blocks taken since the last commit still hold a turn to write, so
+	 * they go to their workers, emptied of what can't be trusted. */
+	for (i = 0; i < pl->n_pending; i++) {
+		struct block *b = pl->pending[i];
+		b->len = b == pl->committed_cur ? pl->committed_len : 0;
+	}
+
+	pl->valid_end = pl->committed_pushed;
+	if (pl->committed_cur != NULL) {
+		pl->valid_end = pl->committed_cur->offset + pl->committed_len / 128 * 128;
+	}
+	pl->bytes_pushed = pl->committed_pushed;
+
+	pipeline_commit(pl);
+}
+
+void
+pipeline_skip(struct pipeline *pl, uint64_t len)
+{
+	pl->bytes_pushed += len;
+	pl->committed_pushed = pl->bytes_pushed;
+	pl->samples_lost += (pl->bytes_pushed - pl->valid_end) / 4;
+}
+
+void
+pipeline_anchor(struct pipeline *pl, const struct cap_anchor *anchor)
+{
+	if (pl->anchor_slots == NULL) {
+		return;
+	}
+
+	struct cap_anchor *a = spsc_pop(&pl->anchors_free);
+	if (a == NULL) {
+		/* No block was written for PIPELINE_ANCHOR_SLOTS anchors */
+		pl->anchors_dropped++;
+		return;
+	}
+	*a = *anchor;
+	a->sample = filtered_sample(pl, anchor->sample);
+	spsc_push(&pl->anchors_full, a);
+}
+
+void
+pipeline_get_stats(struct pipeline *pl, struct pipeline_stats *st)
+{
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < pl->cfg.n_workers; i++) {
+		st->blocks_queued += spsc_depth(&pl->workers[i].full);
+	}
+	if (pl->writer != NULL) {
+		st->write_backlog = writer_backlog(pl->writer, &st->write_buffers);
+	}
+}
+
+bool
+pipeline_failed(struct pipeline *pl)
+{
+	return __atomic_load_n(&pl->failed, __ATOMIC_ACQUIRE);
+}
+
+int
+pipeline_finish(struct pipeline *pl, const struct capture_info *info)
+{
+	int i;
+
+	if (pl->cur != NULL && pl->cur->len) {
+		pl->pending[pl->n_pending++] = pl->cur;
+		pl->cur = NULL;
+	}
+	pipeline_commit(pl);
+
+	__atomic_store_n(&pl->done, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < pl->cfg.n_workers; i++) {
+		if (pl->workers[i].started) {
+			pthread_join(pl->workers[i].thread, NULL);
+			pl->workers[i].started = false;
+		}
+	}
+
+	if (!pipeline_failed(pl) && info != NULL && pl->cfg.container
+		&& pl->writer != NULL)
+	{
+		/* The workers are gone, the turn is ours */
+		struct capture_info end = *info;
+		end.end_sample = filtered_sample(pl, info->end_sample);
+		if (write_anchors(pl) == -1 || write_index(pl, &end, pl->gaps_written) == -1) {
+			pipeline_fail(pl);
+		}
+	}
+
+	if (pl->writer != NULL && writer_finish(pl->writer) == -1) {
+		pipeline_fail(pl);
+	}
+
+	if (pl->cfg.segments != NULL
+		&& segments_close(pl->cfg.segments,
+			info ? filtered_sample(pl, info->end_sample) : pl->write_end) == -1)
+	{
+		pipeline_fail(pl);
+	}
+
+	return pipeline_failed(pl) ? -1 : 0;
+}
+
+static void
+print_compression_summary(struct pipeline *pl)
+{
+	uint64_t in = 0, out = 0, ns = 0, chunks = 0, stored = 0;
+	int i;
+
+	for (i = 0; i < pl->cfg.n_workers; i++) {
+		struct worker *w = &pl->workers[i];
+		in += w->codec_in;
+		out += w->codec_out;
+		ns += w->codec_ns;
+		chunks += w->codec_chunks;
+		stored += w->codec_stored;
+	}
+
+	/* Throughput is per worker: ns adds up the time spent by all of them */
+	printf("         Compression (%s): %" PRIu64 " -> %" PRIu64 " bytes, ratio %.2f, %.1f MB/s per worker; %" PRIu64 " of %" PRIu64 " chunks stored as they were\n",
+		codec_name(pl->cfg.compress), in, out, out ? (double) in / out : 0.0,
+		ns ? in * 1000.0 / ns : 0.0, stored, chunks);
+}
+
+void
+pipeline_print_summary(struct pipeline *pl)
+{
+	int i;
+
+	if (pl->cfg.format == OUTPUT_RAW) {
+		if (pl->raw != NULL) {
+			raw_output_print_summary(pl->raw);
+		}
+		return;
+	}
+
+	printf("         Pipeline: %d worker(s), %d blocks of %zu bytes each; queue high-water marks:",
+		pl->cfg.n_workers, pl->cfg.n_blocks, pl->cfg.block_size);
+	for (i = 0; i < pl->cfg.n_workers; i++) {
+		printf(" %" PRIu32, pl->workers[i].high_water);
+	}
+	printf("\n");
+	printf("         %" PRIu64 " polls found every block busy\n", pl->stalls);
+	if (pl->writer != NULL) {
+		writer_print_summary(pl->writer);
+	}
+	if (pl->cfg.compress != CAP_CODEC_NONE) {
+		print_compression_summary(pl);
+	}
+	if (pl->filter != NULL) {
+		filter_print_summary(pl->filter);
+	}
+	if (pl->trigger != NULL) {
+		trigger_print_summary(pl->trigger);
+	}
+	if (pl->live != NULL) {
+		live_print_summary(pl->live);
+	}
+	if (pl->cfg.segments != NULL) {
+		segments_print_summary(pl->cfg.segments);
+	}
+	if (pl->anchor_slots != NULL) {
+		printf("         %" PRIu64 " timebase anchor(s) recorded, %" PRIu64 " dropped\n",
+			pl->n_anchors_written, pl->anchors_dropped);
+	}
+	printf("         %" PRIu32 " gap(s) in the capture, %" PRIu64 " samples lost to overruns (%.4f%%)\n",
+		pl->total_gaps_written, pl->samples_lost,
+		pl->bytes_pushed ? 100.0 * pl->samples_lost * 4 / pl->bytes_pushed : 0.0);
+}
+
+void
+pipeline_destroy(struct pipeline *pl)
+{
+	int i, j;
+
+	if (pl->workers != NULL) {
+		for (i = 0; i < pl->cfg.n_workers; i++) {
+			struct worker *w = &pl->workers[i];
+			if (w->blocks != NULL) {
+				for (j = 0; j < pl->cfg.n_blocks; j++) {
+					free(w->blocks[j].data);
+				}
+			}
+			free(w->blocks);
+			free(w->out);
+			free(w->encoded);
+			free(w->segs);
+			free(w->compressed);
+			free(w->lz4_table);
+			spsc_destroy(&w->full);
+			spsc_destroy(&w->free);
+		}
+	}
+
+	if (pl->writer != NULL) {
+		writer_destroy(pl->writer);
+	}
+	if (pl->filter != NULL) {
+		filter_destroy(pl->filter);
+	}
+	if (pl->trigger != NULL) {
+		trigger_destroy(pl->trigger);
+	}
+	if (pl->raw != NULL) {
+		raw_output_destroy(pl->raw);
+	}
+	if (pl->live != NULL) {
+		live_destroy(pl->live);
+	}
+	free(pl->workers);
+	free(pl->pending);
+	free(pl->index);
+	free(pl->anchors);
+	free(pl->anchor_slots);
+	spsc_destroy(&pl->anchors_full);
+	spsc_destroy(&pl->anchors_free);
+	pthread_mutex_destroy(&pl->write_lock);
+	pthread_cond_destroy(&pl->write_cond);
+	free(pl);
+}
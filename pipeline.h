@@ -0,0 +1,125 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "writer.h"
+#include "trigger.h"
+#include "filter.h"
+#include "codec.h"
+#include "capfile.h"
+#include "segments.h"
+
+/* Moves data from the poller (the thread watching the PRU counters) to worker
+ * threads which validate, pack and write it. The poller copies ring data into
+ * large blocks; block number k goes to worker k % n_workers through a
+ * lock-free SPSC queue, and comes back through another once processed.
+ * Workers pack in parallel but write in block order.
+ *
+ * With a filter (see filter.h), blocks also take their turn in order to go
+ * through it, right after packing; what comes after runs on the filtered
+ * planes, in the filtered sample numbering.
+ *
+ * The blocks are also where the uncached ring is staged: it is read once, in
+ * bursts (see ddrcopy.h), and validation, packing and encoding all run on the
+ * cached copy.
+ */
+
+enum output_format {
+	OUTPUT_PACKED = 0, /* one packed word per channel per 32 samples */
+	OUTPUT_EDGES, /* only the samples where a channel changes, see edges.h */
+	OUTPUT_RAW, /* whole r31 words, bare, written by the poller (see rawout.h) */
+};
+
+struct pipeline_config {
+	int fd; /* -1 to only run the checks */
+	enum output_format format;
+	bool container; /* wrap the output in the capfile.h container */
+	enum cap_codec compress; /* of container chunks, CAP_CODEC_NONE to not */
+	uint32_t channel_mask;
+	bool test_mode;
+	int n_workers;
+	int n_blocks; /* per worker */
+	size_t block_size; /* bytes, a multiple of 128 (32 samples) */
+	struct writer_config writer; /* its fd is taken from above */
+	struct filter_config filter; /* applied first, see filter.h */
+	struct trigger_config trigger; /* TRIGGER_NONE to keep every sample */
+	const char *live_path; /* socket for live readers (see live.h), or NULL */
+	int live_slots;
+	struct segments *segments; /* when fd is the first of several, or NULL */
+};
+
+/* What the container header and footer record about the capture */
+struct capture_info {
+	uint32_t capture_choke;
+	double sample_rate; /* nominal, or measured by --calibrate */
+	uint64_t start_monotonic_ns;
+	uint64_t start_realtime_ns;
+
+	/* Only known at the end */
+	uint64_t end_sample;
+	uint64_t end_monotonic_ns;
+	uint32_t n_overruns;
+};
+
+/* What is queued between the poller and the disk, see pipeline_get_stats() */
+struct pipeline_stats {
+	uint32_t blocks_queued; /* committed, not picked up by a worker yet */
+	int write_buffers; /* in flight in the writer */
+	uint64_t write_backlog; /* bytes in those buffers */
+};
+
+struct pipeline;
+
+struct pipeline *pipeline_create(const struct pipeline_config *cfg);
+
+/* Writes the file header. Called right after the producer is started. The
+ * header of later segments is made from the same info.
+ */
+int pipeline_start(struct pipeline *pl, const struct capture_info *info);
+
+/* Poller side. Copies up to len bytes of ring data whose first byte has write
+ * counter value `counter`. Returns how many bytes were taken, which is less
+ * than len when every block is busy; the rest should stay in the ring.
+ */
+size_t pipeline_push(struct pipeline *pl, const void *data, size_t len,
+		uint32_t counter);
+
+/* Poller side. Hands the blocks filled since the last commit to the workers.
+ * Called once the copied data is known not to have been overrun.
+ */
+void pipeline_commit(struct pipeline *pl);
+
+/* Poller side. Forgets the data pushed since the last commit. What was
+ * committed is kept, except for a trailing partial group of 32 samples.
+ */
+void pipeline_discard(struct pipeline *pl);
+
+/* Poller side, after pipeline_discard(). The next len bytes of the capture
+ * are lost; they are recorded as a gap and the next push starts a new block.
+ */
+void pipeline_skip(struct pipeline *pl, uint64_t len);
+
+/* Poller side. Queues a timebase anchor for the container (see capfile.h).
+ * Ignored without one; dropped if anchors come faster than blocks are written.
+ */
+void pipeline_anchor(struct pipeline *pl, const struct cap_anchor *anchor);
+
+/* Safe from any thread; the numbers are a snapshot */
+void pipeline_get_stats(struct pipeline *pl, struct pipeline_stats *st);
+
+/* True once a worker has hit an error (test pattern or write failure) */
+bool pipeline_failed(struct pipeline *pl);
+
+/* Commits the last partial block, waits for the workers to drain and writes
+ * the container index and footer. Samples after the last whole group of 32
+ * are dropped. info may be NULL when giving up on the capture.
+ */
+int pipeline_finish(struct pipeline *pl, const struct capture_info *info);
+
+void pipeline_print_summary(struct pipeline *pl);
+
+void pipeline_destroy(struct pipeline *pl);
+
+#endif /* PIPELINE_H */
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "profile.h"
+#include "log.h"
+
+int
+profile_save(const char *path, const struct capture_profile *p)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	fprintf(f, "# iorec --calibrate profile, load it with --profile\n");
+	fprintf(f, "capture_choke=%d\n", p->capture_choke);
+	fprintf(f, "sample_rate=%.1f\n", p->sample_rate);
+	fprintf(f, "ring_size=%" PRIu32 "\n", p->ring_size);
+	fprintf(f, "max_poll_gap_ns=%" PRIu64 "\n", p->max_poll_gap_ns);
+	fprintf(f, "trial_seconds=%d\n", p->trial_seconds);
+	fprintf(f, "calibrated_realtime_s=%" PRIu64 "\n", p->calibrated_realtime_s);
+
+	if (fclose(f) != 0) {
+		perror("fclose");
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+profile_load(const char *path, struct capture_profile *p)
+{
+	char line[256];
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	memset(p, 0, sizeof(*p));
+	p->capture_choke = -1;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *value = strchr(line, '=');
+		if (line[0] == '#' || value == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+
+		if (strcmp(line, "capture_choke") == 0) {
+			p->capture_choke = atoi(value);
+		} else if (strcmp(line, "sample_rate") == 0) {
+			p->sample_rate = atof(value);
+		} else if (strcmp(line, "ring_size") == 0) {
+			p->ring_size = strtoul(value, NULL, 0);
+		} else if (strcmp(line, "max_poll_gap_ns") == 0) {
+			p->max_poll_gap_ns = strtoull(value, NULL, 0);
+		} else if (strcmp(line, "trial_seconds") == 0) {
+			p->trial_seconds = atoi(value);
+		} else if (strcmp(line, "calibrated_realtime_s") == 0) {
+			p->calibrated_realtime_s = strtoull(value, NULL, 0);
+		}
+	}
+	fclose(f);
+
+	if (p->capture_choke < 1) {
+		ERROR("%s has no capture_choke", path);
+		return -1;
+	}
+
+	return 0;
+}
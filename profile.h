@@ -0,0 +1,25 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+/* What iorec --calibrate found, saved for later captures to load with
+ * --profile. The file is text, one key=value per line; lines starting with
+ * # and unknown keys are ignored.
+ */
+
+struct capture_profile {
+	int capture_choke; /* the fastest that ran without overruns */
+	double sample_rate; /* measured at that choke */
+	uint32_t ring_size;
+	uint64_t max_poll_gap_ns; /* during that trial */
+	int trial_seconds;
+	uint64_t calibrated_realtime_s; /* when */
+};
+
+int profile_save(const char *path, const struct capture_profile *p);
+
+/* Returns 0, or -1 if the file can't be read or has no capture_choke */
+int profile_load(const char *path, struct capture_profile *p);
+
+#endif /* PROFILE_H */
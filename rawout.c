@@ -0,0 +1,168 @@
+#define _GNU_SOURCE /* vmsplice(), splice(), F_SETPIPE_SZ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "rawout.h"
+#include "log.h"
+
+#define RAW_PIPE_SIZE 1048576
+
+struct raw_output {
+	int fd;
+	bool splice;
+	int pipe[2];
+	size_t pipe_size;
+	uint64_t bytes;
+	uint64_t calls; /* vmsplice() or write() */
+};
+
+struct raw_output *
+raw_output_create(int fd)
+{
+	struct stat st;
+
+	struct raw_output *ro = malloc(sizeof(*ro));
+	if (ro == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(ro, 0, sizeof(*ro));
+	ro->fd = fd;
+	ro->pipe[0] = ro->pipe[1] = -1;
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		free(ro);
+		return NULL;
+	}
+
+	if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+		return ro;
+	}
+
+	if (pipe2(ro->pipe, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return ro;
+	}
+
+	/* Bigger pipes mean fewer round trips; the default is 16 pages */
+	fcntl(ro->pipe[1], F_SETPIPE_SZ, RAW_PIPE_SIZE);
+	int size = fcntl(ro->pipe[1], F_GETPIPE_SZ);
+	ro->pipe_size = size > 0 ? size : 65536;
+	ro->splice = true;
+
+	return ro;
+}
+
+static int
+raw_output_write_plain(struct raw_output *ro, const uint8_t *p, size_t len)
+{
+	while (len) {
+		ssize_t n = write(ro->fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1) {
+			perror("write");
+			return -1;
+		}
+		ro->calls++;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Empties the pipe into the file */
+static int
+raw_output_drain(struct raw_output *ro, size_t len)
+{
+	while (len) {
+		ssize_t n = splice(ro->pipe[0], NULL, ro->fd, NULL, len, SPLICE_F_MOVE);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			perror("splice");
+			return -1;
+		}
+		len -= n;
+	}
+
+	return 0;
+}
+
+int
+raw_output_write(struct raw_output *ro, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (ro->splice && len) {
+		struct iovec iov = {
+			.iov_base = (void *) p,
+			.iov_len = len < ro->pipe_size ? len : ro->pipe_size,
+		};
+
+		ssize_t n = vmsplice(ro->pipe[1], &iov, 1, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1) {
+			if (ro->calls == 0) {
+				/* The memory can't be spliced, which we only learn
+				 * by trying */
+				ro->splice = false;
+				break;
+			}
+			perror("vmsplice");
+			return -1;
+		}
+		ro->calls++;
+
+		if (raw_output_drain(ro, n) == -1) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+		ro->bytes += n;
+	}
+
+	if (len) {
+		if (raw_output_write_plain(ro, p, len) == -1) {
+			return -1;
+		}
+		ro->bytes += len;
+	}
+
+	return 0;
+}
+
+const char *
+raw_output_method(struct raw_output *ro)
+{
+	return ro->splice ? "vmsplice" : "write";
+}
+
+void
+raw_output_print_summary(struct raw_output *ro)
+{
+	printf("         Raw output: %" PRIu64 " bytes in %" PRIu64 " %s calls\n",
+		ro->bytes, ro->calls, raw_output_method(ro));
+}
+
+void
+raw_output_destroy(struct raw_output *ro)
+{
+	if (ro->pipe[0] != -1) {
+		close(ro->pipe[0]);
+		close(ro->pipe[1]);
+	}
+	free(ro);
+}
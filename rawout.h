@@ -0,0 +1,33 @@
+#ifndef RAWOUT_H
+#define RAWOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Raw output: the ring's r31 words go to the output file unchanged, with no
+ * work per sample in user space. Ring pages are spliced into a pipe with
+ * vmsplice() and from there into the file with splice(), so the only copy is
+ * the kernel's, into the page cache. A write has completed that copy when
+ * it returns, so the ring can be reused right away.
+ *
+ * Pipes and sockets get plain write()s instead: splicing into them would only
+ * pass references to ring pages the PRU is about to overwrite. So does memory
+ * vmsplice() can't pin, like the uio mapping of the PRU's DDR ring; write()
+ * then copies straight from the mapping.
+ */
+
+struct raw_output;
+
+struct raw_output *raw_output_create(int fd);
+
+/* Moves all of data to the file. Returns 0, or -1 on errors. */
+int raw_output_write(struct raw_output *ro, const void *data, size_t len);
+
+/* "vmsplice" or "write", for display purposes */
+const char *raw_output_method(struct raw_output *ro);
+
+void raw_output_print_summary(struct raw_output *ro);
+
+void raw_output_destroy(struct raw_output *ro);
+
+#endif /* RAWOUT_H */
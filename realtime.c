@@ -0,0 +1,87 @@
+#define _GNU_SOURCE /* sched_setaffinity(), RUSAGE_THREAD */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "realtime.h"
+#include "log.h"
+
+/* Stack the poller may use without faulting once locked */
+#define REALTIME_STACK_PREFAULT 262144
+
+static void
+prefault_stack(void)
+{
+	volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += page) {
+		stack[i] = 0;
+	}
+}
+
+int
+realtime_enter(const struct realtime_config *cfg)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int cpu = cfg->cpu;
+
+	if (cpu < 0) {
+		cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		perror("sched_setaffinity");
+		ERROR("failed to pin the poller to CPU %d", cpu);
+		return -1;
+	}
+
+	/* Also makes every page mapped so far resident, buffers included */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("mlockall");
+		ERROR("failed to lock memory, check RLIMIT_MEMLOCK or run as root");
+		return -1;
+	}
+	prefault_stack();
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = cfg->priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+		perror("sched_setscheduler");
+		ERROR("failed to switch the poller to SCHED_FIFO priority %d", cfg->priority);
+		return -1;
+	}
+
+	return cpu;
+}
+
+void
+realtime_prefault(const void *mem, size_t len)
+{
+	const volatile uint8_t *p = mem;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	for (i = 0; i < len; i += page) {
+		(void) p[i];
+	}
+}
+
+uint64_t
+realtime_thread_faults(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) == -1) {
+		return 0;
+	}
+
+	return ru.ru_minflt + ru.ru_majflt;
+}
@@ -0,0 +1,32 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* iorec --realtime: keeps the poller from being preempted or stalled on page
+ * faults long enough to overrun the ring. The calling thread is pinned to
+ * one CPU and moved to SCHED_FIFO; all of the process's memory, present and
+ * future, is locked, which also faults in every buffer allocated so far.
+ * Threads started before realtime_enter() keep the default scheduler.
+ */
+
+struct realtime_config {
+	int cpu; /* -1 for the last online CPU */
+	int priority; /* SCHED_FIFO, 1 to 99 */
+};
+
+/* Returns the CPU the thread now runs on, or -1 if any of it failed (usually
+ * for lack of privileges).
+ */
+int realtime_enter(const struct realtime_config *cfg);
+
+/* Touches every page of len bytes at mem, reading only: for mappings like the
+ * PRU's DDR ring, which mlockall() doesn't fault in.
+ */
+void realtime_prefault(const void *mem, size_t len);
+
+/* Minor and major page faults taken by the calling thread so far */
+uint64_t realtime_thread_faults(void);
+
+#endif /* REALTIME_H */
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "segments.h"
+#include "log.h"
+
+struct segment {
+	uint32_t number;
+	int fd; /* -1 once closed */
+	uint64_t first_sample;
+	uint64_t end_sample;
+	uint64_t start_realtime_ns;
+	uint64_t end_realtime_ns;
+	uint64_t start_monotonic_ns;
+	uint64_t bytes;
+};
+
+struct segments {
+	struct segment_config cfg;
+	const char *dir_end; /* where the name starts in cfg.path */
+
+	/* Segments on disk, oldest first */
+	struct segment *list;
+	size_t n;
+	size_t size;
+	uint32_t next_number;
+
+	/* For the summary */
+	uint64_t bytes_on_disk;
+	uint64_t max_segment_bytes;
+	uint32_t n_deleted;
+	uint64_t bytes_deleted;
+};
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+segment_path(struct segments *sg, uint32_t number, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.%06" PRIu32, sg->cfg.path, number);
+}
+
+static int
+write_manifest(struct segments *sg)
+{
+	char tmp[4096];
+	size_t i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", sg->cfg.path);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	fprintf(f, "%s\n", SEGMENTS_MANIFEST_MAGIC);
+	fprintf(f, "# name first_sample end_sample start_realtime_ns end_realtime_ns bytes\n");
+	for (i = 0; i < sg->n; i++) {
+		const struct segment *s = &sg->list[i];
+		fprintf(f, "%s.%06" PRIu32 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+			sg->dir_end, s->number, s->first_sample, s->end_sample,
+			s->start_realtime_ns, s->end_realtime_ns, s->bytes);
+	}
+
+	if (fclose(f) != 0) {
+		perror("fclose");
+		return -1;
+	}
+	if (rename(tmp, sg->cfg.path) == -1) {
+		perror("rename");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct segments *
+segments_create(const struct segment_config *cfg)
+{
+	struct segments *sg = malloc(sizeof(*sg));
+	if (sg == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(sg, 0, sizeof(*sg));
+	sg->cfg = *cfg;
+	sg->dir_end = strrchr(cfg->path, '/');
+	sg->dir_end = sg->dir_end ? sg->dir_end + 1 : cfg->path;
+
+	return sg;
+}
+
+int
+segments_open(struct segments *sg, uint64_t first_sample)
+{
+	char path[4096];
+
+	if (sg->n == sg->size) {
+		size_t size = sg->size ? sg->size * 2 : 64;
+		struct segment *list = realloc(sg->list, size * sizeof(*list));
+		if (list == NULL) {
+			ERROR("out of memory");
+			return -1;
+		}
+		sg->list = list;
+		sg->size = size;
+	}
+
+	struct segment *s = &sg->list[sg->n];
+	memset(s, 0, sizeof(*s));
+	s->number = sg->next_number;
+	s->first_sample = first_sample;
+	s->start_realtime_ns = clock_ns(CLOCK_REALTIME);
+	s->start_monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+
+	segment_path(sg, s->number, path, sizeof(path));
+	s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (s->fd == -1) {
+		perror("open");
+		ERROR("failed to create segment %s", path);
+		return -1;
+	}
+	sg->n++;
+	sg->next_number++;
+
+	if (write_manifest(sg) == -1) {
+		return -1;
+	}
+
+	return s->fd;
+}
+
+bool
+segments_due(struct segments *sg, uint64_t bytes)
+{
+	const struct segment *s = &sg->list[sg->n - 1];
+
+	if (sg->cfg.max_bytes && bytes >= sg->cfg.max_bytes) {
+		return true;
+	}
+
+	return sg->cfg.max_seconds
+		&& clock_ns(CLOCK_MONOTONIC) - s->start_monotonic_ns
+			>= sg->cfg.max_seconds * 1000000000ull;
+}
+
+/* Deletes the oldest closed segments until the ones left, and one more as
+ * big as the largest so far, fit in the budget. Segments end after the chunk
+ * that crosses max_bytes, with the index and footer on top, so the next one
+ * can be bigger than max_bytes too.
+ */
+static void
+enforce_budget(struct segments *sg)
+{
+	char path[4096];
+	uint64_t next = sg->cfg.max_bytes > sg->max_segment_bytes ?
+		sg->cfg.max_bytes : sg->max_segment_bytes;
+
+	while (sg->n && sg->list[0].fd == -1 && sg->bytes_on_disk + next > sg->cfg.budget) {
+		struct segment *s = &sg->list[0];
+
+		segment_path(sg, s->number, path, sizeof(path));
+		if (unlink(path) == -1) {
+			perror("unlink");
+			ERROR("failed to delete segment %s, keeping it", path);
+			return;
+		}
+		sg->bytes_on_disk -= s->bytes;
+		sg->bytes_deleted += s->bytes;
+		sg->n_deleted++;
+
+		sg->n--;
+		memmove(&sg->list[0], &sg->list[1], sg->n * sizeof(sg->list[0]));
+	}
+}
+
+int
+segments_close(struct segments *sg, uint64_t end_sample)
+{
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < sg->n && sg->list[i].fd == -1; i++) {
+	}
+	if (i == sg->n) {
+		return 0;
+	}
+
+	struct segment *s = &sg->list[i];
+	if (fstat(s->fd, &st) == -1) {
+		perror("fstat");
+		return -1;
+	}
+	if (close(s->fd) == -1) {
+		perror("close");
+		return -1;
+	}
+	s->fd = -1;
+	s->end_sample = end_sample;
+	s->end_realtime_ns = clock_ns(CLOCK_REALTIME);
+	s->bytes = st.st_size;
+
+	sg->bytes_on_disk += s->bytes;
+	if (s->bytes > sg->max_segment_bytes) {
+		sg->max_segment_bytes = s->bytes;
+	}
+
+	/* The manifest may not list a deleted segment, nor miss a closed one */
+	if (sg->cfg.budget) {
+		enforce_budget(sg);
+	}
+
+	return write_manifest(sg);
+}
+
+void
+segments_print_summary(struct segments *sg)
+{
+	printf("         Segments: %" PRIu32 " written, %zu kept (%" PRIu64 " bytes), %" PRIu32 " deleted (%" PRIu64 " bytes) to stay within the budget\n",
+		sg->next_number, sg->n, sg->bytes_on_disk, sg->n_deleted, sg->bytes_deleted);
+}
+
+void
+segments_destroy(struct segments *sg)
+{
+	size_t i;
+
+	for (i = 0; i < sg->n; i++) {
+		if (sg->list[i].fd != -1) {
+			close(sg->list[i].fd);
+		}
+	}
+	free(sg->list);
+	free(sg);
+}
@@ -0,0 +1,59 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* iorec --segment-size/--segment-duration: the capture goes to a series of
+ * files, OUTPUT_FILE.000000, OUTPUT_FILE.000001... each one a whole container
+ * (see capfile.h) whose header has the sample it starts at. The pipeline
+ * moves on to the next file between two chunks, in the worker whose turn it
+ * is to write, so the poller never waits on it.
+ *
+ * OUTPUT_FILE itself is the manifest, rewritten (through a temporary file and
+ * a rename, so readers always see a whole one) each time a segment is opened
+ * or closed:
+ *
+ *   # comments
+ *   NAME FIRST_SAMPLE END_SAMPLE START_REALTIME_NS END_REALTIME_NS BYTES
+ *
+ * one line per segment still on disk, oldest first. NAME is relative to the
+ * manifest's directory. The segment being written has END_SAMPLE,
+ * END_REALTIME_NS and BYTES 0.
+ *
+ * With a disk budget, the oldest segments are deleted whenever a segment is
+ * closed, until what is left plus one more segment fits.
+ */
+
+#define SEGMENTS_MANIFEST_MAGIC "# iorec segment manifest"
+
+struct segment_config {
+	const char *path; /* of the manifest, segments get a suffix */
+	uint64_t max_bytes; /* 0 for no limit; soft, a segment ends after the chunk that crosses it */
+	uint32_t max_seconds; /* 0 for no limit */
+	uint64_t budget; /* bytes for all segments together, 0 for no limit */
+};
+
+struct segments;
+
+struct segments *segments_create(const struct segment_config *cfg);
+
+/* Creates the next segment, to start at first_sample. Returns its fd, which
+ * stays open until segments_close().
+ */
+int segments_open(struct segments *sg, uint64_t first_sample);
+
+/* Whether the newest segment, now bytes long, has to make room for the next */
+bool segments_due(struct segments *sg, uint64_t bytes);
+
+/* Closes the oldest segment still open, which ends before end_sample, then
+ * deletes segments over the budget.
+ */
+int segments_close(struct segments *sg, uint64_t end_sample);
+
+void segments_print_summary(struct segments *sg);
+
+/* Closes whatever is still open, without writing the manifest */
+void segments_destroy(struct segments *sg);
+
+#endif /* SEGMENTS_H */
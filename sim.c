@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "sim.h"
+#include "log.h"
+
+#define SIM_PRIV_MEM_SIZE 8192 /* same as the PRU0 data RAM */
+#define SIM_MAX_BURST 4096 /* samples written between two counter updates */
+#define SIM_IDLE_SLEEP_NS 20000
+
+/* iorec.p runs at 200 MHz. Each sample costs 2 cycles per delay loop
+ * iteration plus a fixed overhead dominated by the OCP write to DDR; 168 is
+ * what gives the 115200 Hz PWM its usual 81 samples per frame at choke 23.
+ */
+#define SIM_PRU_CLOCK_HZ 200000000.0
+#define SIM_PRU_SAMPLE_OVERHEAD 168
+
+struct sim_pru {
+	uint32_t *priv_mem;
+	uint32_t *ring;
+	uint32_t ring_size;
+	double sample_rate;
+	bool test_pattern;
+	int event_fd;
+
+	pthread_t thread;
+	bool running;
+	volatile int stop;
+};
+
+static uint64_t
+sim_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double
+sim_pru_rate_for_choke(int choke)
+{
+	return SIM_PRU_CLOCK_HZ / (2 * choke + SIM_PRU_SAMPLE_OVERHEAD);
+}
+
+struct sim_pru *
+sim_pru_create(uint32_t ring_size, double sample_rate, bool test_pattern)
+{
+	if (ring_size < 4096 || (ring_size & (ring_size - 1))) {
+		ERROR("simulated ring size must be a power of 2 of at least 4096 bytes");
+		return NULL;
+	}
+
+	struct sim_pru *sim = malloc(sizeof(*sim));
+	if (sim == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(sim, 0, sizeof(*sim));
+	sim->ring_size = ring_size;
+	sim->sample_rate = sample_rate;
+	sim->test_pattern = test_pattern;
+
+	sim->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (sim->event_fd == -1) {
+		perror("eventfd");
+		free(sim);
+		return NULL;
+	}
+
+	sim->priv_mem = calloc(1, SIM_PRIV_MEM_SIZE);
+	sim->ring = aligned_alloc(4096, ring_size);
+	if (sim->priv_mem == NULL || sim->ring == NULL) {
+		ERROR("out of memory");
+		sim_pru_destroy(sim);
+		return NULL;
+	}
+	memset(sim->ring, 0, ring_size);
+
+	return sim;
+}
+
+void *
+sim_pru_get_priv_mem(struct sim_pru *sim)
+{
+	return sim->priv_mem;
+}
+
+void *
+sim_pru_get_ring(struct sim_pru *sim)
+{
+	return sim->ring;
+}
+
+int
+sim_pru_event_fd(struct sim_pru *sim)
+{
+	return sim->event_fd;
+}
+
+/* Same loop as iorec.p, except that the counters are published once per burst
+ * of samples instead of once per sample. before_write is set to the last
+ * offset of the burst before any of it is written, so overrun detection stays
+ * conservative.
+ */
+static void *
+sim_pru_thread(void *arg)
+{
+	struct sim_pru *sim = arg;
+	volatile uint32_t *priv = sim->priv_mem;
+	uint32_t size = priv[3]; /* r2 */
+	uint32_t watermark = priv[5]; /* r7 */
+	uint32_t r0 = 0; /* write counter, not moduloed */
+	uint32_t r5 = 0; /* offset in the ring */
+	uint64_t produced = 0;
+	uint64_t t0 = sim_now();
+
+	while (!sim->stop) {
+		uint64_t target = (double)(sim_now() - t0) * sim->sample_rate / 1e9;
+		if (target <= produced) {
+			struct timespec ts = { 0, SIM_IDLE_SLEEP_NS };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		uint64_t n = target - produced;
+		if (n > SIM_MAX_BURST) {
+			n = SIM_MAX_BURST;
+		}
+
+		uint32_t burst_start = r0;
+		__atomic_store_n(&priv[0], r0 + (uint32_t)(n - 1) * 4, __ATOMIC_RELEASE);
+
+		uint64_t i;
+		for (i = 0; i < n; i++) {
+			/* Without the test pattern, pretend r31 holds the sample
+			 * number: bit k toggles every 2^k samples. */
+			sim->ring[r5 / 4] = sim->test_pattern ? r0 : (uint32_t)(produced + i);
+			r0 += 4;
+			r5 += 4;
+			if (r5 == size) {
+				r5 = 0;
+			}
+		}
+
+		__atomic_store_n(&priv[1], r0, __ATOMIC_RELEASE);
+		produced += n;
+
+		if (watermark && burst_start / watermark != r0 / watermark) {
+			uint64_t one = 1;
+			if (write(sim->event_fd, &one, sizeof(one)) == -1) {
+				/* Only fails if the counter would overflow */
+			}
+		}
+	}
+
+	return NULL;
+}
+
+int
+sim_pru_start(struct sim_pru *sim)
+{
+	if (sim->priv_mem[3] != sim->ring_size) {
+		ERROR("ring size given to the simulated PRU does not match its ring");
+		return -1;
+	}
+
+	if (pthread_create(&sim->thread, NULL, sim_pru_thread, sim) != 0) {
+		ERROR("failed to start simulated PRU thread");
+		return -1;
+	}
+	sim->running = true;
+
+	return 0;
+}
+
+void
+sim_pru_destroy(struct sim_pru *sim)
+{
+	if (sim->running) {
+		sim->stop = 1;
+		pthread_join(sim->thread, NULL);
+	}
+
+	close(sim->event_fd);
+	free(sim->priv_mem);
+	free(sim->ring);
+	free(sim);
+}
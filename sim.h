@@ -0,0 +1,34 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Software stand-in for the PRU running iorec.p. A thread fills a ring buffer
+ * and publishes the before_write and after_write counters at offsets 0 and 4
+ * of a fake private memory, exactly like the firmware does, so the consumer in
+ * run() cannot tell the difference.
+ */
+struct sim_pru;
+
+struct sim_pru *sim_pru_create(uint32_t ring_size, double sample_rate,
+		bool test_pattern);
+
+/* The fake PRU0 data RAM and the fake designated DDR region */
+void *sim_pru_get_priv_mem(struct sim_pru *sim);
+void *sim_pru_get_ring(struct sim_pru *sim);
+
+/* eventfd signalled every time the watermark set at offset 20 of the private
+ * memory is crossed, standing in for PRU_EVTOUT_0
+ */
+int sim_pru_event_fd(struct sim_pru *sim);
+
+/* Like the firmware, picks up the ring size from the private memory */
+int sim_pru_start(struct sim_pru *sim);
+
+void sim_pru_destroy(struct sim_pru *sim);
+
+/* Sample rate the real PRU reaches for a given --capture-choke */
+double sim_pru_rate_for_choke(int choke);
+
+#endif /* SIM_H */
@@ -0,0 +1,86 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define SPSC_CACHE_LINE 64
+
+/* Lock-free single-producer/single-consumer queue of pointers. The capacity
+ * must be a power of 2. head is only written by the consumer and tail only by
+ * the producer; they live on separate cache lines so the two sides don't
+ * bounce a line between cores on every operation.
+ */
+struct spsc_queue {
+	uint32_t head __attribute__((aligned(SPSC_CACHE_LINE)));
+	uint32_t tail __attribute__((aligned(SPSC_CACHE_LINE)));
+	uint32_t mask __attribute__((aligned(SPSC_CACHE_LINE)));
+	void **slots;
+};
+
+static inline bool
+spsc_init(struct spsc_queue *q, uint32_t capacity)
+{
+	if (capacity == 0 || (capacity & (capacity - 1))) {
+		return false;
+	}
+
+	memset(q, 0, sizeof(*q));
+	q->mask = capacity - 1;
+	q->slots = calloc(capacity, sizeof(q->slots[0]));
+
+	return q->slots != NULL;
+}
+
+static inline void
+spsc_destroy(struct spsc_queue *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+/* Producer side. Returns false if the queue is full. */
+static inline bool
+spsc_push(struct spsc_queue *q, void *item)
+{
+	uint32_t tail = q->tail;
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head > q->mask) {
+		return false;
+	}
+
+	q->slots[tail & q->mask] = item;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/* Consumer side. Returns NULL if the queue is empty. */
+static inline void *
+spsc_pop(struct spsc_queue *q)
+{
+	uint32_t head = q->head;
+	uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		return NULL;
+	}
+
+	void *item = q->slots[head & q->mask];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+/* Number of queued items; exact from either side, approximate from others */
+static inline uint32_t
+spsc_depth(struct spsc_queue *q)
+{
+	return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+#endif /* SPSC_H */
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "telemetry.h"
+#include "log.h"
+
+#define TELEMETRY_LINE_SIZE 4096
+
+struct snapshot {
+	uint64_t ns;
+	uint64_t polls;
+	uint64_t bytes;
+	uint64_t bytes_lost;
+	uint32_t overruns;
+	uint32_t fill;
+	struct poll_max max;
+	uint32_t latency_hist[TELEMETRY_HIST_BUCKETS];
+	uint32_t gap_hist[TELEMETRY_HIST_BUCKETS];
+};
+
+struct telemetry {
+	struct telemetry_config cfg;
+	int fd;
+	bool is_socket;
+	bool broken;
+	struct poll_counters pc;
+
+	pthread_t thread;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stopping;
+
+	uint64_t start_ns;
+	struct snapshot last;
+};
+
+struct poll_counters *
+telemetry_counters(struct telemetry *t)
+{
+	return &t->pc;
+}
+
+/* Takes the counters and starts a new epoch for the maxima */
+static void
+take_snapshot(struct telemetry *t, struct snapshot *s)
+{
+	struct poll_counters *pc = &t->pc;
+	int k;
+
+	s->ns = telemetry_now();
+	s->polls = COUNTER_GET(pc->polls);
+	s->bytes = COUNTER_GET(pc->bytes);
+	s->bytes_lost = COUNTER_GET(pc->bytes_lost);
+	s->overruns = COUNTER_GET(pc->overruns);
+	s->fill = COUNTER_GET(pc->fill);
+	for (k = 0; k < TELEMETRY_HIST_BUCKETS; k++) {
+		s->latency_hist[k] = COUNTER_GET(pc->latency_hist[k]);
+		s->gap_hist[k] = COUNTER_GET(pc->gap_hist[k]);
+	}
+
+	/* The poller may still add to the old slot for a moment after this,
+	 * which only moves a maximum to the next interval */
+	uint32_t epoch = COUNTER_GET(pc->epoch);
+	__atomic_store_n(&pc->epoch, epoch + 1, __ATOMIC_RELEASE);
+	struct poll_max *m = &pc->max[epoch & 1];
+	s->max.fill = COUNTER_GET(m->fill);
+	s->max.latency_ns = COUNTER_GET(m->latency_ns);
+	s->max.gap_ns = COUNTER_GET(m->gap_ns);
+}
+
+static void
+line_printf(char *line, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (*len >= TELEMETRY_LINE_SIZE) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	int n = vsnprintf(line + *len, TELEMETRY_LINE_SIZE - *len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0) {
+		*len += n;
+	}
+}
+
+/* Histograms go out as arrays of deltas, up to the last non-empty bucket */
+static void
+line_hist(char *line, size_t *len, const char *name, uint32_t max_ns,
+		const uint32_t *cur, const uint32_t *prev)
+{
+	int k, last = -1;
+
+	for (k = 0; k < TELEMETRY_HIST_BUCKETS; k++) {
+		if (cur[k] != prev[k]) {
+			last = k;
+		}
+	}
+
+	line_printf(line, len, ",\"%s\":{\"max\":%" PRIu32 ",\"log2_hist\":[", name, max_ns);
+	for (k = 0; k <= last; k++) {
+		line_printf(line, len, "%s%" PRIu32, k ? "," : "", cur[k] - prev[k]);
+	}
+	line_printf(line, len, "]}");
+}
+
+static void
+emit(struct telemetry *t)
+{
+	struct snapshot s;
+	struct pipeline_stats ps;
+	char line[TELEMETRY_LINE_SIZE];
+	size_t len = 0;
+
+	if (t->broken) {
+		return;
+	}
+
+	take_snapshot(t, &s);
+	pipeline_get_stats(t->cfg.pl, &ps);
+
+	double interval = (s.ns - t->last.ns) / 1e9;
+	uint64_t bytes = s.bytes - t->last.bytes;
+	double ring = t->cfg.ring_size;
+
+	line_printf(line, &len, "{\"time\":%.3f,\"interval\":%.3f", (s.ns - t->start_ns) / 1e9, interval);
+	line_printf(line, &len, ",\"polls\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"mb_per_s\":%.3f",
+		s.polls - t->last.polls, bytes, interval > 0 ? bytes / interval / 1e6 : 0.0);
+	line_printf(line, &len, ",\"ring_fill_pct\":%.2f,\"ring_fill_max_pct\":%.2f",
+		100.0 * s.fill / ring, 100.0 * s.max.fill / ring);
+	/* Time the producer would take to catch up with us from the fullest
+	 * the ring got, if we stopped reading */
+	if (t->cfg.byte_rate > 0) {
+		line_printf(line, &len, ",\"headroom_ms\":%.3f",
+			(ring - s.max.fill) / t->cfg.byte_rate * 1e3);
+	} else {
+		line_printf(line, &len, ",\"headroom_ms\":null");
+	}
+	line_hist(line, &len, "poll_latency_ns", s.max.latency_ns, s.latency_hist, t->last.latency_hist);
+	line_hist(line, &len, "poll_gap_ns", s.max.gap_ns, s.gap_hist, t->last.gap_hist);
+	line_printf(line, &len, ",\"overruns\":%" PRIu32 ",\"bytes_lost\":%" PRIu64,
+		s.overruns, s.bytes_lost);
+	line_printf(line, &len, ",\"blocks_queued\":%" PRIu32 ",\"write_buffers\":%d,\"write_backlog\":%" PRIu64 "}\n",
+		ps.blocks_queued, ps.write_buffers, ps.write_backlog);
+
+	t->last = s;
+
+	if (len >= TELEMETRY_LINE_SIZE) {
+		ERROR("telemetry line too long, dropped");
+		return;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n;
+		if (t->is_socket) {
+			n = send(t->fd, line + done, len - done, MSG_NOSIGNAL);
+		} else {
+			n = write(t->fd, line + done, len - done);
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			perror("telemetry");
+			ERROR("telemetry stopped");
+			t->broken = true;
+			return;
+		}
+		done += n;
+	}
+}
+
+static void *
+telemetry_thread(void *arg)
+{
+	struct telemetry *t = arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->stopping) {
+		/* Absolute deadlines so the intervals don't drift */
+		next.tv_nsec += (long) (t->cfg.interval_ms % 1000) * 1000000;
+		next.tv_sec += t->cfg.interval_ms / 1000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+
+		while (!t->stopping && pthread_cond_timedwait(&t->cond, &t->lock, &next) != ETIMEDOUT) {
+		}
+		if (t->stopping) {
+			break;
+		}
+
+		pthread_mutex_unlock(&t->lock);
+		emit(t);
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+static int
+open_dest(struct telemetry *t, const char *dest)
+{
+	if (strcmp(dest, "-") == 0) {
+		t->fd = dup(STDOUT_FILENO);
+		if (t->fd == -1) {
+			perror("dup");
+			return -1;
+		}
+	} else if (strncmp(dest, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		const char *path = dest + 5;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(addr.sun_path)) {
+			ERROR("socket path too long: %s", path);
+			return -1;
+		}
+		strcpy(addr.sun_path, path);
+
+		t->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (t->fd == -1) {
+			perror("socket");
+			return -1;
+		}
+		t->is_socket = true;
+		if (connect(t->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+			perror("connect");
+			ERROR("can't send telemetry to %s", path);
+			return -1;
+		}
+	} else {
+		t->fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (t->fd == -1) {
+			perror("open");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct telemetry *
+telemetry_create(const struct telemetry_config *cfg)
+{
+	pthread_condattr_t attr;
+
+	if (cfg->interval_ms == 0) {
+		ERROR("telemetry interval must not be 0");
+		return NULL;
+	}
+
+	struct telemetry *t = malloc(sizeof(*t));
+	if (t == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->cfg = *cfg;
+	t->fd = -1;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&t->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (open_dest(t, cfg->dest) == -1) {
+		telemetry_destroy(t);
+		return NULL;
+	}
+
+	t->start_ns = telemetry_now();
+	t->last.ns = t->start_ns;
+
+	if (pthread_create(&t->thread, NULL, telemetry_thread, t) != 0) {
+		ERROR("failed to start telemetry thread");
+		telemetry_destroy(t);
+		return NULL;
+	}
+	t->started = true;
+
+	return t;
+}
+
+void
+telemetry_destroy(struct telemetry *t)
+{
+	if (t->started) {
+		pthread_mutex_lock(&t->lock);
+		t->stopping = true;
+		pthread_cond_signal(&t->cond);
+		pthread_mutex_unlock(&t->lock);
+		pthread_join(t->thread, NULL);
+
+		/* What happened since the last interval */
+		emit(t);
+	}
+
+	if (t->fd != -1) {
+		close(t->fd);
+	}
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->cond);
+	free(t);
+}
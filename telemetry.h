@@ -0,0 +1,157 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "pipeline.h"
+
+/* Live statistics about the capture, written as one JSON object per line
+ * every interval to a file, a Unix socket or stdout.
+ *
+ * The poller only updates counters of its own (struct poll_counters), with
+ * plain relaxed stores; a separate thread takes snapshots of them and works
+ * out the rates from the difference between two snapshots. Maxima are kept
+ * per interval: the thread starts a new epoch at every snapshot and the
+ * poller, once it notices, starts over in the other slot.
+ */
+
+#define TELEMETRY_HIST_BUCKETS 32 /* bucket k counts durations below 2^k ns */
+
+struct poll_max {
+	uint32_t fill; /* bytes */
+	uint32_t latency_ns;
+	uint32_t gap_ns;
+};
+
+struct poll_counters {
+	/* Written by the poller only */
+	uint64_t polls;
+	uint64_t bytes;
+	uint64_t bytes_lost;
+	uint32_t overruns;
+	uint32_t fill; /* bytes in the ring at the last poll */
+	uint32_t latency_hist[TELEMETRY_HIST_BUCKETS]; /* time spent in a poll */
+	uint32_t gap_hist[TELEMETRY_HIST_BUCKETS]; /* time between two polls */
+	struct poll_max max[2];
+
+	/* Written by the telemetry thread */
+	uint32_t epoch;
+
+	/* Poller private */
+	uint32_t epoch_seen;
+	uint64_t poll_start_ns;
+};
+
+#define COUNTER_SET(c, v) __atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define COUNTER_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+static inline uint64_t
+telemetry_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int
+telemetry_bucket(uint64_t ns)
+{
+	int k = ns ? 64 - __builtin_clzll(ns) : 0;
+	return k < TELEMETRY_HIST_BUCKETS ? k : TELEMETRY_HIST_BUCKETS - 1;
+}
+
+static inline uint32_t
+telemetry_clamp(uint64_t v)
+{
+	return v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+/* Called by the poller as it starts a poll, with pc NULL when telemetry is off */
+static inline void
+telemetry_poll_begin(struct poll_counters *pc)
+{
+	if (pc == NULL) {
+		return;
+	}
+
+	uint64_t now = telemetry_now();
+	uint32_t epoch = __atomic_load_n(&pc->epoch, __ATOMIC_ACQUIRE);
+	struct poll_max *m = &pc->max[epoch & 1];
+
+	if (epoch != pc->epoch_seen) {
+		pc->epoch_seen = epoch;
+		COUNTER_SET(m->fill, 0);
+		COUNTER_SET(m->latency_ns, 0);
+		COUNTER_SET(m->gap_ns, 0);
+	}
+
+	if (pc->poll_start_ns) {
+		uint32_t gap = telemetry_clamp(now - pc->poll_start_ns);
+		int k = telemetry_bucket(gap);
+		COUNTER_SET(pc->gap_hist[k], pc->gap_hist[k] + 1);
+		if (gap > m->gap_ns) {
+			COUNTER_SET(m->gap_ns, gap);
+		}
+	}
+	pc->poll_start_ns = now;
+}
+
+/* Called by the poller at the end of a poll which found `fill` bytes in the
+ * ring and took `bytes` of them
+ */
+static inline void
+telemetry_poll_end(struct poll_counters *pc, uint32_t fill, uint32_t bytes)
+{
+	if (pc == NULL) {
+		return;
+	}
+
+	struct poll_max *m = &pc->max[pc->epoch_seen & 1];
+	uint32_t latency = telemetry_clamp(telemetry_now() - pc->poll_start_ns);
+	int k = telemetry_bucket(latency);
+
+	COUNTER_SET(pc->latency_hist[k], pc->latency_hist[k] + 1);
+	if (latency > m->latency_ns) {
+		COUNTER_SET(m->latency_ns, latency);
+	}
+	if (fill > m->fill) {
+		COUNTER_SET(m->fill, fill);
+	}
+	COUNTER_SET(pc->fill, fill);
+	COUNTER_SET(pc->polls, pc->polls + 1);
+	COUNTER_SET(pc->bytes, pc->bytes + bytes);
+}
+
+/* Called by the poller after an overrun which lost `lost` bytes */
+static inline void
+telemetry_overrun(struct poll_counters *pc, uint64_t lost)
+{
+	if (pc == NULL) {
+		return;
+	}
+
+	COUNTER_SET(pc->overruns, pc->overruns + 1);
+	COUNTER_SET(pc->bytes_lost, pc->bytes_lost + lost);
+}
+
+struct telemetry_config {
+	const char *dest; /* a file name, unix:PATH or - for stdout */
+	uint32_t interval_ms;
+	uint32_t ring_size;
+	double byte_rate; /* nominal rate the producer fills the ring at */
+	struct pipeline *pl;
+};
+
+struct telemetry;
+
+/* Opens the destination and starts the snapshot thread */
+struct telemetry *telemetry_create(const struct telemetry_config *cfg);
+
+/* The counters the poller updates */
+struct poll_counters *telemetry_counters(struct telemetry *t);
+
+/* Writes a last line, stops the thread and closes the destination */
+void telemetry_destroy(struct telemetry *t);
+
+#endif /* TELEMETRY_H */
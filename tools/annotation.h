@@ -0,0 +1,384 @@
+#ifndef ANNOTATION_H
+#define ANNOTATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+
+/* Annotation files: what decode marked on which sample, for display.
+ *
+ *   ann_file_header
+ *   ann_record...     by increasing sample
+ *
+ * A record marks `count` samples with `code`, starting `skip` samples after
+ * the end of the previous record (after sample 0 for the first). Records
+ * with a count of 0 only skip. Samples no record covers aren't marked.
+ *
+ * Older decoders wrote one byte per sample instead, 0 where there was no
+ * mark; readers still take those.
+ */
+
+#define ANN_FILE_MAGIC "IORECANN"
+#define ANN_FILE_VERSION 1
+
+struct ann_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct ann_record {
+	uint32_t skip;
+	uint16_t count;
+	char code;
+	uint8_t reserved;
+};
+
+#define ANN_BUF_SIZE (1 << 20)
+
+/* Encodes records, merging runs of the same code. It writes them to a file in
+ * large batches, or keeps them in memory when fd is -1.
+ */
+struct ann_writer {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	uint64_t end; /* sample after the last record */
+
+	/* Run being extended */
+	uint64_t run_sample;
+	uint32_t run_count;
+	char run_code;
+};
+
+/* Records in memory start from `end`, those in a file from sample 0 */
+static inline bool
+ann_writer_init(struct ann_writer *w, int fd, uint64_t end)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->end = end;
+	w->size = ANN_BUF_SIZE;
+	w->buf = malloc(w->size);
+	if (w->buf == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+
+	if (fd != -1) {
+		struct ann_file_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, ANN_FILE_MAGIC, sizeof(hdr.magic));
+		hdr.version = ANN_FILE_VERSION;
+		hdr.record_size = sizeof(struct ann_record);
+		memcpy(w->buf, &hdr, sizeof(hdr));
+		w->len = sizeof(hdr);
+	}
+
+	return true;
+}
+
+static inline bool
+ann_writer_flush(struct ann_writer *w)
+{
+	size_t done = 0;
+
+	while (done < w->len) {
+		ssize_t result = write(w->fd, w->buf + done, w->len - done);
+		if (result == -1) {
+			perror("write");
+			return false;
+		}
+		done += result;
+	}
+	w->len = 0;
+
+	return true;
+}
+
+/* Appends bytes already encoded from w->end on */
+static inline bool
+ann_writer_append(struct ann_writer *w, const void *records, size_t len)
+{
+	if (w->len + len > w->size) {
+		if (w->fd != -1) {
+			if (!ann_writer_flush(w)) {
+				return false;
+			}
+		}
+		if (len > w->size - w->len) {
+			size_t size = w->size;
+			while (len > size - w->len) {
+				size *= 2;
+			}
+			uint8_t *buf = realloc(w->buf, size);
+			if (buf == NULL) {
+				ERROR("out of memory");
+				return false;
+			}
+			w->buf = buf;
+			w->size = size;
+		}
+	}
+
+	memcpy(w->buf + w->len, records, len);
+	w->len += len;
+
+	return true;
+}
+
+/* Records that only skip, until `sample` is close enough for a record */
+static inline bool
+ann_writer_skip(struct ann_writer *w, uint64_t sample)
+{
+	struct ann_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.skip = UINT32_MAX;
+	while (sample - w->end > UINT32_MAX) {
+		if (!ann_writer_append(w, &r, sizeof(r))) {
+			return false;
+		}
+		w->end += UINT32_MAX;
+	}
+
+	return true;
+}
+
+static inline bool
+ann_writer_put(struct ann_writer *w, uint64_t sample, uint32_t count, char code)
+{
+	struct ann_record r;
+
+	if (!ann_writer_skip(w, sample)) {
+		return false;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.skip = sample - w->end;
+	r.count = count;
+	r.code = code;
+	w->end = sample + count;
+
+	return ann_writer_append(w, &r, sizeof(r));
+}
+
+/* Encodes the run in progress */
+static inline bool
+ann_writer_end_run(struct ann_writer *w)
+{
+	if (w->run_count == 0) {
+		return true;
+	}
+	if (!ann_writer_put(w, w->run_sample, w->run_count, w->run_code)) {
+		return false;
+	}
+	w->run_count = 0;
+
+	return true;
+}
+
+/* Marks count samples from `sample` on. Marks come by increasing sample. */
+static inline bool
+ann_writer_add(struct ann_writer *w, uint64_t sample, uint32_t count, char code)
+{
+	if (w->run_count && code == w->run_code && sample == w->run_sample + w->run_count
+		&& w->run_count + count <= UINT16_MAX)
+	{
+		w->run_count += count;
+		return true;
+	}
+
+	if (!ann_writer_end_run(w)) {
+		return false;
+	}
+	w->run_sample = sample;
+	w->run_count = count;
+	w->run_code = code;
+
+	return true;
+}
+
+/* Moves the records another writer kept in memory from `from_start` on to
+ * the end of this one, which must not be past from_start. The result is the
+ * same as if they had been added here.
+ */
+static inline bool
+ann_writer_take(struct ann_writer *w, struct ann_writer *from, uint64_t from_start)
+{
+	struct ann_record first;
+
+	if (!ann_writer_end_run(w) || !ann_writer_end_run(from)) {
+		return false;
+	}
+	if (from->len == 0) {
+		return true;
+	}
+
+	/* Its first record skips from from_start, make it skip from here */
+	memcpy(&first, from->buf, sizeof(first));
+	uint64_t sample = from_start + first.skip;
+	if (!ann_writer_skip(w, sample)) {
+		return false;
+	}
+	first.skip = sample - w->end;
+	memcpy(from->buf, &first, sizeof(first));
+
+	if (!ann_writer_append(w, from->buf, from->len)) {
+		return false;
+	}
+	w->end = from->end;
+	from->len = 0;
+
+	return true;
+}
+
+static inline bool
+ann_writer_close(struct ann_writer *w)
+{
+	bool ok = ann_writer_end_run(w) && ann_writer_flush(w);
+
+	free(w->buf);
+	w->buf = NULL;
+
+	return ok;
+}
+
+/* Hands out marked samples in order, from either kind of file */
+struct ann_reader {
+	int fd;
+	bool dense; /* one byte per sample */
+	uint8_t buf[65536];
+	size_t len;
+	size_t next;
+	uint64_t pos; /* sample of the next byte of a dense file, after the last record otherwise */
+	uint64_t from; /* marks before are skipped */
+
+	uint64_t run_sample;
+	uint32_t run_left;
+	char run_code;
+};
+
+static inline int
+ann_reader_fill(struct ann_reader *r)
+{
+	if (r->next < r->len) {
+		memmove(r->buf, r->buf + r->next, r->len - r->next);
+	}
+	r->len -= r->next;
+	r->next = 0;
+
+	ssize_t result = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+	if (result == -1) {
+		perror("read");
+		return -1;
+	}
+	r->len += result;
+
+	return result ? 1 : 0;
+}
+
+/* Marks before sample `from` are skipped. fd -1 is a file without marks. */
+static inline bool
+ann_reader_open(struct ann_reader *r, int fd, uint64_t from)
+{
+	struct ann_file_header hdr;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->from = from;
+	if (fd == -1) {
+		return true;
+	}
+
+	while (r->len < sizeof(hdr)) {
+		int result = ann_reader_fill(r);
+		if (result == -1) {
+			return false;
+		} else if (result == 0) {
+			break;
+		}
+	}
+
+	if (r->len >= sizeof(hdr) && memcmp(r->buf, ANN_FILE_MAGIC, sizeof(hdr.magic)) == 0) {
+		memcpy(&hdr, r->buf, sizeof(hdr));
+		if (hdr.version != ANN_FILE_VERSION || hdr.record_size != sizeof(struct ann_record)) {
+			ERROR("unsupported annotation file version %u", hdr.version);
+			return false;
+		}
+		r->next = sizeof(hdr);
+		return true;
+	}
+
+	r->dense = true;
+	/* Skip to `from` without reading everything before if we can */
+	if (from && lseek(fd, from, SEEK_SET) != -1) {
+		r->len = r->next = 0;
+		r->pos = from;
+	}
+
+	return true;
+}
+
+/* Returns 1 with the next marked sample, 0 when there are no more, -1 on
+ * errors
+ */
+static inline int
+ann_reader_next(struct ann_reader *r, uint64_t *sample, char *code)
+{
+	for (;;) {
+		if (r->run_left) {
+			*sample = r->run_sample++;
+			*code = r->run_code;
+			r->run_left--;
+			if (*sample < r->from) {
+				continue;
+			}
+			return 1;
+		}
+
+		if (r->fd == -1) {
+			return 0;
+		}
+
+		if (r->dense) {
+			while (r->next < r->len && (r->buf[r->next] == 0 || r->pos < r->from)) {
+				r->next++;
+				r->pos++;
+			}
+			if (r->next < r->len) {
+				*sample = r->pos++;
+				*code = r->buf[r->next++];
+				return 1;
+			}
+		} else if (r->len - r->next >= sizeof(struct ann_record)) {
+			struct ann_record rec;
+			memcpy(&rec, r->buf + r->next, sizeof(rec));
+			r->next += sizeof(rec);
+
+			r->run_sample = r->pos + rec.skip;
+			r->run_left = rec.count;
+			r->run_code = rec.code;
+			r->pos = r->run_sample + rec.count;
+			if (r->pos <= r->from) {
+				/* All before `from` */
+				r->run_left = 0;
+			} else if (r->run_sample < r->from) {
+				r->run_left -= r->from - r->run_sample;
+				r->run_sample = r->from;
+			}
+			continue;
+		}
+
+		int result = ann_reader_fill(r);
+		if (result != 1) {
+			return result;
+		}
+	}
+}
+
+#endif /* ANNOTATION_H */
@@ -0,0 +1,194 @@
+#ifndef AUTOBAUD_H
+#define AUTOBAUD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "log.h"
+
+/* Works out the bit period of a UART line from how long it stays low. A low
+ * run is a start bit and the zeros after it, a whole number of bits from 1
+ * to 9; high runs end in idle time of any length, so they aren't counted. The
+ * most common run length is a candidate; the bit period is the largest
+ * fraction of it that nearly all the other runs are multiples of, averaged
+ * over those runs.
+ */
+
+#define AUTOBAUD_MAX_RUN 65536 /* longer runs are idle time */
+#define AUTOBAUD_MIN_RUN 3 /* shorter ones are glitches */
+#define AUTOBAUD_RUNS 4096 /* enough to decide */
+#define AUTOBAUD_MAX_SAMPLES (1ull << 26) /* give up looking further */
+
+struct run_histogram {
+	uint32_t *counts; /* by run length */
+	uint64_t n_runs; /* low runs counted */
+	bool started; /* the first run began before we looked, it isn't counted */
+};
+
+static inline bool
+run_histogram_init(struct run_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->counts = calloc(AUTOBAUD_MAX_RUN, sizeof(h->counts[0]));
+	if (h->counts == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+
+	return true;
+}
+
+/* Counts a run of len samples at value that just ended */
+static inline void
+run_histogram_add(struct run_histogram *h, int value, uint64_t len)
+{
+	if (h->started && value == 0 && len < AUTOBAUD_MAX_RUN) {
+		h->counts[len]++;
+		h->n_runs++;
+	}
+	h->started = true;
+}
+
+/* Shortest run that counts as bits rather than a glitch */
+static inline uint64_t
+autobaud_min_run(double period)
+{
+	return period / 2 > AUTOBAUD_MIN_RUN ? period / 2 : AUTOBAUD_MIN_RUN;
+}
+
+/* Share of the runs from half a bit to 9.5 bits that are within a quarter
+ * bit of a whole number of bits
+ */
+static inline double
+autobaud_fit(const struct run_histogram *h, double period)
+{
+	uint64_t good = 0, total = 0;
+	uint64_t l;
+
+	for (l = autobaud_min_run(period); l < 9.5 * period && l < AUTOBAUD_MAX_RUN; l++) {
+		double k = round(l / period);
+		total += h->counts[l];
+		if (k >= 1 && fabs(l - k * period) <= period / 4) {
+			good += h->counts[l];
+		}
+	}
+
+	return total ? (double) good / total : 0;
+}
+
+/* Least squares bit period from the runs that fit `period`, and the spread
+ * of their length per bit around it in *spread
+ */
+static inline double
+autobaud_refine(const struct run_histogram *h, double period, double *spread)
+{
+	double sum_l = 0, sum_k = 0, sum_d2 = 0, n = 0;
+	uint64_t l;
+
+	for (l = autobaud_min_run(period); l < 9.5 * period && l < AUTOBAUD_MAX_RUN; l++) {
+		double k = round(l / period);
+		if (h->counts[l] && k >= 1 && fabs(l - k * period) <= period / 4) {
+			sum_l += (double) h->counts[l] * l;
+			sum_k += (double) h->counts[l] * k;
+		}
+	}
+	if (sum_k == 0) {
+		return 0;
+	}
+	period = sum_l / sum_k;
+
+	for (l = autobaud_min_run(period); l < 9.5 * period && l < AUTOBAUD_MAX_RUN; l++) {
+		double k = round(l / period);
+		if (h->counts[l] && k >= 1 && fabs(l - k * period) <= period / 4) {
+			double d = l / k - period;
+			sum_d2 += h->counts[l] * d * d;
+			n += h->counts[l];
+		}
+	}
+	*spread = sqrt(sum_d2 / n);
+
+	return period;
+}
+
+/* Frame length (10 bits) and the tolerance to allow on the length measured
+ * from one frame. Returns false if the runs don't look like a UART.
+ */
+static inline bool
+autobaud_estimate(const struct run_histogram *h, int *frame_length, int *tol)
+{
+	uint64_t *below = malloc((AUTOBAUD_MAX_RUN + 1) * sizeof(below[0]));
+	uint64_t l, lo, hi;
+	int attempt, k;
+
+	if (below == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+
+	below[0] = 0;
+	for (l = 0; l < AUTOBAUD_MAX_RUN; l++) {
+		below[l + 1] = below[l] + (l >= AUTOBAUD_MIN_RUN ? h->counts[l] : 0);
+	}
+
+	/* Glitches can outnumber the runs of a slow line: if the most common
+	 * length doesn't work, try the next most common one elsewhere */
+	uint64_t skip_lo = 0, skip_hi = 0;
+	for (attempt = 0; attempt < 4 && h->n_runs >= 16; attempt++) {
+		uint64_t best = 0, best_count = 0;
+
+		/* Most common run length, allowing for jitter of 1/16 around it */
+		for (l = AUTOBAUD_MIN_RUN; l < AUTOBAUD_MAX_RUN; l++) {
+			if (l >= skip_lo && l < skip_hi) {
+				continue;
+			}
+			lo = l - l / 16 - 1;
+			hi = l + l / 16 + 2 < AUTOBAUD_MAX_RUN ? l + l / 16 + 2 : AUTOBAUD_MAX_RUN;
+			if (below[hi] - below[lo] > best_count) {
+				best = l;
+				best_count = below[hi] - below[lo];
+			}
+		}
+		if (best_count < 16) {
+			break;
+		}
+
+		/* It lasts a few bits: the largest bit period it is a multiple of */
+		for (k = 1; k <= 9; k++) {
+			double period = (double) best / k, spread = 0;
+
+			if (period < AUTOBAUD_MIN_RUN) {
+				break;
+			}
+			if (autobaud_fit(h, period) < 0.8) {
+				continue;
+			}
+
+			period = autobaud_refine(h, period, &spread);
+			period = autobaud_refine(h, period, &spread);
+			if (period < AUTOBAUD_MIN_RUN) {
+				break;
+			}
+
+			*frame_length = lround(10 * period);
+			/* A frame's length is measured from about 4 of its edges */
+			*tol = 1 + ceil(3 * 10 * spread / 2);
+			if (*tol > *frame_length / 16) {
+				*tol = *frame_length / 16 > 1 ? *frame_length / 16 : 1;
+			}
+			free(below);
+
+			return true;
+		}
+
+		skip_lo = best / 2;
+		skip_hi = best * 2;
+	}
+
+	free(below);
+
+	return false;
+}
+
+#endif /* AUTOBAUD_H */
@@ -2,16 +2,54 @@
 #define BITINPUT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "log.h"
+#include "capinput.h"
+#include "edgeinput.h"
 
-#define BIT_INPUT_BUFFER_SIZE 1024
+/* The capture channel iorec keeps when no mask is given */
+#define BIT_INPUT_DEFAULT_CHANNEL 15
+
+/* Returned by bit_input_get() where samples are missing from the capture */
+#define BIT_INPUT_GAP 2
 
 struct bit_input {
-	uint32_t buf[1024];
-	size_t next_idx;
-	size_t next_bit;
-	uint32_t cur_word;
 	int fd;
+	const char *live_path; /* read the live ring there rather than fd */
+	const char *manifest_path; /* or the segments this manifest lists */
+	struct cap_input *ci; /* opened at the first request */
+
+	/* Files holding several channels have n_channels words per group of 32
+	 * samples; we only return the bits of word number channel_idx in each
+	 * group, or of the words of `channels` for bit_input_get_levels().
+	 */
+	int channel;
+	uint32_t channel_mask;
+	int n_channels;
+	int channel_idx;
+	uint32_t channels; /* by channel number */
+	uint32_t channel_idxs; /* the same by word number */
+	int channel_words[32]; /* word number of each of them */
+
+	/* Samples are numbered from the start of the capture */
+	struct cap_chunk chunk;
+	uint64_t sample; /* of the next bit returned */
+	uint64_t chunk_end;
+	uint64_t seek_target;
+	uint64_t gap; /* samples missing before `sample` */
+	bool gap_pending;
+
+	/* Packed payloads */
+	const uint32_t *words;
+	size_t next_group;
+	int next_bit;
+	uint32_t cur_word;
+
+	/* Edge payloads are expanded back into samples */
+	struct edge_decoder ed;
+	uint64_t next_edge; /* next change of one of our channels */
+	uint32_t next_changed;
+	uint32_t levels; /* of our channels, by word number */
 };
 
 static inline struct bit_input *bit_input_create(int fd)
@@ -25,42 +63,548 @@ static inline struct bit_input *bit_input_create(int fd)
 	memset(bi, 0, sizeof(*bi));
 
 	bi->fd = fd;
-	/* Trick the get function into reading from file at next request */
-	bi->next_bit = 32;
-	bi->next_idx = BIT_INPUT_BUFFER_SIZE;
+	bi->channel = BIT_INPUT_DEFAULT_CHANNEL;
+	bi->channel_mask = 1u << BIT_INPUT_DEFAULT_CHANNEL;
+	bi->channels = 1u << BIT_INPUT_DEFAULT_CHANNEL;
+	bi->n_channels = 1;
+	bi->channel_idx = 0;
 
 	return bi;
 }
 
+/* Works out where the requested channels live in a file with this mask */
+static inline bool
+bit_input_resolve_channel(struct bit_input *bi, uint32_t channel_mask)
+{
+	uint32_t left = bi->channels;
+
+	bi->channel_idxs = 0;
+	while (left) {
+		int channel = __builtin_ctz(left);
+		if (!(channel_mask & (1u << channel))) {
+			ERROR("channel %d is not part of mask 0x%x", channel, channel_mask);
+			return false;
+		}
+		bi->channel_words[channel] = __builtin_popcount(channel_mask & ((1u << channel) - 1));
+		bi->channel_idxs |= 1u << bi->channel_words[channel];
+		left &= left - 1;
+	}
+
+	bi->n_channels = __builtin_popcount(channel_mask);
+	bi->channel_idx = __builtin_popcount(channel_mask & ((1u << bi->channel) - 1));
+
+	return true;
+}
+
+/* Selects which channel to read from a file written by iorec --channels=MASK.
+ * Containers and edge files record their own mask, which replaces
+ * channel_mask.
+ */
+static inline bool
+bit_input_select_channel(struct bit_input *bi, uint32_t channel_mask, int channel)
+{
+	if (channel < 0 || channel > 31) {
+		ERROR("there is no channel %d", channel);
+		return false;
+	}
+
+	bi->channel = channel;
+	bi->channel_mask = channel_mask;
+	bi->channels = 1u << channel;
+
+	return true;
+}
+
+/* Selects several channels (by number) to read together with
+ * bit_input_get_levels(). bit_input_get() reads the lowest one.
+ */
+static inline bool
+bit_input_select_channels(struct bit_input *bi, uint32_t channel_mask, uint32_t channels)
+{
+	if (channels == 0) {
+		ERROR("no channel to read");
+		return false;
+	}
+
+	bi->channel = __builtin_ctz(channels);
+	bi->channel_mask = channel_mask;
+	bi->channels = channels;
+
+	return true;
+}
+
+static inline bool
+bit_input_open(struct bit_input *bi)
+{
+	if (bi->ci != NULL) {
+		return true;
+	}
+
+	struct cap_input *ci;
+	if (bi->live_path != NULL) {
+		ci = cap_input_open_live(bi->live_path);
+	} else if (bi->manifest_path != NULL) {
+		ci = cap_input_open_manifest(bi->manifest_path);
+	} else {
+		ci = cap_input_open(bi->fd, bi->channel_mask);
+	}
+	if (ci == NULL || !bit_input_resolve_channel(bi, ci->hdr.channel_mask)) {
+		return false;
+	}
+	bi->ci = ci;
+
+	/* Segments don't start with a gap */
+	bi->sample = bi->chunk_end = ci->hdr.first_sample;
+
+	return true;
+}
+
+/* Reads the live ring of iorec --live=path instead of the file. A live
+ * capture starts with the next block iorec publishes, without a gap before.
+ */
+static inline void
+bit_input_set_live(struct bit_input *bi, const char *path)
+{
+	bi->live_path = path;
+}
+
+/* Reads the segments listed in the manifest iorec --segment-size writes
+ * instead of the file, oldest first. The capture starts with the oldest
+ * segment still on disk, without a gap before.
+ */
+static inline void
+bit_input_set_manifest(struct bit_input *bi, const char *path)
+{
+	bi->manifest_path = path;
+}
+
+/* Another reader of the same channel of a mapped capture (see
+ * cap_input_map()), for another thread. It has to be seeked before use.
+ */
+static inline struct bit_input *
+bit_input_clone(struct bit_input *bi)
+{
+	struct bit_input *clone = bit_input_create(bi->fd);
+	if (clone == NULL) {
+		return NULL;
+	}
+
+	clone->ci = cap_input_clone(bi->ci);
+	if (clone->ci == NULL) {
+		free(clone);
+		return NULL;
+	}
+	clone->channel = bi->channel;
+	clone->channel_mask = bi->channel_mask;
+	clone->n_channels = bi->n_channels;
+	clone->channel_idx = bi->channel_idx;
+	clone->channels = bi->channels;
+	clone->channel_idxs = bi->channel_idxs;
+	memcpy(clone->channel_words, bi->channel_words, sizeof(clone->channel_words));
+
+	return clone;
+}
+
+/* What the file says about the capture. Fields a bare file can't tell are 0. */
+static inline const struct cap_header *
+bit_input_header(struct bit_input *bi)
+{
+	if (!bit_input_open(bi)) {
+		return NULL;
+	}
+
+	return &bi->ci->hdr;
+}
+
+/* Finds the next change of our channels in the current edge block */
 static inline int
-bit_input_get(struct bit_input *bi, int *b)
+bit_input_next_edge(struct bit_input *bi)
 {
+	uint64_t sample;
+	uint32_t changed;
 	int result;
 
-	if (bi->next_bit == 32) {
-		if (bi->next_idx == BIT_INPUT_BUFFER_SIZE) {
-			result = read(bi->fd, bi->buf, BIT_INPUT_BUFFER_SIZE * sizeof(bi->buf[0]));
-			if (result == -1) {
-				perror("read");
+	for (;;) {
+		result = edge_decoder_next(&bi->ed, &sample, &changed);
+		if (result == -1) {
+			return -1;
+		} else if (result == 0) {
+			bi->next_edge = UINT64_MAX;
+			return 0;
+		}
+
+		if (changed & bi->channel_idxs) {
+			bi->next_edge = sample;
+			bi->next_changed = changed & bi->channel_idxs;
+			return 1;
+		}
+	}
+}
+
+/* Loads the next chunk and positions us on its first sample, or on the seek
+ * target if that falls inside it
+ */
+static inline int
+bit_input_next_chunk(struct bit_input *bi)
+{
+	int result;
+
+	for (;;) {
+		result = cap_input_next_chunk(bi->ci, &bi->chunk);
+		if (result != 1) {
+			return result;
+		}
+
+		/* Gap records only confirm what the sample numbers tell */
+		if (bi->chunk.flags & CAP_CHUNK_GAP) {
+			continue;
+		}
+
+		if (bi->ci->kind == CAP_INPUT_LIVE && bi->chunk_end == 0) {
+			bi->sample = bi->chunk_end = bi->chunk.first_sample;
+		}
+
+		if (bi->chunk.first_sample + bi->chunk.n_samples > bi->seek_target) {
+			break;
+		}
+	}
+
+	uint64_t skip = 0;
+	if (bi->seek_target > bi->chunk.first_sample) {
+		skip = bi->seek_target - bi->chunk.first_sample;
+	}
+
+	/* bi->sample is where the previous chunk ended */
+	if (bi->chunk.first_sample + skip > bi->sample) {
+		bi->gap = bi->chunk.first_sample + skip - bi->sample;
+		bi->gap_pending = true;
+	}
+	bi->sample = bi->chunk.first_sample;
+	bi->chunk_end = bi->sample + bi->chunk.n_samples;
+
+	if (bi->chunk.payload_format == CAP_PAYLOAD_EDGES) {
+		if (!edge_decoder_init(&bi->ed, bi->chunk.payload, bi->chunk.payload_len,
+				bi->n_channels))
+		{
+			return -1;
+		}
+		bi->levels = bi->ed.hdr.initial & bi->channel_idxs;
+		if (bit_input_next_edge(bi) == -1) {
+			return -1;
+		}
+		while (bi->next_edge < bi->sample + skip) {
+			bi->levels ^= bi->next_changed;
+			if (bit_input_next_edge(bi) == -1) {
 				return -1;
-			} else if (result == 0) {
-				return 0;
 			}
+		}
+	} else {
+		bi->words = (const uint32_t *) bi->chunk.payload;
+		bi->next_group = skip / 32;
+		bi->next_bit = 32;
+		if (skip % 32) {
+			bi->cur_word = bi->words[bi->next_group * bi->n_channels + bi->channel_idx];
+			bi->cur_word <<= skip % 32;
+			bi->next_bit = skip % 32;
+			bi->next_group++;
+		}
+	}
+
+	bi->sample += skip;
+
+	return 1;
+}
+
+/* Returns 1 and the next bit in *b, 0 at the end of the capture, -1 on
+ * errors, or BIT_INPUT_GAP before the first bit following missing samples.
+ * bit_input_gap() then tells how many are missing.
+ */
+static inline int
+bit_input_get(struct bit_input *bi, int *b)
+{
+	int result;
 
-			bi->next_idx = 0;
+	if (!bit_input_open(bi)) {
+		return -1;
+	}
+
+	if (bi->sample == bi->chunk_end) {
+		result = bit_input_next_chunk(bi);
+		if (result != 1) {
+			return result;
+		}
+	}
+
+	if (bi->gap_pending) {
+		bi->gap_pending = false;
+		return BIT_INPUT_GAP;
+	}
+
+	if (bi->chunk.payload_format == CAP_PAYLOAD_EDGES) {
+		if (bi->sample == bi->next_edge) {
+			bi->levels ^= bi->next_changed;
+			if (bit_input_next_edge(bi) == -1) {
+				return -1;
+			}
 		}
 
-		bi->cur_word = bi->buf[bi->next_idx];
-		bi->next_idx++;
+		*b = (bi->levels >> bi->channel_idx) & 1;
+		bi->sample++;
 
+		return 1;
+	}
+
+	if (bi->next_bit == 32) {
+		bi->cur_word = bi->words[bi->next_group * bi->n_channels + bi->channel_idx];
+		bi->next_group++;
 		bi->next_bit = 0;
 	}
 
 	*b = bi->cur_word >> 31;
 	bi->next_bit++;
 	bi->cur_word <<= 1;
+	bi->sample++;
+
+	return 1;
+}
+
+/* Like bit_input_get(), but returns up to 64 bits at once: the first in bit
+ * 63 of *bits, their number in *n. Fewer come at the end of a chunk.
+ */
+static inline int
+bit_input_get_bits(struct bit_input *bi, uint64_t *bits, int *n)
+{
+	int result;
+
+	if (!bit_input_open(bi)) {
+		return -1;
+	}
+
+	if (bi->sample == bi->chunk_end) {
+		result = bit_input_next_chunk(bi);
+		if (result != 1) {
+			return result;
+		}
+	}
+
+	if (bi->gap_pending) {
+		bi->gap_pending = false;
+		return BIT_INPUT_GAP;
+	}
+
+	uint64_t left = bi->chunk_end - bi->sample;
+	int want = left < 64 ? left : 64;
+	int got = 0;
+
+	*bits = 0;
+
+	if (bi->chunk.payload_format == CAP_PAYLOAD_EDGES) {
+		while (got < want) {
+			if (bi->sample == bi->next_edge) {
+				bi->levels ^= bi->next_changed;
+				if (bit_input_next_edge(bi) == -1) {
+					return -1;
+				}
+			}
+
+			/* A run of the same value up to the next edge */
+			int k = want - got;
+			if (bi->next_edge - bi->sample < (uint64_t) k) {
+				k = bi->next_edge - bi->sample;
+			}
+			if ((bi->levels >> bi->channel_idx) & 1) {
+				*bits |= (~0ull >> (64 - k)) << (64 - got - k);
+			}
+			got += k;
+			bi->sample += k;
+		}
+	} else {
+		while (got < want) {
+			if (bi->next_bit == 32) {
+				bi->cur_word = bi->words[bi->next_group * bi->n_channels + bi->channel_idx];
+				bi->next_group++;
+				bi->next_bit = 0;
+			}
+
+			int k = 32 - bi->next_bit;
+			if (k > want - got) {
+				k = want - got;
+			}
+			*bits |= (uint64_t) (bi->cur_word >> (32 - k)) << (64 - got - k);
+			bi->cur_word = k == 32 ? 0 : bi->cur_word << k;
+			bi->next_bit += k;
+			got += k;
+			bi->sample += k;
+		}
+	}
+
+	*n = got;
+
+	return 1;
+}
+
+/* Like bit_input_get_bits() for all the channels selected with
+ * bit_input_select_channels() at once: levels[channel] gets those of each.
+ * Don't mix with bit_input_get_bits().
+ */
+static inline int
+bit_input_get_levels(struct bit_input *bi, uint64_t levels[32], int *n)
+{
+	uint32_t left;
+	int result;
+
+	if (!bit_input_open(bi)) {
+		return -1;
+	}
+
+	if (bi->sample == bi->chunk_end) {
+		result = bit_input_next_chunk(bi);
+		if (result != 1) {
+			return result;
+		}
+	}
+
+	if (bi->gap_pending) {
+		bi->gap_pending = false;
+		return BIT_INPUT_GAP;
+	}
+
+	uint64_t left_in_chunk = bi->chunk_end - bi->sample;
+	int want = left_in_chunk < 64 ? left_in_chunk : 64;
+	int got = 0;
+
+	for (left = bi->channels; left; left &= left - 1) {
+		levels[__builtin_ctz(left)] = 0;
+	}
+
+	if (bi->chunk.payload_format == CAP_PAYLOAD_EDGES) {
+		while (got < want) {
+			if (bi->sample == bi->next_edge) {
+				bi->levels ^= bi->next_changed;
+				if (bit_input_next_edge(bi) == -1) {
+					return -1;
+				}
+			}
+
+			/* Runs of the same levels up to the next edge */
+			int k = want - got;
+			if (bi->next_edge - bi->sample < (uint64_t) k) {
+				k = bi->next_edge - bi->sample;
+			}
+			uint64_t run = (~0ull >> (64 - k)) << (64 - got - k);
+			for (left = bi->channels; left; left &= left - 1) {
+				int channel = __builtin_ctz(left);
+				int idx = bi->channel_words[channel];
+				if ((bi->levels >> idx) & 1) {
+					levels[channel] |= run;
+				}
+			}
+			got += k;
+			bi->sample += k;
+		}
+	} else if (want == 64) {
+		/* The 2 or 3 words the samples are in, straight from the chunk */
+		uint64_t off = bi->sample - bi->chunk.first_sample;
+		const uint32_t *group = bi->words + off / 32 * bi->n_channels;
+		int shift = off % 32;
+
+		for (left = bi->channels; left; left &= left - 1) {
+			int channel = __builtin_ctz(left);
+			const uint32_t *w = group + bi->channel_words[channel];
+			uint64_t x = (uint64_t) w[0] << 32 | w[bi->n_channels];
+			if (shift) {
+				x = x << shift | w[2 * bi->n_channels] >> (32 - shift);
+			}
+			levels[channel] = x;
+		}
+		got = 64;
+		bi->sample += 64;
+	} else {
+		/* Straight from where the sample is in the chunk */
+		while (got < want) {
+			uint64_t off = bi->sample - bi->chunk.first_sample;
+			const uint32_t *group = bi->words + off / 32 * bi->n_channels;
+			int shift = off % 32;
+
+			int k = 32 - shift;
+			if (k > want - got) {
+				k = want - got;
+			}
+			for (left = bi->channels; left; left &= left - 1) {
+				int channel = __builtin_ctz(left);
+				int idx = bi->channel_words[channel];
+				uint32_t word = group[idx] << shift;
+				levels[channel] |= (uint64_t) (word >> (32 - k)) << (64 - got - k);
+			}
+			got += k;
+			bi->sample += k;
+		}
+	}
+
+	*n = got;
 
 	return 1;
 }
 
+/* Makes the next bit returned the one of `sample`. Seeks the file through
+ * its index when it can and reads its way there otherwise, so it only goes
+ * forward on pipes and containers without an index.
+ */
+static inline bool
+bit_input_seek(struct bit_input *bi, uint64_t sample)
+{
+	if (!bit_input_open(bi)) {
+		return false;
+	}
+
+	bi->seek_target = sample;
+
+	if (cap_input_seek(bi->ci, sample)) {
+		/* Force a chunk load at the next request */
+		bi->sample = bi->chunk_end = sample;
+		return true;
+	}
+
+	if (sample < bi->sample) {
+		ERROR("can't seek backwards in this input");
+		return false;
+	}
+
+	if (sample >= bi->chunk_end) {
+		/* Chunks before the target are skipped as they are read */
+		bi->sample = bi->chunk_end = sample;
+		return true;
+	}
+
+	while (bi->sample < sample) {
+		int b;
+		if (bit_input_get(bi, &b) <= 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Sample number of the next bit bit_input_get() returns */
+static inline uint64_t
+bit_input_sample(struct bit_input *bi)
+{
+	return bi->sample;
+}
+
+/* Length of the last gap reported by bit_input_get() */
+static inline uint64_t
+bit_input_gap(struct bit_input *bi)
+{
+	return bi->gap;
+}
+
+/* Blocks of a live capture we lost by reading too slowly */
+static inline uint64_t
+bit_input_live_dropped(struct bit_input *bi)
+{
+	return bi->ci != NULL && bi->ci->live != NULL ? bi->ci->live->dropped : 0;
+}
+
 #endif /* BITINPUT_H */
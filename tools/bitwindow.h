@@ -0,0 +1,145 @@
+#ifndef BITWINDOW_H
+#define BITWINDOW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "log.h"
+#include "bitinput.h"
+
+/* A stretch of one channel's samples, packed 64 to a word with the first in
+ * the most significant bit, for decoders that look back and ahead by whole
+ * words instead of going through bit_input_get() one sample at a time.
+ *
+ * The window holds samples [start, end). It grows at the end as decoders ask
+ * for more and they drop what they are done with from the start. A gap in
+ * the capture stops it from growing until bit_window_restart().
+ */
+
+struct bit_window {
+	struct bit_input *bi;
+	uint64_t *words; /* bits from `end` on are 0 */
+	size_t size; /* in words */
+	uint64_t start; /* sample in bit 63 of words[0], a multiple of 64 from the restart */
+	uint64_t end;
+	bool gap; /* the input has more only after a gap */
+};
+
+static inline bool
+bit_window_init(struct bit_window *w, struct bit_input *bi)
+{
+	memset(w, 0, sizeof(*w));
+	w->bi = bi;
+	w->size = 1024;
+	w->words = calloc(w->size, sizeof(w->words[0]));
+	if (w->words == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+	if (!bit_input_open(bi)) {
+		return false;
+	}
+	w->start = w->end = bit_input_sample(bi);
+
+	return true;
+}
+
+/* Empties the window and starts it again where the input is, after a gap */
+static inline void
+bit_window_restart(struct bit_window *w)
+{
+	memset(w->words, 0, w->size * sizeof(w->words[0]));
+	w->start = w->end = bit_input_sample(w->bi);
+	w->gap = false;
+}
+
+/* Forgets the samples before `sample` */
+static inline void
+bit_window_drop(struct bit_window *w, uint64_t sample)
+{
+	size_t k = (sample - w->start) / 64;
+	size_t used = (w->end - w->start + 63) / 64;
+
+	/* Whole words, and only once there are enough of them to be worth it */
+	if (k < w->size / 2) {
+		return;
+	}
+	memmove(w->words, w->words + k, (used - k) * sizeof(w->words[0]));
+	memset(w->words + used - k, 0, k * sizeof(w->words[0]));
+	w->start += 64 * k;
+}
+
+/* Reads until the window holds the samples before `until`. Returns 1, 0 if
+ * the capture ends first, -1 on errors or BIT_INPUT_GAP if samples are missing
+ * first; the window then holds what came before.
+ */
+static inline int
+bit_window_fill(struct bit_window *w, uint64_t until)
+{
+	while (w->end < until) {
+		uint64_t bits;
+		int n;
+
+		if (w->gap) {
+			return BIT_INPUT_GAP;
+		}
+
+		int result = bit_input_get_bits(w->bi, &bits, &n);
+		if (result == BIT_INPUT_GAP) {
+			w->gap = true;
+			return result;
+		} else if (result != 1) {
+			return result;
+		}
+
+		size_t used = (w->end - w->start) / 64 + 2;
+		if (used > w->size) {
+			size_t size = w->size * 2;
+			uint64_t *words = realloc(w->words, size * sizeof(words[0]));
+			if (words == NULL) {
+				ERROR("out of memory");
+				return -1;
+			}
+			memset(words + w->size, 0, (size - w->size) * sizeof(words[0]));
+			w->words = words;
+			w->size = size;
+		}
+
+		uint64_t off = w->end - w->start;
+		int shift = off % 64;
+		w->words[off / 64] |= bits >> shift;
+		if (shift + n > 64) {
+			w->words[off / 64 + 1] = bits << (64 - shift);
+		}
+		w->end += n;
+	}
+
+	return 1;
+}
+
+/* The 64 samples from `sample` on, the first in bit 63; those past the end
+ * of the window are 0
+ */
+static inline uint64_t
+bit_window_word(const struct bit_window *w, uint64_t sample)
+{
+	uint64_t off = sample - w->start;
+	int shift = off % 64;
+	uint64_t word = w->words[off / 64] << shift;
+
+	if (shift && off / 64 + 1 < w->size) {
+		word |= w->words[off / 64 + 1] >> (64 - shift);
+	}
+
+	return word;
+}
+
+static inline int
+bit_window_bit(const struct bit_window *w, uint64_t sample)
+{
+	uint64_t off = sample - w->start;
+
+	return (w->words[off / 64] >> (63 - off % 64)) & 1;
+}
+
+#endif /* BITWINDOW_H */
@@ -0,0 +1,951 @@
+#ifndef CAPINPUT_H
+#define CAPINPUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../capfile.h"
+#include "../edges.h"
+#include "../segments.h"
+#include "log.h"
+#include "liveinput.h"
+#include "codecinput.h"
+#include "timebase.h"
+
+/* Reads any iorec output as a sequence of chunks of samples: containers
+ * (capfile.h), bare edge files (edges.h), bare packed files, the live ring
+ * of a running iorec (liveinput.h) and the segments listed in a manifest
+ * (segments.h), one after the other. For bare files and live rings a
+ * cap_header is made up from what is known.
+ */
+
+#define CAP_INPUT_BARE_CHUNK_SIZE 65536
+
+enum cap_input_kind {
+	CAP_INPUT_BARE_PACKED,
+	CAP_INPUT_BARE_EDGES,
+	CAP_INPUT_CONTAINER,
+	CAP_INPUT_LIVE,
+};
+
+struct cap_chunk {
+	uint64_t first_sample;
+	uint32_t n_samples;
+	uint32_t payload_format; /* enum cap_payload_format */
+	uint32_t flags; /* CAP_CHUNK_GAP: n_samples were lost, no payload */
+	const uint8_t *payload;
+	size_t payload_len;
+};
+
+struct cap_segment {
+	char *path;
+	uint64_t first_sample;
+	uint64_t end_sample; /* 0 while it is being written */
+	uint64_t start_realtime_ns;
+	uint64_t end_realtime_ns;
+};
+
+struct cap_input {
+	int fd;
+	enum cap_input_kind kind;
+	struct cap_header hdr;
+	int n_channels;
+
+	/* Containers that were closed cleanly */
+	bool have_footer;
+	struct cap_footer footer;
+	struct cap_index_entry *index;
+	uint64_t n_index;
+
+	/* Bytes read while sniffing, handed out before reading more */
+	uint8_t pre[sizeof(struct cap_header)];
+	size_t pre_len;
+	size_t pre_pos;
+
+	uint8_t *buf;
+	size_t buf_size;
+	uint8_t *raw; /* decompressed payloads */
+	size_t raw_size;
+	uint64_t pos; /* file offset of the next byte */
+	uint64_t next_sample; /* bare packed files */
+	struct live_input *live;
+
+	/* Regular files can be read through a mapping (cap_input_map()) */
+	const uint8_t *map;
+	size_t map_len;
+
+	/* From the anchor table if the container was closed cleanly, otherwise
+	 * from the anchor chunks read so far */
+	struct timebase tb;
+	bool have_anchor_table;
+
+	/* Manifests: the header is the open segment's */
+	struct cap_segment *segments;
+	size_t n_segments;
+	size_t segment;
+	bool growing; /* the open segment is still being written, it may end mid-chunk */
+};
+
+/* Reads up to len bytes, less only at the end of the file */
+static inline ssize_t
+cap_input_read_some(struct cap_input *ci, void *out, size_t len)
+{
+	uint8_t *p = out;
+	size_t done = 0;
+
+	if (ci->map != NULL) {
+		size_t left = ci->pos < ci->map_len ? ci->map_len - ci->pos : 0;
+		done = len < left ? len : left;
+		memcpy(p, ci->map + ci->pos, done);
+		ci->pos += done;
+		return done;
+	}
+
+	while (done < len && ci->pre_pos < ci->pre_len) {
+		p[done++] = ci->pre[ci->pre_pos++];
+	}
+
+	while (done < len) {
+		ssize_t result = read(ci->fd, p + done, len - done);
+		if (result == -1) {
+			perror("read");
+			return -1;
+		} else if (result == 0) {
+			break;
+		}
+		done += result;
+	}
+
+	ci->pos += done;
+
+	return done;
+}
+
+/* Returns 1, 0 if the file ended before the first byte, -1 on errors or if
+ * it ended in the middle
+ */
+static inline int
+cap_input_read(struct cap_input *ci, void *out, size_t len)
+{
+	ssize_t result = cap_input_read_some(ci, out, len);
+
+	if (result == -1) {
+		return -1;
+	} else if (result == 0 && len) {
+		return 0;
+	} else if ((size_t) result < len && ci->growing) {
+		return 0;
+	} else if ((size_t) result < len) {
+		ERROR("truncated capture file");
+		return -1;
+	}
+
+	return 1;
+}
+
+static inline bool
+cap_input_reserve(struct cap_input *ci, size_t len)
+{
+	if (len <= ci->buf_size) {
+		return true;
+	}
+
+	uint8_t *buf = realloc(ci->buf, len);
+	if (buf == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+	ci->buf = buf;
+	ci->buf_size = len;
+
+	return true;
+}
+
+/* Like cap_input_read(), but points *out at the bytes: in place in a mapped
+ * file when they are aligned for the words of a payload, in ci->buf otherwise.
+ * *out is NULL when it returns 0 or -1 from a mapped file.
+ */
+static inline int
+cap_input_read_payload(struct cap_input *ci, size_t len, const uint8_t **out)
+{
+	*out = NULL;
+	if (ci->map != NULL && ((uintptr_t) (ci->map + ci->pos)) % sizeof(uint64_t) == 0) {
+		if (len && ci->pos >= ci->map_len) {
+			return 0;
+		} else if (ci->pos + len > ci->map_len) {
+			ERROR("truncated capture file");
+			return -1;
+		}
+		*out = ci->map + ci->pos;
+		ci->pos += len;
+		return 1;
+	}
+
+	if (!cap_input_reserve(ci, len)) {
+		return -1;
+	}
+	*out = ci->buf;
+
+	return cap_input_read(ci, ci->buf, len);
+}
+
+/* Replaces a compressed chunk payload by its decompressed form */
+static inline bool
+cap_input_decompress(struct cap_input *ci, struct cap_chunk *chunk, uint32_t codec)
+{
+	struct codec_header chdr;
+
+	if (chunk->payload_len < sizeof(chdr)) {
+		ERROR("truncated compressed chunk");
+		return false;
+	}
+	memcpy(&chdr, chunk->payload, sizeof(chdr));
+
+	if (chdr.raw_len > ci->raw_size) {
+		uint8_t *raw = realloc(ci->raw, chdr.raw_len);
+		if (raw == NULL) {
+			ERROR("out of memory");
+			return false;
+		}
+		ci->raw = raw;
+		ci->raw_size = chdr.raw_len;
+	}
+
+	const uint8_t *in = chunk->payload + sizeof(chdr);
+	size_t len = chunk->payload_len - sizeof(chdr);
+	bool ok = false;
+
+	if (codec == CAP_CODEC_BITRUN && chunk->payload_format == CAP_PAYLOAD_PACKED) {
+		size_t n_groups = chunk->n_samples / 32;
+		ok = chdr.raw_len == n_groups * ci->n_channels * sizeof(uint32_t)
+			&& codec_bitrun_decompress((uint32_t *) ci->raw, n_groups,
+				ci->n_channels, in, len);
+	} else if (codec == CAP_CODEC_LZ4) {
+		ok = codec_lz4_decompress(ci->raw, chdr.raw_len, in, len);
+	} else {
+		ERROR("unknown chunk codec %u", codec);
+		return false;
+	}
+
+	if (!ok) {
+		ERROR("corrupt %s chunk at sample %" PRIu64, codec_name(codec), chunk->first_sample);
+		return false;
+	}
+
+	chunk->payload = ci->raw;
+	chunk->payload_len = chdr.raw_len;
+
+	return true;
+}
+
+/* Loads the footer and index of a container, if the file is seekable and was
+ * closed cleanly. Leaves the file offset where it was.
+ */
+static inline void
+cap_input_load_index(struct cap_input *ci)
+{
+	struct stat st;
+	struct cap_index_header ihdr;
+
+	if (fstat(ci->fd, &st) == -1 || !S_ISREG(st.st_mode)
+		|| st.st_size < (off_t) (sizeof(ci->hdr) + sizeof(ihdr) + sizeof(ci->footer)))
+	{
+		return;
+	}
+
+	if (pread(ci->fd, &ci->footer, sizeof(ci->footer), st.st_size - sizeof(ci->footer))
+		!= sizeof(ci->footer)
+		|| memcmp(ci->footer.magic, CAP_FOOTER_MAGIC, sizeof(ci->footer.magic)) != 0)
+	{
+		return;
+	}
+
+	if (pread(ci->fd, &ihdr, sizeof(ihdr), ci->footer.index_offset) != sizeof(ihdr)
+		|| ihdr.magic != CAP_INDEX_MAGIC)
+	{
+		ERROR("capture footer points to a bad index, ignoring it");
+		return;
+	}
+
+	size_t len = ihdr.n_entries * sizeof(ci->index[0]);
+	ci->index = malloc(len ? len : 1);
+	if (ci->index == NULL
+		|| pread(ci->fd, ci->index, len, ci->footer.index_offset + sizeof(ihdr)) != (ssize_t) len)
+	{
+		ERROR("failed to read the capture index");
+		free(ci->index);
+		ci->index = NULL;
+		return;
+	}
+
+	ci->n_index = ihdr.n_entries;
+	ci->have_footer = true;
+
+	/* Captures from before anchors go straight to the footer */
+	struct cap_anchor_header ahdr;
+	uint64_t offset = ci->footer.index_offset + sizeof(ihdr) + len;
+	if (pread(ci->fd, &ahdr, sizeof(ahdr), offset) != sizeof(ahdr)
+		|| ahdr.magic != CAP_ANCHOR_MAGIC)
+	{
+		return;
+	}
+
+	uint64_t i;
+	for (i = 0; i < ahdr.n_entries; i++) {
+		struct cap_anchor a;
+		if (pread(ci->fd, &a, sizeof(a), offset + sizeof(ahdr) + i * sizeof(a)) != sizeof(a)
+			|| !timebase_add(&ci->tb, &a))
+		{
+			ERROR("failed to read the capture anchors");
+			return;
+		}
+	}
+	ci->have_anchor_table = true;
+}
+
+/* Reads the rest of a container header, once its magic is in ci->pre */
+static inline bool
+cap_input_read_header(struct cap_input *ci)
+{
+	/* Up to header_size, which tells how much of the rest there is */
+	size_t fixed = offsetof(struct cap_header, header_size) + sizeof(ci->hdr.header_size);
+
+	memset(&ci->hdr, 0, sizeof(ci->hdr));
+	memcpy(&ci->hdr, ci->pre, 8);
+	ci->pre_pos = 8;
+	ci->pos = 8;
+	if (cap_input_read(ci, ((uint8_t *) &ci->hdr) + 8, fixed - 8) != 1) {
+		ERROR("truncated capture header");
+		return false;
+	}
+	if (ci->hdr.version != CAP_FILE_VERSION) {
+		ERROR("unsupported capture file version %u", ci->hdr.version);
+		return false;
+	}
+
+	/* Older files have a shorter header, the fields they lack stay 0 */
+	size_t len = ci->hdr.header_size < sizeof(ci->hdr) ? ci->hdr.header_size : sizeof(ci->hdr);
+	if (len < fixed || cap_input_read(ci, ((uint8_t *) &ci->hdr) + fixed, len - fixed) != 1) {
+		ERROR("truncated capture header");
+		return false;
+	}
+
+	/* Skip fields added by later versions */
+	while (ci->pos < ci->hdr.header_size) {
+		uint8_t byte;
+		if (cap_input_read(ci, &byte, 1) != 1) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* bare_channel_mask is what bare packed files are assumed to hold */
+static inline struct cap_input *
+cap_input_open(int fd, uint32_t bare_channel_mask)
+{
+	struct cap_input *ci = malloc(sizeof(*ci));
+	if (ci == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(ci, 0, sizeof(*ci));
+	ci->fd = fd;
+
+	ssize_t result = cap_input_read_some(ci, ci->pre, 8);
+	if (result == -1) {
+		free(ci);
+		return NULL;
+	}
+	ci->pre_len = result;
+	ci->pos = 0; /* the bytes are handed out again */
+
+	if (result == 8 && memcmp(ci->pre, CAP_FILE_MAGIC, 8) == 0) {
+		ci->kind = CAP_INPUT_CONTAINER;
+		if (!cap_input_read_header(ci)) {
+			free(ci);
+			return NULL;
+		}
+		timebase_init(&ci->tb, ci->hdr.sample_rate, ci->hdr.start_monotonic_ns);
+		cap_input_load_index(ci);
+	} else if (result == 8 && memcmp(ci->pre, EDGE_FILE_MAGIC, 8) == 0) {
+		struct edge_file_header ehdr;
+
+		ci->kind = CAP_INPUT_BARE_EDGES;
+		if (cap_input_read(ci, &ehdr, sizeof(ehdr)) != 1) {
+			free(ci);
+			return NULL;
+		}
+		if (ehdr.version != EDGE_FILE_VERSION) {
+			ERROR("unsupported edge file version %u", ehdr.version);
+			free(ci);
+			return NULL;
+		}
+		ci->hdr.payload_format = CAP_PAYLOAD_EDGES;
+		ci->hdr.channel_mask = ehdr.channel_mask;
+	} else {
+		ci->kind = CAP_INPUT_BARE_PACKED;
+		ci->hdr.payload_format = CAP_PAYLOAD_PACKED;
+		ci->hdr.channel_mask = bare_channel_mask;
+	}
+
+	ci->n_channels = __builtin_popcount(ci->hdr.channel_mask);
+
+	return ci;
+}
+
+/* Moves on to segment k of a manifest. Its anchors join those of the
+ * segments read before.
+ */
+static inline bool
+cap_input_open_segment(struct cap_input *ci, size_t k)
+{
+	const struct cap_segment *seg = &ci->segments[k];
+	struct cap_header first = ci->hdr;
+
+	if (ci->fd != -1) {
+		close(ci->fd);
+	}
+	free(ci->index);
+	ci->index = NULL;
+	ci->n_index = 0;
+	ci->have_footer = false;
+	ci->have_anchor_table = false;
+	ci->growing = false;
+	ci->pre_len = ci->pre_pos = 0;
+	ci->pos = 0;
+	ci->segment = k;
+
+	ci->fd = open(seg->path, O_RDONLY);
+	if (ci->fd == -1) {
+		perror("open");
+		ERROR("can't open segment %s, it may have been deleted to stay within the disk budget",
+			seg->path);
+		return false;
+	}
+
+	ssize_t result = cap_input_read_some(ci, ci->pre, 8);
+	if (result != 8 || memcmp(ci->pre, CAP_FILE_MAGIC, 8) != 0) {
+		ERROR("segment %s is not a capture container", seg->path);
+		return false;
+	}
+	ci->pre_len = 8;
+	if (!cap_input_read_header(ci)) {
+		return false;
+	}
+
+	if (k == 0) {
+		timebase_init(&ci->tb, ci->hdr.sample_rate, ci->hdr.start_monotonic_ns);
+	} else if (ci->hdr.channel_mask != first.channel_mask
+		|| ci->hdr.payload_format != first.payload_format)
+	{
+		ERROR("segment %s doesn't hold the same channels as the ones before", seg->path);
+		return false;
+	}
+	cap_input_load_index(ci);
+	ci->growing = seg->end_realtime_ns == 0;
+
+	return true;
+}
+
+/* Reads the segments of an iorec --segment-size/--segment-duration capture
+ * from its manifest, oldest first.
+ */
+static inline struct cap_input *
+cap_input_open_manifest(const char *path)
+{
+	char line[4096], name[4096];
+	size_t size = 0;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen");
+		return NULL;
+	}
+
+	struct cap_input *ci = malloc(sizeof(*ci));
+	if (ci == NULL) {
+		ERROR("out of memory");
+		fclose(f);
+		return NULL;
+	}
+	memset(ci, 0, sizeof(*ci));
+	ci->fd = -1;
+	ci->kind = CAP_INPUT_CONTAINER;
+
+	if (fgets(line, sizeof(line), f) == NULL
+		|| strncmp(line, SEGMENTS_MANIFEST_MAGIC, strlen(SEGMENTS_MANIFEST_MAGIC)) != 0)
+	{
+		ERROR("%s is not a segment manifest", path);
+		goto fail;
+	}
+
+	/* Segment names are relative to the manifest */
+	const char *slash = strrchr(path, '/');
+	int dir_len = slash ? slash - path + 1 : 0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct cap_segment seg;
+
+		if (line[0] == '#') {
+			continue;
+		}
+		if (sscanf(line, "%4095s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+				name, &seg.first_sample, &seg.end_sample,
+				&seg.start_realtime_ns, &seg.end_realtime_ns) != 5)
+		{
+			ERROR("bad manifest line: %s", line);
+			goto fail;
+		}
+
+		if (ci->n_segments == size) {
+			size = size ? size * 2 : 64;
+			struct cap_segment *segments = realloc(ci->segments, size * sizeof(*segments));
+			if (segments == NULL) {
+				ERROR("out of memory");
+				goto fail;
+			}
+			ci->segments = segments;
+		}
+		seg.path = malloc(dir_len + strlen(name) + 1);
+		if (seg.path == NULL) {
+			ERROR("out of memory");
+			goto fail;
+		}
+		sprintf(seg.path, "%.*s%s", dir_len, path, name);
+		ci->segments[ci->n_segments++] = seg;
+	}
+	fclose(f);
+	f = NULL;
+
+	if (ci->n_segments == 0) {
+		ERROR("%s lists no segments", path);
+		goto fail;
+	}
+	if (!cap_input_open_segment(ci, 0)) {
+		goto fail;
+	}
+	ci->n_channels = __builtin_popcount(ci->hdr.channel_mask);
+
+	return ci;
+
+fail:
+	if (f != NULL) {
+		fclose(f);
+	}
+	if (ci->fd != -1) {
+		close(ci->fd);
+	}
+	while (ci->n_segments) {
+		free(ci->segments[--ci->n_segments].path);
+	}
+	free(ci->segments);
+	free(ci->index);
+	free(ci);
+	return NULL;
+}
+
+/* First sample of the last `seconds` of a manifest's capture, going by the
+ * wall clock times the manifest records. A segment still being written is
+ * taken to end now.
+ */
+static inline uint64_t
+cap_input_recent_sample(struct cap_input *ci, double seconds)
+{
+	const struct cap_segment *last = &ci->segments[ci->n_segments - 1];
+	struct timespec now;
+	size_t k;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t end_ns = last->end_realtime_ns ? last->end_realtime_ns
+		: (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	double target_ns = end_ns - seconds * 1e9;
+
+	for (k = ci->n_segments - 1; k > 0 && ci->segments[k].start_realtime_ns > target_ns; k--) {
+	}
+	const struct cap_segment *seg = &ci->segments[k];
+	if (target_ns <= seg->start_realtime_ns) {
+		return seg->first_sample;
+	}
+
+	double rate = ci->hdr.sample_rate;
+	if (seg->end_realtime_ns > seg->start_realtime_ns) {
+		rate = (seg->end_sample - seg->first_sample)
+			/ ((seg->end_realtime_ns - seg->start_realtime_ns) / 1e9);
+	}
+
+	return seg->first_sample + (uint64_t) ((target_ns - seg->start_realtime_ns) / 1e9 * rate);
+}
+
+/* Attaches to the live ring iorec --live=path publishes */
+static inline struct cap_input *
+cap_input_open_live(const char *path)
+{
+	struct cap_input *ci = malloc(sizeof(*ci));
+	if (ci == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(ci, 0, sizeof(*ci));
+	ci->fd = -1;
+	ci->kind = CAP_INPUT_LIVE;
+	ci->live = live_input_attach(path);
+	if (ci->live == NULL) {
+		free(ci);
+		return NULL;
+	}
+
+	ci->hdr.payload_format = CAP_PAYLOAD_PACKED;
+	ci->hdr.channel_mask = ci->live->hdr->channel_mask;
+	ci->hdr.sample_rate = ci->live->hdr->sample_rate;
+	ci->hdr.start_monotonic_ns = ci->live->hdr->start_monotonic_ns;
+	ci->hdr.start_realtime_ns = ci->live->hdr->start_realtime_ns;
+	timebase_init(&ci->tb, ci->hdr.sample_rate, ci->hdr.start_monotonic_ns);
+	ci->n_channels = __builtin_popcount(ci->hdr.channel_mask);
+
+	return ci;
+}
+
+static inline int cap_input_next_chunk(struct cap_input *ci, struct cap_chunk *chunk);
+
+/* At the end of a container: goes on with the next segment if there is one */
+static inline int
+cap_input_next_segment(struct cap_input *ci, struct cap_chunk *chunk)
+{
+	if (ci->segment + 1 >= ci->n_segments) {
+		return 0;
+	}
+	if (!cap_input_open_segment(ci, ci->segment + 1)) {
+		return -1;
+	}
+
+	return cap_input_next_chunk(ci, chunk);
+}
+
+/* Returns 1 and fills chunk, 0 at the end of the capture or -1 on error.
+ * The payload stays valid until the next call.
+ */
+static inline int
+cap_input_next_chunk(struct cap_input *ci, struct cap_chunk *chunk)
+{
+	int result;
+
+	if (ci->kind == CAP_INPUT_CONTAINER) {
+		struct cap_chunk_header chdr;
+
+		if (ci->have_footer && ci->pos >= ci->footer.index_offset) {
+			return cap_input_next_segment(ci, chunk);
+		}
+
+		result = cap_input_read(ci, &chdr, sizeof(chdr));
+		if (result == 0) {
+			return cap_input_next_segment(ci, chunk);
+		} else if (result != 1) {
+			return result;
+		}
+		if (chdr.magic == CAP_INDEX_MAGIC) {
+			return cap_input_next_segment(ci, chunk);
+		} else if (chdr.magic != CAP_CHUNK_MAGIC) {
+			ERROR("bad chunk magic at offset %" PRIu64, ci->pos - sizeof(chdr));
+			return -1;
+		}
+
+		const uint8_t *payload;
+		result = cap_input_read_payload(ci, chdr.payload_len, &payload);
+		if (result == 0 && ci->growing) {
+			return 0;
+		} else if (result == 0) {
+			/* Cut off right after the header, by a crash for instance */
+			ERROR("truncated capture file");
+			return -1;
+		} else if (result == -1) {
+			return -1;
+		}
+
+		if (chdr.flags & CAP_CHUNK_ANCHORS) {
+			size_t i;
+			for (i = 0; !ci->have_anchor_table && i < chdr.payload_len / sizeof(struct cap_anchor); i++) {
+				struct cap_anchor a;
+				memcpy(&a, payload + i * sizeof(a), sizeof(a));
+				if (!timebase_add(&ci->tb, &a)) {
+					return -1;
+				}
+			}
+			return cap_input_next_chunk(ci, chunk);
+		}
+
+		chunk->first_sample = chdr.first_sample;
+		chunk->n_samples = chdr.n_samples;
+		chunk->flags = chdr.flags;
+		chunk->payload_format = ci->hdr.payload_format;
+		chunk->payload = payload;
+		chunk->payload_len = chdr.payload_len;
+
+		uint32_t codec = CAP_CHUNK_CODEC(chdr.flags);
+		if (codec != CAP_CODEC_NONE && !cap_input_decompress(ci, chunk, codec)) {
+			return -1;
+		}
+	} else if (ci->kind == CAP_INPUT_LIVE) {
+		result = live_input_next(ci->live, &chunk->first_sample, &chunk->n_samples,
+			&chunk->payload, &chunk->payload_len);
+		if (result != 1) {
+			return result;
+		}
+		chunk->flags = 0;
+		chunk->payload_format = CAP_PAYLOAD_PACKED;
+	} else if (ci->kind == CAP_INPUT_BARE_EDGES) {
+		struct edge_block_header ehdr;
+
+		result = cap_input_read(ci, &ehdr, sizeof(ehdr));
+		if (result != 1) {
+			return result;
+		}
+		if (ehdr.magic != EDGE_BLOCK_MAGIC) {
+			ERROR("bad edge block magic");
+			return -1;
+		}
+
+		/* The payload is the whole block, header included */
+		if (!cap_input_reserve(ci, sizeof(ehdr) + ehdr.payload_len)) {
+			return -1;
+		}
+		memcpy(ci->buf, &ehdr, sizeof(ehdr));
+		result = cap_input_read(ci, ci->buf + sizeof(ehdr), ehdr.payload_len);
+		if (result == 0) {
+			ERROR("truncated capture file");
+			return -1;
+		} else if (result == -1) {
+			return -1;
+		}
+
+		chunk->first_sample = ehdr.first_sample;
+		chunk->n_samples = ehdr.n_samples;
+		chunk->flags = 0;
+		chunk->payload_format = CAP_PAYLOAD_EDGES;
+		chunk->payload = ci->buf;
+		chunk->payload_len = sizeof(ehdr) + ehdr.payload_len;
+	} else {
+		size_t group_size = ci->n_channels * sizeof(uint32_t);
+		size_t want = CAP_INPUT_BARE_CHUNK_SIZE / group_size * group_size;
+		const uint8_t *payload;
+		ssize_t got;
+
+		if (ci->map != NULL) {
+			payload = ci->map + ci->pos;
+			got = ci->pos < ci->map_len ? ci->map_len - ci->pos : 0;
+			got = got < (ssize_t) want ? got : (ssize_t) want;
+			ci->pos += got;
+		} else {
+			if (!cap_input_reserve(ci, want)) {
+				return -1;
+			}
+			payload = ci->buf;
+			got = cap_input_read_some(ci, ci->buf, want);
+			if (got == -1) {
+				return -1;
+			}
+		}
+		/* A trailing partial group is dropped */
+		got -= got % group_size;
+		if (got == 0) {
+			return 0;
+		}
+
+		chunk->first_sample = ci->next_sample;
+		chunk->n_samples = got / group_size * 32;
+		chunk->flags = 0;
+		chunk->payload_format = CAP_PAYLOAD_PACKED;
+		chunk->payload = payload;
+		chunk->payload_len = got;
+		ci->next_sample += chunk->n_samples;
+	}
+
+	return 1;
+}
+
+/* Positions the input so that the next chunk holds `sample`, or is the first
+ * one after it. In a manifest, the segment being written has no index and
+ * reading starts from its beginning. Returns false if the file can't be
+ * seeked (not a regular file, or a container without index), in which case
+ * the caller has to read its way there.
+ */
+static inline bool
+cap_input_seek(struct cap_input *ci, uint64_t sample)
+{
+	uint64_t offset;
+
+	if (ci->n_segments) {
+		size_t k = ci->n_segments - 1;
+		while (k > 0 && ci->segments[k].first_sample > sample) {
+			k--;
+		}
+		if (k != ci->segment || !ci->have_footer) {
+			if (!cap_input_open_segment(ci, k)) {
+				return false;
+			}
+			if (!ci->have_footer) {
+				return true;
+			}
+		}
+	}
+
+	if (ci->kind == CAP_INPUT_CONTAINER && ci->have_footer && ci->n_index) {
+		/* Without gaps, chunk k starts at k * samples_per_chunk */
+		uint64_t k = sample / ci->hdr.samples_per_chunk;
+		if (k >= ci->n_index || ci->index[k].first_sample > sample
+			|| (k + 1 < ci->n_index && ci->index[k + 1].first_sample <= sample))
+		{
+			/* Last chunk starting at or before the sample */
+			uint64_t lo = 0, hi = ci->n_index;
+			while (hi - lo > 1) {
+				uint64_t mid = lo + (hi - lo) / 2;
+				if (ci->index[mid].first_sample <= sample) {
+					lo = mid;
+				} else {
+					hi = mid;
+				}
+			}
+			k = lo;
+		}
+		offset = ci->index[k].offset;
+	} else if (ci->kind == CAP_INPUT_BARE_PACKED) {
+		uint64_t group = sample / 32;
+		offset = group * ci->n_channels * sizeof(uint32_t);
+		ci->next_sample = group * 32;
+	} else {
+		return false;
+	}
+
+	if (ci->map == NULL && lseek(ci->fd, offset, SEEK_SET) == (off_t) -1) {
+		return false;
+	}
+	ci->pos = offset;
+	ci->pre_pos = ci->pre_len;
+
+	return true;
+}
+
+/* Sample after the last one of an input that cap_input_seek() can seek, 0
+ * if unknown
+ */
+static inline uint64_t
+cap_input_end_sample(struct cap_input *ci)
+{
+	struct stat st;
+
+	if (ci->n_segments) {
+		return 0;
+	} else if (ci->kind == CAP_INPUT_CONTAINER && ci->have_footer && ci->n_index) {
+		return ci->footer.end_sample;
+	} else if (ci->kind == CAP_INPUT_BARE_PACKED && fstat(ci->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		return st.st_size / (ci->n_channels * sizeof(uint32_t)) * 32;
+	}
+
+	return 0;
+}
+
+/* Reads a regular file through a mapping from now on, so that payloads are
+ * used where they are and cap_input_clone() works. Returns false and leaves
+ * the input as it was for anything else.
+ */
+static inline bool
+cap_input_map(struct cap_input *ci)
+{
+	struct stat st;
+
+	if (ci->kind == CAP_INPUT_LIVE || ci->n_segments
+		|| fstat(ci->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ci->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+
+	ci->map = map;
+	ci->map_len = st.st_size;
+	/* ci->pos is where the sniffed bytes are in the file */
+	ci->pre_pos = ci->pre_len;
+
+	return true;
+}
+
+/* Another reader of a mapped input, for another thread. It shares the
+ * mapping, the index and the timebase, and has to be seeked before use.
+ * Anchor chunks are left to the original.
+ */
+static inline struct cap_input *
+cap_input_clone(const struct cap_input *ci)
+{
+	struct cap_input *clone = malloc(sizeof(*clone));
+	if (clone == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	*clone = *ci;
+	clone->buf = clone->raw = NULL;
+	clone->buf_size = clone->raw_size = 0;
+	clone->have_anchor_table = true;
+
+	return clone;
+}
+
+/* Sample rate to use for time conversions: measured from the anchors, or over
+ * the whole capture when the footer is there, nominal otherwise. 0 if unknown.
+ */
+static inline double
+cap_input_sample_rate(struct cap_input *ci)
+{
+	if (ci->tb.n >= 2) {
+		return timebase_rate(&ci->tb);
+	}
+	if (ci->have_footer && ci->footer.end_monotonic_ns > ci->hdr.start_monotonic_ns) {
+		return ci->footer.end_sample
+			/ ((ci->footer.end_monotonic_ns - ci->hdr.start_monotonic_ns) / 1e9);
+	}
+
+	return ci->hdr.sample_rate;
+}
+
+/* Sample at `seconds` from sample 0, interpolated between anchors when the
+ * capture has them. -1 if the capture has no time information.
+ */
+static inline double
+cap_input_time_to_sample(struct cap_input *ci, double seconds)
+{
+	if (ci->tb.n < 2) {
+		double rate = cap_input_sample_rate(ci);
+		return rate ? seconds * rate : -1;
+	}
+
+	return timebase_sample(&ci->tb, seconds);
+}
+
+/* Seconds from sample 0 to `sample`, -1 if unknown */
+static inline double
+cap_input_sample_to_time(struct cap_input *ci, uint64_t sample)
+{
+	if (ci->tb.n < 2) {
+		double rate = cap_input_sample_rate(ci);
+		return rate ? sample / rate : -1;
+	}
+
+	return timebase_time(&ci->tb, sample);
+}
+
+#endif /* CAPINPUT_H */
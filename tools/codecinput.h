@@ -0,0 +1,151 @@
+#ifndef CODECINPUT_H
+#define CODECINPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../codec.h"
+#include "log.h"
+
+/* Decompression of chunks written with iorec --compress, see codec.h */
+
+static inline bool
+codec_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		uint8_t b = *(*p)++;
+		*v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+		shift += 7;
+	}
+
+	return false;
+}
+
+/* Fills n_groups groups of planes from a bit-run payload */
+static inline bool
+codec_bitrun_decompress(uint32_t *planes, size_t n_groups, int n_channels,
+		const uint8_t *in, size_t len)
+{
+	const uint8_t *p = in;
+	const uint8_t *end = in + len;
+	uint64_t n_samples = n_groups * 32;
+	int c;
+
+	for (c = 0; c < n_channels; c++) {
+		uint64_t s = 0;
+		uint32_t word = 0;
+
+		if (p >= end) {
+			return false;
+		}
+		int cur = *p++ & 1;
+
+		while (s < n_samples) {
+			uint64_t run;
+			if (!codec_get_varint(&p, end, &run) || run == 0 || run > n_samples - s) {
+				return false;
+			}
+
+			/* Whole words of the same value go in one store */
+			while (run) {
+				uint64_t bit = s % 32;
+				uint64_t n = 32 - bit < run ? 32 - bit : run;
+				uint32_t ones = n == 32 ? ~0u : ((1u << n) - 1) << (32 - bit - n);
+				if (cur) {
+					word |= ones;
+				}
+				s += n;
+				run -= n;
+				if (s % 32 == 0) {
+					planes[(s / 32 - 1) * n_channels + c] = word;
+					word = 0;
+				}
+			}
+			cur ^= 1;
+		}
+	}
+
+	return p == end;
+}
+
+/* Returns false unless in decompresses to exactly out_len bytes */
+static inline bool
+codec_lz4_decompress(uint8_t *out, size_t out_len, const uint8_t *in, size_t len)
+{
+	const uint8_t *ip = in;
+	const uint8_t *iend = in + len;
+	uint8_t *op = out;
+	uint8_t *oend = out + out_len;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit_len = token >> 4;
+		uint8_t b;
+
+		if (lit_len == 15) {
+			do {
+				if (ip >= iend) {
+					return false;
+				}
+				b = *ip++;
+				lit_len += b;
+			} while (b == 255);
+		}
+		if (lit_len > (size_t) (iend - ip) || lit_len > (size_t) (oend - op)) {
+			return false;
+		}
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* The last sequence has no match */
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return false;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - out)) {
+			return false;
+		}
+
+		size_t match_len = token & 15;
+		if (match_len == 15) {
+			do {
+				if (ip >= iend) {
+					return false;
+				}
+				b = *ip++;
+				match_len += b;
+			} while (b == 255);
+		}
+		match_len += 4;
+		if (match_len > (size_t) (oend - op)) {
+			return false;
+		}
+
+		/* Matches may overlap what they produce */
+		const uint8_t *ref = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		} else {
+			while (match_len--) {
+				*op++ = *ref++;
+			}
+		}
+	}
+
+	return op == oend;
+}
+
+#endif /* CODECINPUT_H */
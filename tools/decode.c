@@ -4,10 +4,17 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <math.h>
 #include "bitinput.h"
+#include "bitwindow.h"
+#include "annotation.h"
+#include "decoder.h"
+#include "uart.h"
 #include "log.h"
 
 #define SYNC_FRAME_LENGTH 81
@@ -16,187 +23,259 @@
 int sync_frame_length = 81;
 int sync_frame_length_tol = 5;
 
-enum phase {
-	PHASE_SYNC=0,
-	PHASE_DECODE,
+/* Parallel decoding (--jobs) splits the capture into pieces at sync points
+ * that the sequential UART decoder is bound to take: falling edges after
+ * enough high samples that no frame can still be open and the sync phase has
+ * seen two frames of them. From there on, what it does no longer depends on
+ * what came before, so each piece is decoded on its own and the outputs are
+ * put back together in order.
+ */
+struct job {
+	uint64_t from; /* the piece starts at the first sync point from here */
+	uint64_t to; /* and ends at the first one from there */
+
+	char *out;
+	size_t out_len;
+	char *err;
+	size_t err_len;
+	struct ann_writer ann; /* in memory, from ann_from on */
+	uint64_t ann_from;
+	bool done;
 };
 
-struct state {
-	enum phase phase;
+struct jobs {
+	struct bit_input *bi;
+	struct uart_config cfg;
+	struct ann_writer *ann; /* NULL without --annotation-out */
+	struct job *jobs;
+	size_t n_jobs;
+	size_t next; /* to hand out */
 
-	/* sync phase */
-	int last; /* were we high or low */
-	int consecutive_highs;
-
-	/* frame decode */
-	int frame_length;
-	char *frame_samples;
-	size_t n_frame_samples;
-	size_t frame_required_samples;
-	off_t beginning_of_frame;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when a job is done */
 };
 
-int annotation_fd = 0;
-
-bool
-open_annotation(const char *annotation_out_file)
+/* First sample from `from` on with, right before it and within the samples
+ * read from `from`, enough highs without a gap to be a sync point. UINT64_MAX
+ * if there is none.
+ */
+uint64_t
+find_sync_point(struct bit_window *w, uint64_t from)
 {
-	if (annotation_out_file == NULL) {
-		annotation_out_file = "/dev/null";
-	}
-	annotation_fd = open(annotation_out_file, O_CREAT | O_TRUNC | O_WRONLY, 0600);
-	if (annotation_fd == -1) {
-		perror("open");
-		return false;
-	}
+	uint64_t want = 2 * sync_frame_length + uart_frame_reach(sync_frame_length);
+	uint64_t highs = 0;
+	uint64_t pos;
 
-	return true;
-}
-
-void
-annotate(off_t offset, char c)
-{
-	if (lseek(annotation_fd, offset, SEEK_SET) == -1) {
-		perror("seek");
+	if (!bit_input_seek(w->bi, from)) {
+		ERROR("failed to seek to sample %" PRIu64, from);
 		abort();
 	}
+	bit_window_restart(w);
+	pos = w->start;
 
-	if (write(annotation_fd, &c, 1) == -1) {
-		perror("write");
-		abort();
-	}
-}
+	for (;;) {
+		int result = bit_window_fill(w, pos + 64);
+		int n = w->end - pos < 64 ? w->end - pos : 64;
+
+		if (n == 0) {
+			if (result == BIT_INPUT_GAP) {
+				bit_window_restart(w);
+				pos = w->start;
+				highs = 0;
+				continue;
+			} else if (result == -1) {
+				ERROR("error getting next bit");
+				abort();
+			}
+			return UINT64_MAX;
+		}
 
-bool
-is_within_tol(int v, int ref, int tol)
-{
-	return (v > ref - tol && v < ref + tol);
-}
+		uint64_t x = bit_window_word(w, pos);
+		uint64_t lows = ~x & (~0ull << (64 - n));
+		int counted = 0;
 
-void
-enter_sync(struct state *s)
-{
-	s->phase = PHASE_SYNC;
-	s->consecutive_highs = 0;
-}
+		while (lows) {
+			int p = __builtin_clzll(lows);
+			if (highs + (p - counted) >= want) {
+				return pos + p;
+			}
+			highs = 0;
+			counted = p + 1;
+			lows &= ~(1ull << (63 - p));
+		}
 
-void
-enter_decode_frames(struct state *s, uint32_t frame_length, off_t off)
-{
-	s->phase = PHASE_DECODE;
-	s->frame_length = frame_length;
-	// FIXME HACK we want decode_frames() to see this first bit which
-	// was already consumed so we add it here
-	s->n_frame_samples = 1;
-	s->frame_samples[0] = 0; // also part of this hack
-	s->frame_required_samples = frame_length + frame_length / 8;
-	s->beginning_of_frame = off;
+		highs += n - counted;
+		pos += n;
+		bit_window_drop(w, pos);
+	}
 }
 
-int
-decode_frames(struct state *s, int b, size_t off)
+void
+run_job(struct jobs *jobs, struct job *job, struct bit_window *w)
 {
-	/* FIXME: no boundary checks */
-	int i,j;
+	struct uart_config cfg = jobs->cfg;
+	uint64_t start = job->from;
+	FILE *out = open_memstream(&job->out, &job->out_len);
+	FILE *err = open_memstream(&job->err, &job->err_len);
 
-	if (b != 0 && b!= 1) {
+	if (out == NULL || err == NULL) {
+		perror("open_memstream");
 		abort();
 	}
-	s->frame_samples[s->n_frame_samples++] = b;
 
-	if (s->n_frame_samples < s->frame_required_samples) {
-		return;
+	if (job != &jobs->jobs[jobs->n_jobs - 1]) {
+		cfg.stop = find_sync_point(w, job->to);
 	}
 
-	/* Ok we have a full frame, decode bits */
-	unsigned char bits = 0;
+	/* The first starts where the sequential decoder does, the others at a
+	 * sync point: frames don't reach back past it */
+	if (job != &jobs->jobs[0]) {
+		start = find_sync_point(w, job->from);
+		cfg.start_in_frame = true;
+	}
 
-	for (i = 0; i < 10; i++) {
-		size_t offset = s->frame_length * i / 10;
-		int bit = 1;
-		for (j = 0; j < 3; j++) {
-			/* look at 3 samples; if any is low, consider the bit low */
-			if (!s->frame_samples[offset + j]) {
-				bit = 0;
-			}
+	if (start < cfg.stop) {
+		struct uart *u = uart_create(&cfg);
+		struct decoder *d = &u->d;
+
+		if (u == NULL || !bit_input_seek(w->bi, start)) {
+			ERROR("failed to seek to sample %" PRIu64, start);
+			abort();
 		}
-		annotate(s->beginning_of_frame + offset, (bit)?'B':'b');
-
-		if (i == 0) {
-			/* Start bit */
-			if (bit != 0) {
-				ERROR("didn't find start bit, resetting sync");
-				enter_sync(s);
-				return 0;
+		d->out = out;
+		d->err = err;
+		if (jobs->ann) {
+			job->ann_from = cfg.start_in_frame ? start - 1 : start;
+			if (!ann_writer_init(&job->ann, -1, job->ann_from)) {
+				abort();
 			}
-		} else if (i == 9) {
-			/* Stop bit */
-			if (bit != 1) {
-				ERROR("didn't find stop bit, resetting sync");
-				enter_sync(s);
-				return 0;
-			}
-		} else {
-			bits >>= 1;
-			bits |= (bit << 7);
+			decoder_annotate_to(d, &job->ann, job->ann_from);
 		}
+		if (!decode_pass(w->bi, &d, 1)) {
+			abort();
+		}
+		d->ops->destroy(d);
 	}
 
-	/* We're done; use this byte */
-	if (write(STDOUT_FILENO, &bits, 1) == -1) {
-		perror("write");
+	fclose(out);
+	fclose(err);
+}
+
+void *
+job_thread(void *arg)
+{
+	struct jobs *jobs = arg;
+	struct bit_window w;
+	struct bit_input *bi = bit_input_clone(jobs->bi);
+
+	if (bi == NULL || !bit_window_init(&w, bi)) {
 		abort();
 	}
 
-	/* Now reset the state machine for the next frame */
+	for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		size_t k = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
 
-	/* From the offset of the 9th (0-based) bit, search for a low sample */
-	for (i = s->frame_length * 9 / 10 + 1; i < s->n_frame_samples; i++) {
-		annotate(s->beginning_of_frame + i, '>');
-		if (s->frame_samples[i] == 0) {
-			annotate(s->beginning_of_frame + i, 'v');
-			/* Found the beginning of the next frame. Reuse the samples */
-			memmove(s->frame_samples, &s->frame_samples[i], sizeof(s->frame_samples[0]) * s->n_frame_samples - i);
-			s->beginning_of_frame = s->beginning_of_frame + i;
-			s->n_frame_samples = s->n_frame_samples - i;
-			return 0;
+		if (k >= jobs->n_jobs) {
+			break;
 		}
+		run_job(jobs, &jobs->jobs[k], &w);
+
+		pthread_mutex_lock(&jobs->lock);
+		jobs->jobs[k].done = true;
+		pthread_cond_broadcast(&jobs->cond);
+		pthread_mutex_unlock(&jobs->lock);
 	}
 
-	ERROR("couldn't find next frame");
-	enter_sync(s);
-	return 0;
+	return NULL;
 }
 
-int
-decode_sync(struct state *s, int b, size_t off)
+/* Decodes samples [from, end) with UART decoders set up like cfg, on
+ * n_threads threads, annotating to ann if it isn't NULL. Returns false if it
+ * can't start them.
+ */
+bool
+decode_parallel(struct bit_input *bi, uint64_t from, uint64_t end, int n_threads,
+	const struct uart_config *cfg, struct ann_writer *ann)
 {
-	if (s->last && !b) {
-		/* Transition from high to low */
+	struct jobs jobs;
+	pthread_t threads[n_threads];
+	size_t k;
+	int i;
+
+	/* Pieces small enough to balance the load, large enough that finding
+	 * their sync points doesn't matter */
+	uint64_t min_len = 1024 * (2 * sync_frame_length + uart_frame_reach(sync_frame_length));
+	if (min_len < (1 << 20)) {
+		min_len = 1 << 20;
+	}
+	jobs.n_jobs = (end - from) / min_len;
+	if (jobs.n_jobs > (size_t) n_threads * 8) {
+		jobs.n_jobs = n_threads * 8;
+	}
+	/* Annotations wait in memory until their piece's turn */
+	if (ann && jobs.n_jobs < (end - from) >> 26) {
+		jobs.n_jobs = (end - from) >> 26;
+	}
+	if (jobs.n_jobs < 1) {
+		jobs.n_jobs = 1;
+	}
 
-		if (s->consecutive_highs >= sync_frame_length * 2) {
-			annotate(off-1, '!');
-			enter_decode_frames(s, sync_frame_length, off);
-		}
+	jobs.bi = bi;
+	jobs.cfg = *cfg;
+	jobs.ann = ann;
+	jobs.next = 0;
+	jobs.jobs = calloc(jobs.n_jobs, sizeof(jobs.jobs[0]));
+	if (jobs.jobs == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+	for (k = 0; k < jobs.n_jobs; k++) {
+		jobs.jobs[k].from = from + (end - from) / jobs.n_jobs * k;
+		jobs.jobs[k].to = from + (end - from) / jobs.n_jobs * (k + 1);
+	}
+	pthread_mutex_init(&jobs.lock, NULL);
+	pthread_cond_init(&jobs.cond, NULL);
 
-		s->consecutive_highs = 0;
-	} else if (b) {
-		s->consecutive_highs++;
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, job_thread, &jobs) != 0) {
+			ERROR("failed to start decoding thread");
+			return false;
+		}
 	}
 
-	s->last = b;
-}
+	/* Outputs go out in order, as pieces get done */
+	for (k = 0; k < jobs.n_jobs; k++) {
+		struct job *job = &jobs.jobs[k];
 
-int decode(struct state *s, int b, size_t off)
-{
-	if (s->phase == PHASE_SYNC) {
-		return decode_sync(s, b, off);
-	} else if (s->phase == PHASE_DECODE) {
-		return decode_frames(s, b, off);
-	} else {
-		ERROR("unknown phase %d", s->phase);
-		return -1;
+		pthread_mutex_lock(&jobs.lock);
+		while (!job->done) {
+			pthread_cond_wait(&jobs.cond, &jobs.lock);
+		}
+		pthread_mutex_unlock(&jobs.lock);
+
+		if (write(STDOUT_FILENO, job->out, job->out_len) == -1
+			|| write(STDERR_FILENO, job->err, job->err_len) == -1)
+		{
+			perror("write");
+			abort();
+		}
+		if (ann && !ann_writer_take(ann, &job->ann, job->ann_from)) {
+			ERROR("failed to write annotations");
+			abort();
+		}
+		free(job->out);
+		free(job->err);
+		free(job->ann.buf);
 	}
+
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(jobs.jobs);
+
+	return true;
 }
 
 void
@@ -204,10 +283,105 @@ usage(char *progname)
 {
 	fprintf(stderr, "Usage:\n");
 	fprintf(stderr, "\t%s -h\n", progname);
-	fprintf(stderr, "\t%s [ --annotation-out ANNOTATION_FILE ] <FILE_IN\n", progname);
+	fprintf(stderr, "\t%s [ --annotation-out ANNOTATION_FILE ] [ --channels=MASK --channel=BIT ]\n"
+		"\t\t[ --baud=RATE | --frame-length=SAMPLES|auto [ --frame-length-tol=SAMPLES ] ]\n"
+		"\t\t[ --track-drift ] [ --seek=SAMPLE | --seek-time=SECONDS ] [ --jobs=N ] <FILE_IN\n", progname);
+	fprintf(stderr, "\t%s [ options ] --decoder=NAME[,channel=BIT][,out=FILE][,annotation-out=FILE]...\n", progname);
+	fprintf(stderr, "\t%s [ options ] --live=SOCKET\n", progname);
+	fprintf(stderr, "\t%s [ options ] --manifest=MANIFEST [ --last=SECONDS ]\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--decoder runs a decoder on a channel (--channel by default), writing to\n");
+	fprintf(stderr, "stdout or `out`. Several go through the capture together. Decoders: uart.\n");
+	fprintf(stderr, "Without any, decode runs a uart on --channel.\n");
+	fprintf(stderr, "--live decodes the capture of a running iorec --live=SOCKET as it comes.\n");
+	fprintf(stderr, "--manifest decodes the segments of iorec --segment-size, from the oldest one\n");
+	fprintf(stderr, "left or from about --last seconds before the newest one ended.\n");
+	fprintf(stderr, "--jobs decodes a capture file on N threads (0 for one per CPU), with the same\n");
+	fprintf(stderr, "output as one. Files without an index, pipes, several decoders and the above\n");
+	fprintf(stderr, "take one pass.\n");
+	fprintf(stderr, "--frame-length=auto works out the frame length and its tolerance from the\n");
+	fprintf(stderr, "lengths of the runs at the start of the capture. --track-drift follows a\n");
+	fprintf(stderr, "frame length that drifts by less than --frame-length-tol per frame; it\n");
+	fprintf(stderr, "decodes in one pass.\n");
 }
 
+/* --decoder */
+struct decoder_spec {
+	const char *name;
+	int channel;
+	const char *out_file;
+	const char *annotation_out_file;
+	char label[32];
+};
+
+#define MAX_DECODERS 32
+
 char *flag_annotation_out_file = NULL;
+uint32_t flag_channel_mask = 1 << BIT_INPUT_DEFAULT_CHANNEL;
+int flag_channel = BIT_INPUT_DEFAULT_CHANNEL;
+int flag_baud = 0;
+uint64_t flag_seek = 0;
+double flag_seek_time = -1;
+const char *flag_live = NULL;
+const char *flag_manifest = NULL;
+double flag_last = -1;
+int flag_jobs = 1;
+bool flag_auto_frame_length = false;
+bool flag_frame_length_tol = false;
+bool flag_track_drift = false;
+struct decoder_spec flag_decoders[MAX_DECODERS];
+int flag_n_decoders = 0;
+
+/* NAME[,KEY=VALUE...] of --decoder. The channel is resolved once all
+ * options are in, as --channel may come after. */
+bool
+parse_decoder(char *arg)
+{
+	struct decoder_spec *spec = &flag_decoders[flag_n_decoders];
+	char *save = NULL;
+	char *field;
+
+	if (flag_n_decoders == MAX_DECODERS) {
+		ERROR("too many decoders");
+		return false;
+	}
+	memset(spec, 0, sizeof(*spec));
+	spec->channel = -1;
+
+	spec->name = strtok_r(arg, ",", &save);
+	if (spec->name == NULL || strcmp(spec->name, "uart") != 0) {
+		ERROR("unknown decoder %s", spec->name ? spec->name : "");
+		return false;
+	}
+
+	while ((field = strtok_r(NULL, ",", &save)) != NULL) {
+		char *value = strchr(field, '=');
+		if (value == NULL) {
+			ERROR("decoder option %s needs a value", field);
+			return false;
+		}
+		*value++ = '\0';
+
+		if (strcmp(field, "channel") == 0) {
+			spec->channel = atoi(value);
+			if (spec->channel < 0 || spec->channel > 31) {
+				ERROR("there is no channel %d", spec->channel);
+				return false;
+			}
+		} else if (strcmp(field, "out") == 0) {
+			spec->out_file = value;
+		} else if (strcmp(field, "annotation-out") == 0) {
+			spec->annotation_out_file = value;
+		} else {
+			ERROR("unknown decoder option %s", field);
+			return false;
+		}
+	}
+
+	flag_n_decoders++;
+
+	return true;
+}
 
 bool
 parse_opt(int argc, char **argv)
@@ -217,6 +391,17 @@ parse_opt(int argc, char **argv)
 		{ "help", 0, NULL, 'h' },
 		{ "frame-length", 1, NULL, 'f' },
 		{ "frame-length-tol", 1, NULL, 't' },
+		{ "channels", 1, NULL, 2 },
+		{ "channel", 1, NULL, 3 },
+		{ "baud", 1, NULL, 4 },
+		{ "seek", 1, NULL, 5 },
+		{ "seek-time", 1, NULL, 6 },
+		{ "live", 1, NULL, 7 },
+		{ "manifest", 1, NULL, 8 },
+		{ "last", 1, NULL, 9 },
+		{ "jobs", 1, NULL, 10 },
+		{ "track-drift", 0, NULL, 11 },
+		{ "decoder", 1, NULL, 12 },
 		{ NULL, 0, NULL, 0 },
 	};
 
@@ -232,11 +417,55 @@ parse_opt(int argc, char **argv)
 		case 1:
 			flag_annotation_out_file = optarg;
 			break;
+		case 2:
+			flag_channel_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 3:
+			flag_channel = atoi(optarg);
+			break;
+		case 4:
+			flag_baud = atoi(optarg);
+			break;
+		case 5:
+			flag_seek = strtoull(optarg, NULL, 0);
+			break;
+		case 6:
+			flag_seek_time = atof(optarg);
+			break;
+		case 7:
+			flag_live = optarg;
+			break;
+		case 8:
+			flag_manifest = optarg;
+			break;
+		case 9:
+			flag_last = atof(optarg);
+			break;
+		case 10:
+			flag_jobs = atoi(optarg);
+			if (flag_jobs < 0) {
+				ERROR("--jobs needs a number of threads, or 0 for one per CPU");
+				return false;
+			}
+			break;
+		case 11:
+			flag_track_drift = true;
+			break;
+		case 12:
+			if (!parse_decoder(optarg)) {
+				return false;
+			}
+			break;
 		case 'f':
-			sync_frame_length = atoi(optarg);
+			if (strcmp(optarg, "auto") == 0) {
+				flag_auto_frame_length = true;
+			} else {
+				sync_frame_length = atoi(optarg);
+			}
 			break;
 		case 't':
 			sync_frame_length_tol = atoi(optarg);
+			flag_frame_length_tol = true;
 			break;
 		case 'h':
 			usage(argv[0]);
@@ -249,30 +478,66 @@ parse_opt(int argc, char **argv)
 	return true;
 }
 
+/* The UART options, for a decoder on `channel` */
+void
+uart_config_from_flags(struct uart_config *cfg, int channel, double rate)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->channel = channel;
+	cfg->frame_length = flag_auto_frame_length ? 0 : sync_frame_length;
+	cfg->frame_length_tol = flag_auto_frame_length && !flag_frame_length_tol ? -1 : sync_frame_length_tol;
+	cfg->track_drift = flag_track_drift;
+	cfg->centered = flag_auto_frame_length || flag_track_drift;
+	cfg->sample_rate = rate;
+	cfg->stop = UINT64_MAX;
+}
+
+/* Opens a file the decoder writes to */
+int
+open_out(const char *path)
+{
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd == -1) {
+		perror("open");
+		ERROR("failed to open %s", path);
+		exit(1);
+	}
+
+	return fd;
+}
+
 int
 main(int argc, char **argv)
 {
-	struct state s;
-	memset(&s, 0, sizeof(s));
-	size_t read_offset = 0;
+	struct decoder *decoders[MAX_DECODERS];
+	struct ann_writer anns[MAX_DECODERS];
+	uint32_t channels = 0;
+	int i;
 
 	if (!parse_opt(argc, argv)) {
 		ERROR("failed to parse arguments");
 		exit(1);
 	}
 
-	/* FIXME HACK HACK HACK: reserving twice the amount of memory is a terrible
-	 * approximation.
-	 */
-	s.frame_samples = malloc(2 * sync_frame_length * sizeof(s.frame_samples[0]));
-	if (s.frame_samples == 0) {
-		ERROR("out of memory");
+	if (flag_n_decoders == 0) {
+		flag_decoders[0].name = "uart";
+		flag_decoders[0].channel = flag_channel;
+		flag_decoders[0].annotation_out_file = flag_annotation_out_file;
+		flag_n_decoders = 1;
+	} else if (flag_annotation_out_file) {
+		ERROR("with --decoder, annotations are a decoder option");
 		exit(1);
 	}
-
-	if (!open_annotation(flag_annotation_out_file)) {
-		ERROR("failed to open annotation output");
-		return false;
+	for (i = 0; i < flag_n_decoders; i++) {
+		struct decoder_spec *spec = &flag_decoders[i];
+		if (spec->channel == -1) {
+			spec->channel = flag_channel;
+		}
+		channels |= 1u << spec->channel;
+		/* Errors say which decoder they come from */
+		if (flag_n_decoders > 1) {
+			snprintf(spec->label, sizeof(spec->label), "%s on channel %d: ", spec->name, spec->channel);
+		}
 	}
 
 	struct bit_input *bi = bit_input_create(STDIN_FILENO);
@@ -281,21 +546,128 @@ main(int argc, char **argv)
 		abort();
 	}
 
-	for (;;) {
-		int result;
-		int d;
+	if (!bit_input_select_channels(bi, flag_channel_mask, channels)) {
+		exit(1);
+	}
+	if (flag_live) {
+		if (flag_seek || flag_seek_time >= 0) {
+			ERROR("a live capture can't be seeked");
+			exit(1);
+		}
+		bit_input_set_live(bi, flag_live);
+	}
+	if (flag_last >= 0 && (!flag_manifest || flag_seek || flag_seek_time >= 0)) {
+		ERROR("--last needs --manifest, and replaces --seek and --seek-time");
+		exit(1);
+	}
+	if (flag_manifest) {
+		bit_input_set_manifest(bi, flag_manifest);
+	}
 
-		result = bit_input_get(bi, &d);
-		if (result == -1) {
-			ERROR("error getting next bit");
-			abort();
-		} else if (result == 0) {
-			break;
+	const struct cap_header *hdr = bit_input_header(bi);
+	if (hdr == NULL) {
+		ERROR("failed to read input");
+		exit(1);
+	}
+
+	if (flag_baud && flag_auto_frame_length) {
+		ERROR("--baud and --frame-length=auto don't go together");
+		exit(1);
+	}
+	if (flag_baud) {
+		/* 10 bits per frame: start, 8 data, stop. The measured rate if
+		 * the capture has anchors. */
+		double rate = cap_input_sample_rate(bi->ci);
+		if (rate == 0) {
+			ERROR("--baud needs a capture that records its sample rate");
+			exit(1);
 		}
+		sync_frame_length = rate / flag_baud * 10;
+	}
 
-		decode(&s, d, read_offset);
+	if (flag_seek_time >= 0) {
+		double sample = cap_input_time_to_sample(bi->ci, flag_seek_time);
+		if (sample < 0) {
+			ERROR("--seek-time needs a capture that records its sample rate");
+			exit(1);
+		}
+		flag_seek = sample;
+	}
+	if (flag_last >= 0) {
+		flag_seek = cap_input_recent_sample(bi->ci, flag_last);
+	}
+	if (flag_seek) {
+		if (!bit_input_seek(bi, flag_seek)) {
+			ERROR("failed to seek to sample %" PRIu64, flag_seek);
+			exit(1);
+		}
+	}
+
+	uint64_t first = bit_input_sample(bi);
+	double rate = cap_input_sample_rate(bi->ci);
+
+	for (i = 0; i < flag_n_decoders; i++) {
+		struct decoder_spec *spec = &flag_decoders[i];
+		struct uart_config cfg;
+
+		uart_config_from_flags(&cfg, spec->channel, rate);
+		struct uart *u = uart_create(&cfg);
+		if (u == NULL) {
+			exit(1);
+		}
+		decoders[i] = &u->d;
+		decoders[i]->label = spec->label;
+		if (spec->out_file) {
+			decoders[i]->out_fd = open_out(spec->out_file);
+		}
+		if (spec->annotation_out_file) {
+			if (!ann_writer_init(&anns[i], open_out(spec->annotation_out_file), 0)) {
+				exit(1);
+			}
+			decoder_annotate_to(decoders[i], &anns[i], first);
+		}
+	}
+
+	/* Drift tracking carries over from piece to piece */
+	if (flag_n_decoders == 1 && flag_jobs != 1 && !flag_track_drift
+		&& cap_input_end_sample(bi->ci) && cap_input_map(bi->ci))
+	{
+		struct uart *u = (struct uart *) decoders[0];
+		struct uart_config cfg = u->cfg;
+
+		if (flag_auto_frame_length) {
+			/* Every piece needs the frame length, work it out first */
+			u->cfg.detect_only = true;
+			if (!decode_pass(bi, decoders, 1) || !bit_input_seek(bi, first)) {
+				exit(1);
+			}
+			sync_frame_length = cfg.frame_length = u->frame_length;
+			sync_frame_length_tol = cfg.frame_length_tol = u->frame_length_tol;
+		}
+
+		if (flag_jobs == 0) {
+			flag_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		if (!decode_parallel(bi, first, cap_input_end_sample(bi->ci), flag_jobs, &cfg,
+				decoders[0]->ann))
+		{
+			exit(1);
+		}
+	} else if (!decode_pass(bi, decoders, flag_n_decoders)) {
+		exit(1);
+	}
+
+	for (i = 0; i < flag_n_decoders; i++) {
+		if (decoders[i]->ann && !ann_writer_close(decoders[i]->ann)) {
+			ERROR("failed to write annotations");
+			exit(1);
+		}
+		decoders[i]->ops->destroy(decoders[i]);
+	}
 
-		read_offset++;
+	if (bit_input_live_dropped(bi)) {
+		ERROR("%" PRIu64 " live blocks were dropped, the decoder fell behind",
+			bit_input_live_dropped(bi));
 	}
 
 	return 0;
@@ -0,0 +1,331 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "log.h"
+#include "bitinput.h"
+#include "annotation.h"
+
+/* Protocol decoders (uart.h) share one pass over the capture. decode_pass()
+ * reads the channels they need together and turns them into the samples
+ * where any of them changes, which every decoder gets in batches and
+ * interprets for its own channels. Each decoder has its own output, errors
+ * and annotations.
+ */
+
+/* Levels of the channels, bit n for channel n, from `sample` on */
+struct level_change {
+	uint64_t sample;
+	uint32_t levels;
+};
+
+/* The levels of samples [start, end): `initial` at start, then the changes */
+struct level_batch {
+	uint64_t start;
+	uint64_t end;
+	uint32_t initial;
+	const struct level_change *changes;
+	size_t n_changes;
+};
+
+struct decoder;
+
+/* They return false on errors that should stop decoding */
+struct decoder_ops {
+	const char *name;
+	bool (*levels)(struct decoder *d, const struct level_batch *b);
+	/* `missing` samples are missing before `sample`, which is at `time`
+	 * seconds. The next batch starts there. */
+	bool (*gap)(struct decoder *d, uint64_t sample, uint64_t missing, double time);
+	/* The end of the capture, or of what the decoder wanted of it */
+	bool (*end)(struct decoder *d);
+	void (*destroy)(struct decoder *d);
+};
+
+/* Each decoder's state starts with one */
+struct decoder {
+	const struct decoder_ops *ops;
+	uint32_t channels; /* that it reads, by number */
+	const char *label; /* put before its errors, "" when it is the only one */
+	bool done; /* it wants no more of the capture */
+
+	/* Decoded data and errors go there, or to out_fd and stderr when NULL */
+	FILE *out;
+	int out_fd;
+	FILE *err;
+
+	/* Annotations, NULL without. Marks can overwrite each other until they
+	 * are settled; they wait as one byte per sample from ann_base. */
+	struct ann_writer *ann;
+	uint64_t ann_base;
+	char *ann_pending;
+	size_t ann_len;
+	size_t ann_size;
+};
+
+#define DECODER_REPORT(d, msg, args...) \
+	fprintf((d)->err ? (d)->err : stderr, "error: %s" msg "\n", (d)->label, ##args)
+
+static inline void
+decoder_init(struct decoder *d, const struct decoder_ops *ops, uint32_t channels)
+{
+	memset(d, 0, sizeof(*d));
+	d->ops = ops;
+	d->channels = channels;
+	d->label = "";
+	d->out_fd = STDOUT_FILENO;
+}
+
+static inline void
+decoder_output(struct decoder *d, const void *buf, size_t len)
+{
+	if (d->out) {
+		fwrite(buf, 1, len, d->out);
+	} else if (write(d->out_fd, buf, len) == -1) {
+		perror("write");
+		abort();
+	}
+}
+
+/* Marks from `base` on go to ann */
+static inline void
+decoder_annotate_to(struct decoder *d, struct ann_writer *ann, uint64_t base)
+{
+	d->ann = ann;
+	d->ann_base = base;
+	d->ann_len = 0;
+	d->ann_size = 4096;
+	free(d->ann_pending);
+	d->ann_pending = calloc(d->ann_size, 1);
+	if (d->ann_pending == NULL) {
+		ERROR("out of memory");
+		abort();
+	}
+}
+
+/* Marks n samples from `sample` on with c, over any mark they already have */
+static inline void
+decoder_annotate(struct decoder *d, uint64_t sample, char c, size_t n)
+{
+	if (d->ann == NULL || n == 0) {
+		return;
+	}
+	if (sample < d->ann_base) {
+		ERROR("annotation on sample %" PRIu64 " after it was settled", sample);
+		abort();
+	}
+
+	size_t end = sample - d->ann_base + n;
+	if (end > d->ann_size) {
+		size_t size = d->ann_size;
+		while (size < end) {
+			size *= 2;
+		}
+		char *pending = realloc(d->ann_pending, size);
+		if (pending == NULL) {
+			ERROR("out of memory");
+			abort();
+		}
+		memset(pending + d->ann_size, 0, size - d->ann_size);
+		d->ann_pending = pending;
+		d->ann_size = size;
+	}
+
+	memset(d->ann_pending + (sample - d->ann_base), c, n);
+	if (end > d->ann_len) {
+		d->ann_len = end;
+	}
+}
+
+/* Hands the marks before `sample`, which nothing will change anymore, to
+ * the writer
+ */
+static inline void
+decoder_settle(struct decoder *d, uint64_t sample)
+{
+	size_t i, k;
+
+	if (d->ann == NULL || sample <= d->ann_base) {
+		return;
+	}
+
+	k = sample - d->ann_base < d->ann_len ? sample - d->ann_base : d->ann_len;
+	for (i = 0; i < k; i++) {
+		if (d->ann_pending[i] && !ann_writer_add(d->ann, d->ann_base + i, 1, d->ann_pending[i])) {
+			ERROR("failed to write annotations");
+			abort();
+		}
+	}
+
+	memmove(d->ann_pending, d->ann_pending + k, d->ann_len - k);
+	memset(d->ann_pending + d->ann_len - k, 0, k);
+	d->ann_len -= k;
+	d->ann_base = sample;
+}
+
+static inline void
+decoder_settle_all(struct decoder *d)
+{
+	decoder_settle(d, d->ann_base + d->ann_len);
+}
+
+/* What decoder_init() and decoder_annotate_to() allocated */
+static inline void
+decoder_cleanup(struct decoder *d)
+{
+	free(d->ann_pending);
+	d->ann_pending = NULL;
+}
+
+#define DECODE_PASS_CHANGES 4096 /* most in a batch */
+#define DECODE_PASS_SPAN (1 << 16) /* samples a batch covers at most */
+
+static inline bool
+decode_pass_deliver(struct decoder **decoders, size_t n_decoders, struct level_batch *b)
+{
+	size_t k;
+
+	for (k = 0; k < n_decoders; k++) {
+		if (!decoders[k]->done && !decoders[k]->ops->levels(decoders[k], b)) {
+			return false;
+		}
+	}
+	b->start = b->end;
+	b->n_changes = 0;
+
+	return true;
+}
+
+static inline bool
+decode_pass_done(struct decoder **decoders, size_t n_decoders)
+{
+	size_t k;
+
+	for (k = 0; k < n_decoders; k++) {
+		if (!decoders[k]->done) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Runs the decoders over the capture from where bi is, which has to read
+ * the channels of all of them (bit_input_select_channels()), until its end
+ * or until none wants more. Returns false on errors.
+ */
+static inline bool
+decode_pass(struct bit_input *bi, struct decoder **decoders, size_t n_decoders)
+{
+	struct level_change *changes = malloc(DECODE_PASS_CHANGES * sizeof(changes[0]));
+	struct level_batch b;
+	uint64_t levels[32];
+	uint64_t diffs[32];
+	uint32_t cur = 0, left;
+	bool fresh = true; /* no samples yet since the start or a gap */
+	bool single = (bi->channels & (bi->channels - 1)) == 0; /* every change is of that one */
+	bool ok = true;
+	size_t k;
+
+	if (changes == NULL) {
+		ERROR("out of memory");
+		return false;
+	}
+	memset(&b, 0, sizeof(b));
+	b.changes = changes;
+
+	while (ok && !decode_pass_done(decoders, n_decoders)) {
+		uint64_t sample;
+		int n = 0;
+		int result = bit_input_get_levels(bi, levels, &n);
+
+		if (result == -1) {
+			ERROR("error getting next bit");
+			ok = false;
+			break;
+		} else if (result == 0) {
+			if (!fresh) {
+				ok = decode_pass_deliver(decoders, n_decoders, &b);
+			}
+			break;
+		} else if (result == BIT_INPUT_GAP) {
+			if (!fresh) {
+				ok = decode_pass_deliver(decoders, n_decoders, &b);
+			}
+			sample = bit_input_sample(bi);
+			for (k = 0; ok && k < n_decoders; k++) {
+				if (!decoders[k]->done) {
+					ok = decoders[k]->ops->gap(decoders[k], sample, bit_input_gap(bi),
+						cap_input_sample_to_time(bi->ci, sample));
+				}
+			}
+			fresh = true;
+			continue;
+		}
+
+		sample = bit_input_sample(bi) - n;
+		if (fresh) {
+			cur = 0;
+			for (left = bi->channels; left; left &= left - 1) {
+				int channel = __builtin_ctz(left);
+				cur |= (uint32_t) (levels[channel] >> 63) << channel;
+			}
+			b.start = b.end = sample;
+			b.initial = cur;
+			b.n_changes = 0;
+			fresh = false;
+		}
+
+		/* Samples where one of the channels differs from the one before */
+		uint64_t valid = ~0ull << (64 - n);
+		uint64_t any = 0;
+		for (left = bi->channels; left; left &= left - 1) {
+			int channel = __builtin_ctz(left);
+			uint64_t x = levels[channel];
+			uint64_t prev = (x >> 1) | ((uint64_t) ((cur >> channel) & 1) << 63);
+			diffs[channel] = (x ^ prev) & valid;
+			any |= diffs[channel];
+		}
+
+		while (any) {
+			int p = __builtin_clzll(any);
+			uint64_t bit = 1ull << (63 - p);
+
+			if (single) {
+				cur ^= bi->channels;
+			} else {
+				for (left = bi->channels; left; left &= left - 1) {
+					int channel = __builtin_ctz(left);
+					if (diffs[channel] & bit) {
+						cur ^= 1u << channel;
+					}
+				}
+			}
+			changes[b.n_changes].sample = sample + p;
+			changes[b.n_changes].levels = cur;
+			b.n_changes++;
+			any &= ~bit;
+		}
+		b.end = sample + n;
+
+		if (b.n_changes + 64 > DECODE_PASS_CHANGES || b.end - b.start >= DECODE_PASS_SPAN) {
+			ok = decode_pass_deliver(decoders, n_decoders, &b);
+			b.initial = cur;
+		}
+	}
+
+	for (k = 0; ok && k < n_decoders; k++) {
+		ok = decoders[k]->ops->end(decoders[k]);
+	}
+	free(changes);
+
+	return ok;
+}
+
+#endif /* DECODER_H */
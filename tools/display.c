@@ -9,16 +9,7 @@
 #include <getopt.h>
 #include "log.h"
 #include "bitinput.h"
-
-#define BUFFERED_INPUT_BUF_SIZE 65536
-
-struct buffered_input {
-	int fd;
-	char *buf;
-	ssize_t buf_len;
-	size_t buf_size;
-	size_t next;
-};
+#include "annotation.h"
 
 int write_n_same(int fd, char c, size_t n)
 {
@@ -47,70 +38,161 @@ int write_n_same(int fd, char c, size_t n)
 	return 1;
 }
 
-int
-buffered_input_get_one_u32(struct buffered_input *bi, uint32_t *v)
+uint32_t flag_channel_mask = 1 << BIT_INPUT_DEFAULT_CHANNEL;
+int flag_channel = BIT_INPUT_DEFAULT_CHANNEL;
+uint64_t flag_seek = 0;
+double flag_seek_time = -1;
+const char *flag_live = NULL;
+const char *flag_manifest = NULL;
+double flag_last = -1;
+bool flag_timebase = false;
+
+struct bit_input *
+open_data_in(int fd_data_in)
 {
-	if (bi->next + sizeof(uint32_t) <= bi->buf_len) {
-		*v = *(uint32_t *) &bi->buf[bi->next];
-		bi->next += sizeof(uint32_t);
-		return 1;
+	struct bit_input *bi = bit_input_create(fd_data_in);
+	if (bi == NULL) {
+		return NULL;
 	}
 
-	bi->buf_len = read(bi->fd, bi->buf, bi->buf_size);
-	if (bi->buf_len == -1) {
-		perror("read");
-		return -1;
-	} else if (bi->buf_len == 0) {
-		return 0;
+	if (!bit_input_select_channel(bi, flag_channel_mask, flag_channel)) {
+		free(bi);
+		return NULL;
+	}
+	if (flag_live) {
+		bit_input_set_live(bi, flag_live);
+	}
+	if (flag_manifest) {
+		bit_input_set_manifest(bi, flag_manifest);
+		const struct cap_header *hdr = bit_input_header(bi);
+		if (hdr == NULL) {
+			return NULL;
+		}
+		if (flag_last >= 0) {
+			flag_seek = cap_input_recent_sample(bi->ci, flag_last);
+		}
+		/* Annotations are numbered from sample 0 too */
+		if (flag_seek < hdr->first_sample) {
+			flag_seek = hdr->first_sample;
+		}
 	}
 
-	bi->next = sizeof(uint32_t);
-	*v = *(uint32_t *) &bi->buf[0];
-	return 1;
+	if (flag_seek_time >= 0) {
+		if (bit_input_header(bi) == NULL) {
+			return NULL;
+		}
+		double sample = cap_input_time_to_sample(bi->ci, flag_seek_time);
+		if (sample < 0) {
+			ERROR("--seek-time needs a capture that records its sample rate");
+			return NULL;
+		}
+		flag_seek = sample;
+	}
+	if (flag_seek && !bit_input_seek(bi, flag_seek)) {
+		ERROR("failed to seek to sample %" PRIu64, flag_seek);
+		return NULL;
+	}
+
+	return bi;
 }
 
+/* --timebase: the capture's anchors and how steady its sample clock was */
 int
-buffered_input_get_one(struct buffered_input *bi, char *b)
+print_timebase(int fd)
 {
-	if (bi->next < bi->buf_len) {
-		*b = bi->buf[bi->next];
-		bi->next++;
-		return 1;
-	}
+	struct cap_chunk chunk;
+	size_t k;
 
-	bi->buf_len = read(bi->fd, bi->buf, bi->buf_size);
-	if (bi->buf_len == -1) {
-		perror("read");
+	struct cap_input *ci = cap_input_open(fd, flag_channel_mask);
+	if (ci == NULL) {
 		return -1;
-	} else if (bi->buf_len == 0) {
+	}
+	if (ci->kind != CAP_INPUT_CONTAINER) {
+		ERROR("only containers record anchors");
+		return -1;
+	}
+
+	/* Without the table at the end, the anchors are spread over the file.
+	 * A truncated capture still has those before the cut. */
+	while (!ci->have_anchor_table && cap_input_next_chunk(ci, &chunk) == 1) {
+	}
+
+	const struct timebase *tb = &ci->tb;
+	if (tb->n < 2) {
+		printf("%zu anchor(s), the sample clock can't be measured\n", tb->n);
 		return 0;
 	}
 
-	bi->next = 1;
-	*b = bi->buf[0];
-	return 1;
+	double mean = timebase_rate(tb);
+	double min = mean, max = mean;
+
+	printf("%12s %14s %16s %14s %10s\n", "sample", "time (s)", "realtime (s)",
+		"rate (S/s)", "ppm");
+	for (k = 0; k < tb->n; k++) {
+		const struct cap_anchor *a = &tb->anchors[k];
+		printf("%12" PRIu64 " %14.6f %16.6f", a->sample,
+			(a->monotonic_ns - tb->anchors[0].monotonic_ns) / 1e9, a->realtime_ns / 1e9);
+		if (k + 1 < tb->n) {
+			/* Rate up to the next anchor */
+			double rate = timebase_segment_rate(tb, k);
+			printf(" %14.1f %+10.1f", rate, (rate / mean - 1) * 1e6);
+			if (rate < min) {
+				min = rate;
+			}
+			if (rate > max) {
+				max = rate;
+			}
+		}
+		printf("\n");
+	}
+
+	printf("%zu anchors over %.3f s: %.1f samples/s on average, from %.1f to %.1f (%.1f ppm)\n",
+		tb->n, (tb->anchors[tb->n - 1].monotonic_ns - tb->anchors[0].monotonic_ns) / 1e9,
+		mean, min, max, (max - min) / mean * 1e6);
+	if (ci->hdr.sample_rate) {
+		printf("Nominal rate %.1f samples/s, %+.1f ppm off\n", ci->hdr.sample_rate,
+			(mean / ci->hdr.sample_rate - 1) * 1e6);
+	}
+
+	return 0;
 }
 
-struct buffered_input *
-buffered_input_create(int fd)
+void report_dropped(struct bit_input *bi)
 {
-	struct buffered_input *bi = malloc(sizeof(*bi));
-	if (bi == NULL) {
-		ERROR("out of memory");
-		return NULL;
+	if (bit_input_live_dropped(bi)) {
+		ERROR("%" PRIu64 " live blocks were dropped, the display fell behind",
+			bit_input_live_dropped(bi));
 	}
+}
 
-	bi->fd = fd;
-	bi->buf_size = BUFFERED_INPUT_BUF_SIZE;
-	bi->buf_len = 0;
-	bi->next = 0;
-	bi->buf = malloc(bi->buf_size);
-	if (bi->buf == NULL) {
-		ERROR("out of memory");
-		return NULL;
+/* Prints a run of count samples of value val */
+void output_run(int fd_data_out, int fd_ann_out, char val, size_t count, bool verbose_mode,
+		size_t *data_counter_write, size_t *annotation_counter_write)
+{
+	if (count > 10 && !verbose_mode) {
+		/* Compressed print */
+		char buf[100];
+		char printable_char = val ? '-' : '_';
+		size_t n_printed =
+			sprintf(buf, "%c%c%c%d%c%c%c",
+				printable_char,
+				printable_char,
+				printable_char,
+				count - 6,
+				printable_char,
+				printable_char,
+				printable_char);
+		write(fd_data_out, buf, n_printed);
+		*data_counter_write += n_printed;
+
+		/* Write empty annotations to fill the space */
+		write_n_same(fd_ann_out, ' ', n_printed);
+		*annotation_counter_write += n_printed;
+	} else {
+		char printable_char = val ? '-' : '_';
+		write_n_same(fd_data_out, printable_char, count);
+		*data_counter_write += count;
 	}
-
-	return bi;
 }
 
 void output_compress(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_out)
@@ -118,17 +200,22 @@ void output_compress(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_
 	int result;
 	int i;
 
-	struct buffered_input *ann_in = buffered_input_create(fd_ann_in);
-	if (ann_in == NULL) {
-		ERROR("failed to create ann_in");
-		abort();
-	}
-	struct bit_input *bi = bit_input_create(fd_data_in);
+	struct bit_input *bi = open_data_in(fd_data_in);
 	if (bi == NULL) {
 		ERROR("failed to create data_in");
 		abort();
 	}
 
+	/* Annotations are indexed by sample from the start of the capture */
+	struct ann_reader *ann_in = malloc(sizeof(*ann_in));
+	if (ann_in == NULL || !ann_reader_open(ann_in, fd_ann_in, flag_seek)) {
+		ERROR("failed to create ann_in");
+		abort();
+	}
+	uint64_t ann_sample;
+	char ann_code;
+	int ann_result = ann_reader_next(ann_in, &ann_sample, &ann_code);
+
 	size_t data_counter_read = 0;
 	size_t data_counter_write = 0;
 
@@ -146,19 +233,27 @@ void output_compress(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_
 	for (;;) {
 		/* Ok get the next annotation */
 		for (;;) {
-			result = buffered_input_get_one(ann_in, &next_annotation);
-			if (result == -1) {
+			if (ann_result == -1) {
 				ERROR("error reading annotations");
 				abort();
-			} else if (result == 0) {
-				annotation_counter_read += 1048576;
 			}
 
-			annotation_counter_read++;
+			/* Fell in a gap */
+			if (ann_result == 1 && ann_sample - flag_seek < data_counter_read) {
+				ann_result = ann_reader_next(ann_in, &ann_sample, &ann_code);
+				continue;
+			}
 
-			if (next_annotation || annotation_counter_read - data_counter_read >= 1048576) {
-				break;
+			/* Without one in the next 1M samples, stop there anyway */
+			if (ann_result == 1 && ann_sample - flag_seek + 1 <= data_counter_read + 1048576) {
+				annotation_counter_read = ann_sample - flag_seek + 1;
+				next_annotation = ann_code;
+				ann_result = ann_reader_next(ann_in, &ann_sample, &ann_code);
+			} else {
+				annotation_counter_read = data_counter_read + 1048576;
+				next_annotation = 0;
 			}
+			break;
 		}
 
 		/* Ok we have the next annotation, now read data until we get to its point in the data */
@@ -172,31 +267,30 @@ void output_compress(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_
 				d = -1;
 			}
 
+			if (result == BIT_INPUT_GAP) {
+				output_run(fd_data_out, fd_ann_out, previous_data_val, same_data_count,
+					verbose_mode, &data_counter_write, &annotation_counter_write);
+				same_data_count = 0;
+				verbose_mode = false;
+
+				char buf[100];
+				size_t n_printed = sprintf(buf, "[gap of %" PRIu64 " samples]",
+					bit_input_gap(bi));
+				write(fd_data_out, buf, n_printed);
+				data_counter_write += n_printed;
+				write_n_same(fd_ann_out, ' ', n_printed);
+				annotation_counter_write += n_printed;
+
+				/* Annotations within the gap are skipped */
+				data_counter_read += bit_input_gap(bi);
+				/* Makes the next sample start a new run */
+				previous_data_val = -2;
+				continue;
+			}
+
 			if (d != previous_data_val) {
-				if (same_data_count > 10 && !verbose_mode) {
-					/* Compressed print */
-					char buf[100];
-					char printable_char = previous_data_val ? '-' : '_';
-					size_t n_printed =
-						sprintf(buf, "%c%c%c%d%c%c%c",
-							printable_char,
-							printable_char,
-							printable_char,
-							same_data_count - 6,
-							printable_char,
-							printable_char,
-							printable_char);
-					write(fd_data_out, buf, n_printed);
-					data_counter_write += n_printed;
-
-					/* Write empty annotations to fill the space */
-					write_n_same(fd_ann_out, ' ', n_printed);
-					annotation_counter_write += n_printed;
-				} else {
-					char printable_char = previous_data_val ? '-' : '_';
-					write_n_same(fd_data_out, printable_char, same_data_count);
-					data_counter_write += same_data_count;
-				}
+				output_run(fd_data_out, fd_ann_out, previous_data_val, same_data_count,
+					verbose_mode, &data_counter_write, &annotation_counter_write);
 				same_data_count = 0;
 
 				/* We're at a transition so we reset the verbose until we see that we need it */
@@ -208,6 +302,7 @@ void output_compress(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_
 			previous_data_val = d;
 
 			if (d == -1) {
+				report_dropped(bi);
 				return;
 			}
 
@@ -217,7 +312,7 @@ void output_compress(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_
 			 *  - same_data_count is accurate
 			 *  - data counter read is accurate
 			 */
-			if (data_counter_read == annotation_counter_read) {
+			if (data_counter_read >= annotation_counter_read) {
 				/* The corner case here is if we hit an annotation just after a transition.
 				 * For this to work, we need to have access to the number of characters
 				 * that were the same (1, or more if the annotation doesn't immediately
@@ -267,7 +362,7 @@ void output_raw(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_out)
 	int i;
 	int result;
 
-	struct bit_input *bi = bit_input_create(fd_data_in);
+	struct bit_input *bi = open_data_in(fd_data_in);
 	if (bi == NULL) {
 		ERROR("failed to create data_in");
 		abort();
@@ -281,7 +376,10 @@ void output_raw(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_out)
 				ERROR("error getting next bit");
 				abort();
 			} else if (result == 0) {
+				report_dropped(bi);
 				return;
+			} else if (result == BIT_INPUT_GAP) {
+				break;
 			}
 
 			buf[i] = d ? '-' : '_';
@@ -290,7 +388,17 @@ void output_raw(int fd_data_in, int fd_data_out, int fd_ann_in, int fd_ann_out)
 			perror("write");
 			return;
 		}
-		
+
+		if (result == BIT_INPUT_GAP) {
+			char marker[100];
+			size_t n_printed = sprintf(marker, "[gap of %" PRIu64 " samples]",
+				bit_input_gap(bi));
+			if (write(STDOUT_FILENO, marker, n_printed) == -1) {
+				perror("write");
+				return;
+			}
+		}
+
 	}
 
 }
@@ -304,7 +412,20 @@ usage(char *progname)
 {
 	fprintf(stderr, "Usage:\n");
 	fprintf(stderr, "\t%s -h\n", progname);
-	fprintf(stderr, "\t%s <FILE_IN >FILE_OUT\n", progname);
+	fprintf(stderr, "\t%s [ --channels=MASK --channel=BIT ]\n"
+		"\t\t[ --annotation-in=ANNOTATION_FILE --annotation-out=FILE ]\n"
+		"\t\t[ --seek=SAMPLE | --seek-time=SECONDS ] <FILE_IN >FILE_OUT\n", progname);
+	fprintf(stderr, "\t%s [ --raw ] [ --channel=BIT ] --live=SOCKET >FILE_OUT\n", progname);
+	fprintf(stderr, "\t%s [ options ] --manifest=MANIFEST [ --last=SECONDS ] >FILE_OUT\n", progname);
+	fprintf(stderr, "\t%s --timebase <FILE_IN\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "--annotation-in takes the annotations of decode --annotation-out, and\n");
+	fprintf(stderr, "--annotation-out prints them lined up with FILE_OUT.\n");
+	fprintf(stderr, "--seek-time is in seconds from the first sample, following the anchors the\n");
+	fprintf(stderr, "capture recorded. --timebase lists them with the sample rate in between.\n");
+	fprintf(stderr, "--live shows the capture of a running iorec --live=SOCKET as it comes.\n");
+	fprintf(stderr, "--manifest reads the segments of iorec --segment-size, from the oldest one\n");
+	fprintf(stderr, "left or from about --last seconds before the newest one ended.\n");
 }
 
 bool
@@ -314,6 +435,14 @@ parse_opt(int argc, char **argv)
 		{ "annotation-in", 1, NULL, 1 },
 		{ "annotation-out", 1, NULL, 2 },
 		{ "raw", 0, NULL, 3 },
+		{ "channels", 1, NULL, 4 },
+		{ "channel", 1, NULL, 5 },
+		{ "seek", 1, NULL, 6 },
+		{ "seek-time", 1, NULL, 7 },
+		{ "live", 1, NULL, 8 },
+		{ "timebase", 0, NULL, 9 },
+		{ "manifest", 1, NULL, 10 },
+		{ "last", 1, NULL, 11 },
 		{ "help", 0, NULL, 'h' },
 		{ NULL, 0, NULL, 0 },
 	};
@@ -336,6 +465,30 @@ parse_opt(int argc, char **argv)
 		case 3:
 			flag_raw = true;
 			break;
+		case 4:
+			flag_channel_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 5:
+			flag_channel = atoi(optarg);
+			break;
+		case 6:
+			flag_seek = strtoull(optarg, NULL, 0);
+			break;
+		case 7:
+			flag_seek_time = atof(optarg);
+			break;
+		case 8:
+			flag_live = optarg;
+			break;
+		case 9:
+			flag_timebase = true;
+			break;
+		case 10:
+			flag_manifest = optarg;
+			break;
+		case 11:
+			flag_last = atof(optarg);
+			break;
 		case 'h':
 			usage(argv[0]);
 			exit(0);
@@ -356,6 +509,10 @@ int main(int argc, char **argv)
 
 	void (*output)(int, int, int, int);
 
+	if (flag_timebase) {
+		return print_timebase(STDIN_FILENO) == -1 ? 1 : 0;
+	}
+
 	if (flag_raw) {
 		output = output_raw;
 	} else {
@@ -364,9 +521,15 @@ int main(int argc, char **argv)
 
 	int fd_ann_in, fd_ann_out;
 
-	if (!flag_annotation_in_file) {
-		flag_annotation_in_file = "/dev/zero";
+	if (flag_live && (flag_seek || flag_seek_time >= 0 || flag_annotation_in_file)) {
+		ERROR("a live capture can't be seeked or annotated");
+		exit(1);
 	}
+	if (flag_last >= 0 && (!flag_manifest || flag_seek || flag_seek_time >= 0)) {
+		ERROR("--last needs --manifest, and replaces --seek and --seek-time");
+		exit(1);
+	}
+
 	if (!flag_annotation_out_file) {
 		flag_annotation_out_file = "/dev/null";
 	}
@@ -376,10 +539,14 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	fd_ann_in = open(flag_annotation_in_file, O_RDONLY);
-	if (fd_ann_in == -1) {
-		perror("open");
-		exit(1);
+	/* -1 for no annotations */
+	fd_ann_in = -1;
+	if (flag_annotation_in_file) {
+		fd_ann_in = open(flag_annotation_in_file, O_RDONLY);
+		if (fd_ann_in == -1) {
+			perror("open");
+			exit(1);
+		}
 	}
 
 	fd_ann_out = open(flag_annotation_out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
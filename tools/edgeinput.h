@@ -0,0 +1,93 @@
+#ifndef EDGEINPUT_H
+#define EDGEINPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../edges.h"
+#include "log.h"
+
+/* Walks the changes recorded in one edge block (see edges.h) held in memory */
+struct edge_decoder {
+	struct edge_block_header hdr;
+	const uint8_t *p;
+	const uint8_t *end;
+	int n_channels;
+	uint64_t last_edge;
+};
+
+static inline bool
+edge_decoder_init(struct edge_decoder *ed, const void *block, size_t len,
+		int n_channels)
+{
+	if (len < sizeof(ed->hdr)) {
+		ERROR("truncated edge block");
+		return false;
+	}
+
+	memcpy(&ed->hdr, block, sizeof(ed->hdr));
+	if (ed->hdr.magic != EDGE_BLOCK_MAGIC
+		|| ed->hdr.payload_len > len - sizeof(ed->hdr))
+	{
+		ERROR("bad edge block");
+		return false;
+	}
+
+	ed->p = (const uint8_t *) block + sizeof(ed->hdr);
+	ed->end = ed->p + ed->hdr.payload_len;
+	ed->n_channels = n_channels;
+	ed->last_edge = ed->hdr.first_sample;
+
+	return true;
+}
+
+static inline int
+edge_decoder_varint(struct edge_decoder *ed, uint64_t *v)
+{
+	int shift = 0;
+	*v = 0;
+
+	while (ed->p < ed->end) {
+		uint8_t byte = *ed->p++;
+
+		*v |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return 1;
+		}
+		shift += 7;
+	}
+
+	ERROR("varint runs past the end of its block");
+	return -1;
+}
+
+/* Next change in the block: its absolute sample number and the channels that
+ * changed (bits in channel order). Returns 0 once the block is exhausted.
+ */
+static inline int
+edge_decoder_next(struct edge_decoder *ed, uint64_t *sample, uint32_t *changed)
+{
+	uint64_t v;
+
+	if (ed->p == ed->end) {
+		return 0;
+	}
+
+	if (edge_decoder_varint(ed, &v) == -1) {
+		return -1;
+	}
+	ed->last_edge += v;
+	*sample = ed->last_edge;
+
+	*changed = 1;
+	if (ed->n_channels > 1) {
+		if (edge_decoder_varint(ed, &v) == -1) {
+			return -1;
+		}
+		*changed = v;
+	}
+
+	return 1;
+}
+
+#endif /* EDGEINPUT_H */
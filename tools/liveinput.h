@@ -0,0 +1,224 @@
+#ifndef LIVEINPUT_H
+#define LIVEINPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "../livering.h"
+#include "log.h"
+
+/* Reads the live ring of a running iorec --live (see livering.h), starting
+ * with the next block it publishes.
+ */
+
+#define LIVE_INPUT_WAIT_SEC 1 /* between checks that iorec is still there */
+
+struct live_input {
+	struct live_header *hdr;
+	size_t map_len;
+	uint64_t pos; /* next slot to read */
+	uint64_t dropped; /* slots overwritten before we got to them */
+	uint8_t *buf;
+	size_t buf_size;
+};
+
+/* Receives the ring's memfd from the socket iorec listens on */
+static inline int
+live_input_receive_fd(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ERROR("socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("connect");
+		close(sock);
+		return -1;
+	}
+
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	if (recvmsg(sock, &msg, 0) == 1) {
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+			&& cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+		}
+	}
+	close(sock);
+
+	if (fd == -1) {
+		ERROR("no live ring received from %s", path);
+	}
+
+	return fd;
+}
+
+static inline struct live_input *
+live_input_attach(const char *path)
+{
+	struct stat st;
+
+	int fd = live_input_receive_fd(path);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct live_input *li = malloc(sizeof(*li));
+	if (li == NULL) {
+		ERROR("out of memory");
+		close(fd);
+		return NULL;
+	}
+	memset(li, 0, sizeof(*li));
+
+	if (fstat(fd, &st) == -1 || st.st_size < LIVE_HEADER_SIZE) {
+		ERROR("bad live ring");
+		close(fd);
+		free(li);
+		return NULL;
+	}
+	li->map_len = st.st_size;
+	/* Writable for the waiter count */
+	li->hdr = mmap(NULL, li->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (li->hdr == MAP_FAILED) {
+		perror("mmap");
+		free(li);
+		return NULL;
+	}
+
+	if (memcmp(li->hdr->magic, LIVE_MAGIC, sizeof(li->hdr->magic)) != 0
+		|| li->hdr->version != LIVE_VERSION
+		|| li->hdr->header_size + (uint64_t) li->hdr->n_slots * li->hdr->slot_size > li->map_len)
+	{
+		ERROR("bad live ring");
+		munmap(li->hdr, li->map_len);
+		free(li);
+		return NULL;
+	}
+
+	li->buf_size = li->hdr->slot_size;
+	li->buf = malloc(li->buf_size);
+	if (li->buf == NULL) {
+		ERROR("out of memory");
+		munmap(li->hdr, li->map_len);
+		free(li);
+		return NULL;
+	}
+
+	li->pos = __atomic_load_n(&li->hdr->head, __ATOMIC_ACQUIRE);
+
+	return li;
+}
+
+/* Waits until slot pos is published. Returns false once the capture is over. */
+static inline bool
+live_input_wait(struct live_input *li)
+{
+	struct live_header *hdr = li->hdr;
+	struct timespec timeout = { LIVE_INPUT_WAIT_SEC, 0 };
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (li->pos < head) {
+			return true;
+		}
+		if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+
+		/* The writer checks for waiters after moving the futex word on */
+		__atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+		long result = live_futex(&hdr->futex, FUTEX_WAIT, (uint32_t) head, &timeout);
+		__atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (result == -1 && errno == ETIMEDOUT
+			&& kill(hdr->pid, 0) == -1 && errno == ESRCH)
+		{
+			ERROR("iorec went away");
+			return false;
+		}
+	}
+}
+
+/* Copies the next block out of the ring. Returns 1 and sets first_sample,
+ * n_samples, the payload and its length; 0 at the end of the capture.
+ * Blocks overwritten before they could be read are skipped and counted.
+ */
+static inline int
+live_input_next(struct live_input *li, uint64_t *first_sample, uint32_t *n_samples,
+		const uint8_t **payload, size_t *payload_len)
+{
+	struct live_header *hdr = li->hdr;
+
+	for (;;) {
+		if (!live_input_wait(li)) {
+			return 0;
+		}
+
+		/* Whatever is more than a ring behind is gone */
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (head - li->pos > hdr->n_slots) {
+			li->dropped += head - hdr->n_slots - li->pos;
+			li->pos = head - hdr->n_slots;
+		}
+
+		struct live_slot *slot = live_slot(hdr, li->pos);
+		uint64_t expected = 2 * li->pos + 2;
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == expected) {
+			*first_sample = slot->first_sample;
+			*n_samples = slot->n_samples;
+			*payload_len = slot->payload_len;
+			if (*payload_len <= li->buf_size - sizeof(*slot)) {
+				memcpy(li->buf, slot + 1, *payload_len);
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		}
+
+		li->pos++;
+		if (seq != expected || *payload_len > li->buf_size - sizeof(*slot)) {
+			/* Overwritten under us */
+			li->dropped++;
+			continue;
+		}
+
+		*payload = li->buf;
+		return 1;
+	}
+}
+
+#endif /* LIVEINPUT_H */
@@ -0,0 +1,161 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "../capfile.h"
+#include "log.h"
+
+/* Converts between sample numbers and time using the anchors of a capture
+ * (see capfile.h). Between two anchors the sample clock is taken to be
+ * steady; before the first and after the last, the nearest pair's rate
+ * carries on. With fewer than two anchors the nominal rate is used from the
+ * start of the capture.
+ *
+ * Times are in seconds from sample 0, on the monotonic clock.
+ */
+
+struct timebase {
+	struct cap_anchor *anchors; /* by increasing sample and time */
+	size_t n;
+	size_t size;
+
+	/* Fallback */
+	double nominal_rate;
+	uint64_t start_monotonic_ns;
+};
+
+static inline void
+timebase_init(struct timebase *tb, double nominal_rate, uint64_t start_monotonic_ns)
+{
+	tb->anchors = NULL;
+	tb->n = tb->size = 0;
+	tb->nominal_rate = nominal_rate;
+	tb->start_monotonic_ns = start_monotonic_ns;
+}
+
+/* Anchors have to come in order; ones that don't move forward are dropped */
+static inline bool
+timebase_add(struct timebase *tb, const struct cap_anchor *a)
+{
+	if (tb->n) {
+		const struct cap_anchor *last = &tb->anchors[tb->n - 1];
+		if (a->sample <= last->sample || a->monotonic_ns <= last->monotonic_ns) {
+			return true;
+		}
+	}
+
+	if (tb->n == tb->size) {
+		size_t size = tb->size ? tb->size * 2 : 256;
+		struct cap_anchor *anchors = realloc(tb->anchors, size * sizeof(*anchors));
+		if (anchors == NULL) {
+			ERROR("out of memory");
+			return false;
+		}
+		tb->anchors = anchors;
+		tb->size = size;
+	}
+	tb->anchors[tb->n++] = *a;
+
+	return true;
+}
+
+/* Index k of the anchor pair (k, k + 1) to interpolate with */
+static inline size_t
+timebase_pair_by_sample(const struct timebase *tb, double sample)
+{
+	size_t lo = 0, hi = tb->n - 1;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (tb->anchors[mid].sample <= sample) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static inline size_t
+timebase_pair_by_time(const struct timebase *tb, uint64_t monotonic_ns)
+{
+	size_t lo = 0, hi = tb->n - 1;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (tb->anchors[mid].monotonic_ns <= monotonic_ns) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Samples per second between anchors k and k + 1 */
+static inline double
+timebase_segment_rate(const struct timebase *tb, size_t k)
+{
+	const struct cap_anchor *a = &tb->anchors[k], *b = &tb->anchors[k + 1];
+
+	return (b->sample - a->sample) / ((b->monotonic_ns - a->monotonic_ns) / 1e9);
+}
+
+/* Monotonic time of a sample, in ns */
+static inline double
+timebase_sample_to_monotonic(const struct timebase *tb, double sample)
+{
+	if (tb->n < 2) {
+		return tb->start_monotonic_ns + sample / tb->nominal_rate * 1e9;
+	}
+
+	size_t k = timebase_pair_by_sample(tb, sample);
+	const struct cap_anchor *a = &tb->anchors[k];
+	return a->monotonic_ns + (sample - a->sample) / timebase_segment_rate(tb, k) * 1e9;
+}
+
+static inline double
+timebase_monotonic_to_sample(const struct timebase *tb, double monotonic_ns)
+{
+	if (tb->n < 2) {
+		return (monotonic_ns - tb->start_monotonic_ns) / 1e9 * tb->nominal_rate;
+	}
+
+	size_t k = timebase_pair_by_time(tb, monotonic_ns);
+	const struct cap_anchor *a = &tb->anchors[k];
+	return a->sample + (monotonic_ns - a->monotonic_ns) / 1e9 * timebase_segment_rate(tb, k);
+}
+
+/* Seconds from sample 0 to `sample` */
+static inline double
+timebase_time(const struct timebase *tb, double sample)
+{
+	return (timebase_sample_to_monotonic(tb, sample)
+		- timebase_sample_to_monotonic(tb, 0)) / 1e9;
+}
+
+/* Sample at `seconds` from sample 0 */
+static inline double
+timebase_sample(const struct timebase *tb, double seconds)
+{
+	return timebase_monotonic_to_sample(tb,
+		timebase_sample_to_monotonic(tb, 0) + seconds * 1e9);
+}
+
+/* Mean rate over the anchors, or the nominal rate */
+static inline double
+timebase_rate(const struct timebase *tb)
+{
+	if (tb->n < 2) {
+		return tb->nominal_rate;
+	}
+
+	const struct cap_anchor *a = &tb->anchors[0], *b = &tb->anchors[tb->n - 1];
+	return (b->sample - a->sample) / ((b->monotonic_ns - a->monotonic_ns) / 1e9);
+}
+
+#endif /* TIMEBASE_H */
@@ -0,0 +1,525 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include "log.h"
+#include "decoder.h"
+#include "autobaud.h"
+
+/* 8N1 UART decoder: frames of frame_length samples with a start bit, 8 data
+ * bits LSB first and a stop bit.
+ *
+ * It keeps the samples where its channel changes, from the frame it is
+ * decoding or the sync point it is looking for on, and reads the level of
+ * any sample from them. A frame starts at a falling edge after at least 2
+ * frames of high samples. The next one must start by frame_length / 8
+ * after the end of the frame, or the decoder goes back to looking for sync.
+ *
+ * Annotations: '!' before a sync point, 'B'/'b' where a bit was read, '>'
+ * while looking for the next start bit and 'v' where it was found, '#'
+ * after a gap.
+ */
+
+struct uart_config {
+	int channel;
+	int frame_length; /* 0 to work it out from the first runs (autobaud.h) */
+	int frame_length_tol; /* < 0 to take the one worked out with it */
+	bool track_drift;
+	/* Look at the middle of bits rather than their start. Fixed frame
+	 * lengths were tuned to the start; a measured one is only good to a
+	 * sample or so, which the start of a bit doesn't forgive. */
+	bool centered;
+	double sample_rate; /* to tell the baud rate worked out, 0 if unknown */
+
+	/* For pieces of a capture decoded separately: it starts with a frame
+	 * (at a sync point found beforehand) rather than in sync phase, and
+	 * stops at the first sync point from `stop` on */
+	bool start_in_frame;
+	uint64_t stop;
+	bool detect_only; /* stop once the frame length is worked out */
+};
+
+enum uart_phase {
+	UART_SYNC,
+	UART_FRAME,
+};
+
+struct uart {
+	struct decoder d;
+	struct uart_config cfg;
+	int frame_length;
+	int frame_length_tol;
+	double tracked_length; /* with track_drift, 0 otherwise */
+
+	/* Samples from `base` on where the channel changes, in
+	 * edges[head..n_edges) */
+	uint64_t *edges;
+	size_t head;
+	size_t n_edges;
+	size_t size;
+	uint64_t base;
+	int base_level;
+	int level; /* after the last edge */
+	uint64_t end; /* levels are known before it */
+	bool started;
+	bool fresh; /* no samples yet since the start or a gap */
+
+	/* Working out the frame length */
+	bool detecting;
+	struct run_histogram h;
+	uint64_t detect_from;
+	uint64_t run_start;
+
+	enum uart_phase phase;
+	uint64_t pos; /* sync: looking from there; frame: where it starts */
+	uint64_t run_from; /* sync: where the high samples before the next falling edge start */
+	size_t scan; /* sync: next edge to look at */
+	bool stopped;
+};
+
+/* Samples a frame reads, past its start. Very short frames have their stop
+ * bit's samples past the frame_length + frame_length / 8 that the decoder
+ * owns.
+ */
+static inline uint64_t
+uart_frame_reach(int frame_length)
+{
+	uint64_t required = frame_length + frame_length / 8;
+	uint64_t needed = frame_length * 9 / 10 + 3;
+
+	return needed > required ? needed : required;
+}
+
+/* First edge after `sample`, going forward from `edge`, when the edges before
+ * it aren't after `sample`. Everything only moves forward, and not by much
+ * more than a frame, so this beats a search.
+ */
+static inline size_t
+uart_next_edge(const struct uart *u, size_t edge, uint64_t sample)
+{
+	while (edge < u->n_edges && u->edges[edge] <= sample) {
+		edge++;
+	}
+
+	return edge;
+}
+
+/* Level of `sample`, given the first edge after it */
+static inline int
+uart_level_before(const struct uart *u, size_t edge)
+{
+	return u->base_level ^ ((edge - u->head) & 1);
+}
+
+/* Forgets the edges up to `sample`, which becomes the base */
+static inline void
+uart_forget(struct uart *u, uint64_t sample)
+{
+	size_t edge = uart_next_edge(u, u->head, sample);
+
+	u->base_level = uart_level_before(u, edge);
+	u->base = sample;
+	u->head = edge;
+	if (u->scan < u->head) {
+		u->scan = u->head;
+	}
+}
+
+static inline bool
+uart_push_edge(struct uart *u, uint64_t sample)
+{
+	if (u->n_edges == u->size) {
+		if (u->head > u->size / 2) {
+			memmove(u->edges, u->edges + u->head, (u->n_edges - u->head) * sizeof(u->edges[0]));
+			u->n_edges -= u->head;
+			u->scan -= u->head;
+			u->head = 0;
+		} else {
+			size_t size = u->size ? u->size * 2 : 1024;
+			uint64_t *edges = realloc(u->edges, size * sizeof(edges[0]));
+			if (edges == NULL) {
+				ERROR("out of memory");
+				return false;
+			}
+			u->edges = edges;
+			u->size = size;
+		}
+	}
+
+	u->edges[u->n_edges++] = sample;
+
+	return true;
+}
+
+static inline void
+uart_enter_sync(struct uart *u, uint64_t pos)
+{
+	u->phase = UART_SYNC;
+	u->pos = pos;
+	u->run_from = pos;
+	uart_forget(u, pos);
+}
+
+static inline void
+uart_enter_frame(struct uart *u, uint64_t start)
+{
+	u->phase = UART_FRAME;
+	u->pos = start;
+	uart_forget(u, start);
+}
+
+/* Looks for a falling edge after at least 2 frames of high samples, which
+ * is where frames start. Returns false if it needs more of the capture.
+ */
+static inline bool
+uart_sync(struct uart *u)
+{
+	size_t i;
+
+	for (i = u->scan; i < u->n_edges; i++) {
+		uint64_t p = u->edges[i];
+
+		if (uart_level_before(u, i + 1)) {
+			u->run_from = p;
+			continue;
+		}
+
+		if (p - u->run_from >= (uint64_t) u->frame_length * 2) {
+			if (p >= u->cfg.stop) {
+				u->stopped = true;
+				return true;
+			}
+			decoder_annotate(&u->d, p - 1, '!', 1);
+			uart_enter_frame(u, p);
+			return true;
+		}
+	}
+
+	/* Only the edges to come can end a run long enough */
+	if (u->n_edges > u->head) {
+		uart_forget(u, u->edges[u->n_edges - 1]);
+	}
+	u->scan = u->n_edges;
+	decoder_settle(&u->d, u->end ? u->end - 1 : 0);
+
+	return false;
+}
+
+/* Measures the length of the frame starting at `start` from the edges
+ * between its bits and moves the frame length slowly towards it, if it is
+ * within the tolerance
+ */
+static inline void
+uart_track_drift(struct uart *u, uint64_t start)
+{
+	int frame_length = u->frame_length;
+	uint64_t end = start + frame_length * 9 / 10 + frame_length / 20;
+	uint64_t sum_e = 0, sum_k = 0;
+	size_t i;
+
+	for (i = u->head; i < u->n_edges && u->edges[i] < end; i++) {
+		uint64_t e = u->edges[i] - start;
+		/* Between bits k - 1 and k, give or take a quarter bit */
+		uint64_t k = (e * 10 + frame_length / 2) / frame_length;
+		int64_t off = (int64_t) (e * 10) - (int64_t) k * frame_length;
+
+		if (k >= 1 && k <= 9 && llabs(off) * 4 <= frame_length) {
+			sum_e += e;
+			sum_k += k;
+		}
+	}
+
+	if (sum_k == 0) {
+		return;
+	}
+
+	double measured = 10.0 * sum_e / sum_k;
+	if (fabs(measured - u->tracked_length) > u->frame_length_tol) {
+		return;
+	}
+	u->tracked_length += (measured - u->tracked_length) / 16;
+	u->frame_length = lround(u->tracked_length);
+}
+
+/* Decodes the frame starting at u->pos and finds the next one, or goes back
+ * to sync phase. Returns false if it needs more of the capture.
+ */
+static inline bool
+uart_frame(struct uart *u)
+{
+	/* It may change from frame to frame with drift tracking */
+	int frame_length = u->frame_length;
+	uint64_t start = u->pos;
+	uint64_t end = start + frame_length + frame_length / 8;
+	unsigned char bits = 0;
+	size_t edge = u->head; /* edges before are before start */
+	int i;
+
+	if (u->end < start + uart_frame_reach(frame_length)) {
+		return false;
+	}
+	decoder_settle(&u->d, start);
+
+	for (i = 0; i < 10; i++) {
+		size_t offset = frame_length * i / 10;
+		if (u->cfg.centered) {
+			offset = frame_length * (2 * i + 1) / 20;
+			offset = offset ? offset - 1 : 0;
+		}
+		/* look at 3 samples; if any is low, consider the bit low */
+		uint64_t sample = start + offset;
+		edge = uart_next_edge(u, edge, sample);
+		int bit = uart_level_before(u, edge)
+			&& (edge == u->n_edges || u->edges[edge] > sample + 2);
+		decoder_annotate(&u->d, sample, (bit)?'B':'b', 1);
+
+		if (i == 0) {
+			/* Start bit */
+			if (bit != 0) {
+				DECODER_REPORT(&u->d, "didn't find start bit, resetting sync");
+				uart_enter_sync(u, end);
+				return true;
+			}
+		} else if (i == 9) {
+			/* Stop bit */
+			if (bit != 1) {
+				DECODER_REPORT(&u->d, "didn't find stop bit, resetting sync");
+				uart_enter_sync(u, end);
+				return true;
+			}
+		} else {
+			bits >>= 1;
+			bits |= (bit << 7);
+		}
+	}
+
+	/* We're done; use this byte */
+	decoder_output(&u->d, &bits, 1);
+
+	if (u->tracked_length) {
+		uart_track_drift(u, start);
+	}
+
+	/* From the offset of the 9th (0-based) bit, search for a low sample */
+	uint64_t from = start + frame_length * 9 / 10 + 1;
+	uint64_t next = from;
+	/* Centered, the stop bit is after it */
+	edge = uart_next_edge(u, u->head, from);
+	if (uart_level_before(u, edge)) {
+		next = edge < u->n_edges && u->edges[edge] < end ? u->edges[edge] : end;
+	}
+	decoder_annotate(&u->d, from, '>', next - from);
+
+	if (next == end) {
+		DECODER_REPORT(&u->d, "couldn't find next frame");
+		uart_enter_sync(u, end);
+		return true;
+	}
+
+	/* Found the beginning of the next frame */
+	decoder_annotate(&u->d, next, 'v', 1);
+	uart_enter_frame(u, next);
+
+	return true;
+}
+
+/* Decodes as far as what it has of the capture goes */
+static inline void
+uart_run(struct uart *u)
+{
+	while (!u->stopped) {
+		if (u->phase == UART_SYNC ? !uart_sync(u) : !uart_frame(u)) {
+			break;
+		}
+	}
+	if (u->stopped) {
+		u->d.done = true;
+	}
+}
+
+/* Works out the frame length from the runs seen so far */
+static inline bool
+uart_detect(struct uart *u)
+{
+	int tol;
+
+	u->detecting = false;
+	if (!autobaud_estimate(&u->h, &u->frame_length, &tol)) {
+		ERROR("%scouldn't work out the frame length from %" PRIu64 " runs",
+			u->d.label, u->h.n_runs);
+		return false;
+	}
+	if (u->cfg.frame_length_tol < 0) {
+		u->frame_length_tol = tol;
+	}
+	if (u->cfg.track_drift) {
+		u->tracked_length = u->frame_length;
+	}
+
+	fprintf(stderr, "%sframe length %d samples, tolerance %d, from %" PRIu64 " runs",
+		u->d.label, u->frame_length, u->frame_length_tol, u->h.n_runs);
+	if (u->cfg.sample_rate) {
+		fprintf(stderr, " (%.0f baud)", u->cfg.sample_rate / u->frame_length * 10);
+	}
+	fprintf(stderr, "\n");
+	free(u->h.counts);
+	u->h.counts = NULL;
+
+	if (u->cfg.detect_only) {
+		u->stopped = true;
+		u->d.done = true;
+	}
+
+	return true;
+}
+
+static inline bool
+uart_levels(struct decoder *d, const struct level_batch *b)
+{
+	struct uart *u = (struct uart *) d;
+	int channel = u->cfg.channel;
+	size_t k;
+
+	if (u->fresh) {
+		u->fresh = false;
+		u->base = u->end = b->start;
+		u->base_level = u->level = (b->initial >> channel) & 1;
+		u->head = u->n_edges = u->scan = 0;
+
+		if (!u->started && u->cfg.start_in_frame) {
+			/* Where the sequential decoder would have found sync */
+			decoder_annotate(d, b->start - 1, '!', 1);
+			uart_enter_frame(u, b->start);
+		} else {
+			uart_enter_sync(u, b->start);
+		}
+		if (!u->started && u->detecting) {
+			u->detect_from = u->run_start = b->start;
+		}
+		u->started = true;
+	}
+
+	for (k = 0; k < b->n_changes; k++) {
+		const struct level_change *c = &b->changes[k];
+		int level = (c->levels >> channel) & 1;
+
+		if (level == u->level) {
+			continue;
+		}
+		if (!uart_push_edge(u, c->sample)) {
+			return false;
+		}
+		if (u->detecting && u->h.n_runs < AUTOBAUD_RUNS
+			&& c->sample - u->detect_from < AUTOBAUD_MAX_SAMPLES)
+		{
+			run_histogram_add(&u->h, u->level, c->sample - u->run_start);
+			u->run_start = c->sample;
+		}
+		u->level = level;
+	}
+	u->end = b->end;
+
+	if (u->detecting) {
+		if (u->h.n_runs < AUTOBAUD_RUNS && u->end - u->detect_from < AUTOBAUD_MAX_SAMPLES) {
+			return true;
+		}
+		if (!uart_detect(u)) {
+			return false;
+		}
+	}
+	uart_run(u);
+
+	return true;
+}
+
+static inline bool
+uart_gap(struct decoder *d, uint64_t sample, uint64_t missing, double time)
+{
+	struct uart *u = (struct uart *) d;
+
+	/* What came before is all there is to work the frame length out from */
+	if (u->detecting && !uart_detect(u)) {
+		return false;
+	}
+	uart_run(u);
+	if (u->stopped) {
+		return true;
+	}
+
+	DECODER_REPORT(d, "%" PRIu64 " samples missing before sample %" PRIu64 " (%.6f s), resetting sync",
+		missing, sample, time);
+	decoder_settle(d, sample);
+	decoder_annotate(d, sample, '#', 1);
+	u->fresh = true;
+
+	return true;
+}
+
+static inline bool
+uart_end(struct decoder *d)
+{
+	struct uart *u = (struct uart *) d;
+
+	if (u->detecting && !uart_detect(u)) {
+		return false;
+	}
+	uart_run(u);
+	decoder_settle_all(d);
+
+	return true;
+}
+
+static inline void
+uart_destroy(struct decoder *d)
+{
+	struct uart *u = (struct uart *) d;
+
+	decoder_cleanup(d);
+	free(u->h.counts);
+	free(u->edges);
+	free(u);
+}
+
+static const struct decoder_ops uart_ops = {
+	.name = "uart",
+	.levels = uart_levels,
+	.gap = uart_gap,
+	.end = uart_end,
+	.destroy = uart_destroy,
+};
+
+static inline struct uart *
+uart_create(const struct uart_config *cfg)
+{
+	struct uart *u = calloc(1, sizeof(*u));
+	if (u == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	decoder_init(&u->d, &uart_ops, 1u << cfg->channel);
+	u->cfg = *cfg;
+	u->frame_length = cfg->frame_length;
+	u->frame_length_tol = cfg->frame_length_tol;
+	u->fresh = true;
+	if (cfg->track_drift) {
+		u->tracked_length = cfg->frame_length;
+	}
+	if (cfg->frame_length == 0) {
+		u->detecting = true;
+		if (!run_histogram_init(&u->h)) {
+			free(u);
+			return NULL;
+		}
+	}
+
+	return u;
+}
+
+#endif /* UART_H */
@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include "trigger.h"
+#include "log.h"
+
+#define TRIGGER_UNKNOWN UINT64_MAX
+
+/* Four groups at a time; gcc lowers this to SSE2 or NEON registers */
+typedef uint32_t v4u __attribute__((vector_size(16)));
+
+struct trigger {
+	struct trigger_config cfg;
+	int n_channels;
+	int line_idx; /* TRIGGER_EDGE, TRIGGER_PULSE */
+	int pattern_idx[32]; /* TRIGGER_PATTERN */
+	uint32_t pattern_flip[32]; /* ~0 where the channel must be low */
+	int n_pattern;
+	size_t pre_groups;
+
+	/* Scan state, carried from one group to the next */
+	uint64_t expected; /* first sample of the next group if there's no gap */
+	bool have_last;
+	uint32_t last; /* line value of the last sample, in bit 31 */
+	int level;
+	uint64_t last_edge; /* TRIGGER_PULSE, TRIGGER_UNKNOWN until the first edge */
+	bool long_fired;
+	uint64_t armed_at;
+	uint64_t *fires;
+	size_t n_fires;
+
+	/* Windows */
+	uint64_t record_until;
+	uint64_t written_until;
+	uint32_t *hist; /* the pre_groups groups before `expected`, at most */
+	size_t hist_n;
+	uint32_t *scratch;
+
+	uint64_t n_events;
+	uint64_t samples_seen;
+	uint64_t samples_kept;
+};
+
+static bool
+parse_number(const char **p, uint64_t *v)
+{
+	char *end;
+
+	*v = strtoull(*p, &end, 0);
+	if (end == *p) {
+		return false;
+	}
+	*p = end;
+
+	return true;
+}
+
+static bool
+parse_colon(const char **p)
+{
+	if (**p != ':') {
+		return false;
+	}
+	(*p)++;
+
+	return true;
+}
+
+bool
+trigger_parse(struct trigger_config *cfg, const char *spec)
+{
+	const char *p;
+	uint64_t v;
+
+	if (strncmp(spec, "edge:", 5) == 0) {
+		p = spec + 5;
+		cfg->type = TRIGGER_EDGE;
+		cfg->edge = TRIGGER_RISING;
+		if (!parse_number(&p, &v)) {
+			goto bad;
+		}
+		cfg->channel = v;
+		if (*p) {
+			if (!parse_colon(&p)) {
+				goto bad;
+			} else if (strcmp(p, "rising") == 0) {
+				cfg->edge = TRIGGER_RISING;
+			} else if (strcmp(p, "falling") == 0) {
+				cfg->edge = TRIGGER_FALLING;
+			} else if (strcmp(p, "both") == 0) {
+				cfg->edge = TRIGGER_BOTH;
+			} else {
+				goto bad;
+			}
+		}
+	} else if (strncmp(spec, "pattern:", 8) == 0) {
+		p = spec + 8;
+		cfg->type = TRIGGER_PATTERN;
+		if (!parse_number(&p, &v)) {
+			goto bad;
+		}
+		cfg->mask = v;
+		if (!parse_colon(&p) || !parse_number(&p, &v) || *p) {
+			goto bad;
+		}
+		cfg->value = v;
+	} else if (strncmp(spec, "pulse:", 6) == 0) {
+		p = spec + 6;
+		cfg->type = TRIGGER_PULSE;
+		if (!parse_number(&p, &v) || !parse_colon(&p)) {
+			goto bad;
+		}
+		cfg->channel = v;
+		if (strncmp(p, "high:", 5) == 0) {
+			cfg->pulse_high = true;
+		} else if (strncmp(p, "low:", 4) == 0) {
+			cfg->pulse_high = false;
+		} else {
+			goto bad;
+		}
+		p = strchr(p, ':') + 1;
+		if (!parse_number(&p, &cfg->min_width) || !parse_colon(&p)
+			|| !parse_number(&p, &cfg->max_width) || *p)
+		{
+			goto bad;
+		}
+	} else {
+		goto bad;
+	}
+
+	return true;
+
+bad:
+	ERROR("bad trigger %s", spec);
+	return false;
+}
+
+static size_t
+ceil_div(uint64_t a, uint64_t b)
+{
+	return (a + b - 1) / b;
+}
+
+struct trigger *
+trigger_create(const struct trigger_config *cfg, uint32_t channel_mask,
+		size_t max_groups)
+{
+	int c;
+
+	if (cfg->type == TRIGGER_EDGE || cfg->type == TRIGGER_PULSE) {
+		if (cfg->channel < 0 || cfg->channel > 31
+			|| !(channel_mask & (1u << cfg->channel)))
+		{
+			ERROR("trigger channel %d is not captured", cfg->channel);
+			return NULL;
+		}
+	} else if (cfg->type == TRIGGER_PATTERN) {
+		if (cfg->mask == 0 || (cfg->mask & ~channel_mask)) {
+			ERROR("trigger pattern mask 0x%x isn't a set of captured channels", cfg->mask);
+			return NULL;
+		}
+		if (cfg->value & ~cfg->mask) {
+			ERROR("trigger pattern 0x%x has bits outside its mask", cfg->value);
+			return NULL;
+		}
+	} else {
+		ERROR("no trigger configured");
+		return NULL;
+	}
+	if (cfg->type == TRIGGER_PULSE && cfg->max_width && cfg->max_width < cfg->min_width) {
+		ERROR("trigger pulse width range is empty");
+		return NULL;
+	}
+
+	struct trigger *t = malloc(sizeof(*t));
+	if (t == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->cfg = *cfg;
+	t->n_channels = __builtin_popcount(channel_mask);
+	t->line_idx = __builtin_popcount(channel_mask & ((1u << cfg->channel) - 1));
+	for (c = 0; c < 32; c++) {
+		if (cfg->type == TRIGGER_PATTERN && (cfg->mask & (1u << c))) {
+			t->pattern_idx[t->n_pattern] = __builtin_popcount(channel_mask & ((1u << c) - 1));
+			t->pattern_flip[t->n_pattern] = (cfg->value & (1u << c)) ? 0 : ~0u;
+			t->n_pattern++;
+		}
+	}
+	t->pre_groups = ceil_div(cfg->pre, 32);
+	t->expected = TRIGGER_UNKNOWN;
+	t->last_edge = TRIGGER_UNKNOWN;
+
+	size_t group_size = t->n_channels * sizeof(uint32_t);
+	t->fires = malloc((max_groups + 1) * sizeof(t->fires[0]));
+	t->hist = malloc((t->pre_groups + 1) * group_size);
+	t->scratch = malloc((t->pre_groups + 1) * group_size);
+	if (t->fires == NULL || t->hist == NULL || t->scratch == NULL) {
+		ERROR("out of memory");
+		trigger_destroy(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+size_t
+trigger_max_segments(size_t n_groups)
+{
+	/* The end of a window from earlier, the history, then one segment per
+	 * event, and there is at most one event per group */
+	return n_groups + 2;
+}
+
+size_t
+trigger_max_segment_groups(struct trigger *t, size_t max_groups)
+{
+	return t->pre_groups > max_groups ? t->pre_groups : max_groups;
+}
+
+/* The line the trigger watches, for one group */
+static inline uint32_t
+line_word(struct trigger *t, const uint32_t *planes, size_t g)
+{
+	const uint32_t *p = planes + g * t->n_channels;
+	int k;
+
+	if (t->cfg.type != TRIGGER_PATTERN) {
+		return p[t->line_idx];
+	}
+
+	uint32_t acc = ~0u;
+	for (k = 0; k < t->n_pattern; k++) {
+		acc &= p[t->pattern_idx[k]] ^ t->pattern_flip[k];
+	}
+
+	return acc;
+}
+
+static inline v4u
+line_words4(struct trigger *t, const uint32_t *planes, size_t g)
+{
+	const uint32_t *p = planes + g * t->n_channels;
+	size_t s = t->n_channels;
+	int k;
+
+	if (t->cfg.type != TRIGGER_PATTERN) {
+		int i = t->line_idx;
+		return (v4u) { p[i], p[s + i], p[2 * s + i], p[3 * s + i] };
+	}
+
+	v4u acc = { ~0u, ~0u, ~0u, ~0u };
+	for (k = 0; k < t->n_pattern; k++) {
+		int i = t->pattern_idx[k];
+		v4u v = { p[i], p[s + i], p[2 * s + i], p[3 * s + i] };
+		acc &= v ^ t->pattern_flip[k];
+	}
+
+	return acc;
+}
+
+static void
+trigger_fire(struct trigger *t, uint64_t f, uint64_t s0)
+{
+	t->fires[t->n_fires++] = f;
+	t->n_events++;
+
+	/* Re-arm once the window is over, on a group boundary */
+	t->armed_at = s0 + ceil_div(f + 1 + t->cfg.post - s0, 32) * 32;
+}
+
+/* Whether a pulse that's still going on gets too long before sample end */
+static inline bool
+pulse_too_long(struct trigger *t, uint64_t end)
+{
+	return t->cfg.type == TRIGGER_PULSE && t->level == t->cfg.pulse_high
+		&& t->last_edge != TRIGGER_UNKNOWN && t->cfg.max_width
+		&& !t->long_fired && end - t->last_edge > t->cfg.max_width;
+}
+
+static void
+scan_pulse_group(struct trigger *t, uint32_t change, uint64_t s0)
+{
+	while (change) {
+		int p = __builtin_clz(change);
+		uint64_t s = s0 + p;
+		change &= ~(0x80000000u >> p);
+
+		/* A pulse of the measured level ends at s */
+		if (t->level == t->cfg.pulse_high && t->last_edge != TRIGGER_UNKNOWN) {
+			uint64_t width = s - t->last_edge;
+			uint64_t f = TRIGGER_UNKNOWN;
+
+			if (t->cfg.max_width && width > t->cfg.max_width) {
+				if (!t->long_fired) {
+					f = t->last_edge + t->cfg.max_width;
+				}
+			} else if (width < t->cfg.min_width) {
+				f = s;
+			}
+			if (f != TRIGGER_UNKNOWN && f >= t->armed_at) {
+				trigger_fire(t, f, s0);
+			}
+		}
+
+		t->level ^= 1;
+		t->last_edge = s;
+		t->long_fired = false;
+	}
+
+	/* Too long pulses fire as soon as they are, not when they end */
+	if (pulse_too_long(t, s0 + 32)) {
+		uint64_t f = t->last_edge + t->cfg.max_width;
+		t->long_fired = true;
+		if (f >= t->armed_at) {
+			trigger_fire(t, f, s0);
+		}
+	}
+}
+
+static void
+scan_group(struct trigger *t, uint32_t line, uint32_t change, uint64_t s0)
+{
+	uint32_t hits = 0;
+
+	if (t->cfg.type == TRIGGER_PULSE) {
+		scan_pulse_group(t, change, s0);
+		return;
+	} else if (t->cfg.type == TRIGGER_PATTERN) {
+		hits = change & line;
+	} else {
+		if (t->cfg.edge & TRIGGER_RISING) {
+			hits |= change & line;
+		}
+		if (t->cfg.edge & TRIGGER_FALLING) {
+			hits |= change & ~line;
+		}
+	}
+
+	while (hits) {
+		if (t->armed_at > s0) {
+			if (t->armed_at >= s0 + 32) {
+				return;
+			}
+			hits &= ~0u >> (t->armed_at - s0);
+			if (!hits) {
+				return;
+			}
+		}
+
+		trigger_fire(t, s0 + __builtin_clz(hits), s0);
+	}
+}
+
+/* Finds the events in n groups starting at sample first */
+static void
+trigger_scan(struct trigger *t, const uint32_t *planes, size_t n, uint64_t first)
+{
+	size_t g = 0;
+	int k;
+
+	t->n_fires = 0;
+
+	if (!t->have_last && n) {
+		/* The first sample has nothing to change from */
+		uint32_t line = line_word(t, planes, 0);
+		t->last = line & 0x80000000u;
+		t->level = line >> 31;
+		t->have_last = true;
+	}
+
+	for (; g + 4 <= n; g += 4) {
+		v4u line = line_words4(t, planes, g);
+		/* Each sample next to the one before it: the previous group's last
+		 * sample moves in at the top */
+		v4u carry = { t->last, line[0] << 31, line[1] << 31, line[2] << 31 };
+		v4u change = line ^ ((line >> 1) | carry);
+		t->last = line[3] << 31;
+
+		if (!(change[0] | change[1] | change[2] | change[3])
+			&& !pulse_too_long(t, first + 32 * (g + 4)))
+		{
+			continue;
+		}
+
+		for (k = 0; k < 4; k++) {
+			scan_group(t, line[k], change[k], first + 32 * (g + k));
+		}
+	}
+
+	for (; g < n; g++) {
+		uint32_t line = line_word(t, planes, g);
+		uint32_t change = line ^ ((line >> 1) | t->last);
+		t->last = line << 31;
+		scan_group(t, line, change, first + 32 * g);
+	}
+}
+
+static void
+add_segment(struct trigger *t, struct trigger_segment *segs, size_t *n_segs,
+		const uint32_t *planes, size_t n_groups, uint64_t first_sample)
+{
+	struct trigger_segment *prev = *n_segs ? &segs[*n_segs - 1] : NULL;
+
+	if (prev && prev->first_sample + 32 * prev->n_groups == first_sample
+		&& prev->planes + prev->n_groups * t->n_channels == planes)
+	{
+		prev->n_groups += n_groups;
+	} else {
+		segs[*n_segs].planes = planes;
+		segs[*n_segs].n_groups = n_groups;
+		segs[*n_segs].first_sample = first_sample;
+		(*n_segs)++;
+	}
+
+	t->written_until = first_sample + 32 * n_groups;
+	t->samples_kept += 32 * n_groups;
+}
+
+static void
+keep_history(struct trigger *t, const uint32_t *planes, size_t n)
+{
+	size_t group_size = t->n_channels * sizeof(uint32_t);
+	size_t pre = t->pre_groups;
+
+	if (n >= pre) {
+		memcpy(t->hist, planes + (n - pre) * t->n_channels, pre * group_size);
+		t->hist_n = pre;
+	} else {
+		size_t keep = pre - n < t->hist_n ? pre - n : t->hist_n;
+		memmove(t->hist, t->hist + (t->hist_n - keep) * t->n_channels, keep * group_size);
+		memcpy(t->hist + keep * t->n_channels, planes, n * group_size);
+		t->hist_n = keep + n;
+	}
+}
+
+size_t
+trigger_feed(struct trigger *t, const uint32_t *planes, size_t n, uint64_t first,
+		struct trigger_segment *segs)
+{
+	size_t n_segs = 0;
+	size_t from = 0; /* groups of this block stored so far */
+	size_t i;
+
+	if (first != t->expected) {
+		/* First block, or after a gap: what came before is unknown */
+		t->have_last = false;
+		t->last_edge = TRIGGER_UNKNOWN;
+		t->long_fired = false;
+		t->hist_n = 0;
+	}
+
+	trigger_scan(t, planes, n, first);
+
+	/* The rest of a window opened in an earlier block */
+	if (t->record_until > first) {
+		size_t end = ceil_div(t->record_until - first, 32);
+		if (end > n) {
+			end = n;
+		}
+		if (end) {
+			add_segment(t, segs, &n_segs, planes, end, first);
+		}
+		from = end;
+	}
+
+	for (i = 0; i < t->n_fires; i++) {
+		uint64_t f = t->fires[i];
+		uint64_t start = f > t->cfg.pre ? f - t->cfg.pre : 0;
+
+		/* The beginning of the window may be in earlier blocks */
+		if (start < first && from == 0 && t->written_until < first) {
+			size_t want = ceil_div(first - start, 32);
+			if (want > t->hist_n) {
+				want = t->hist_n;
+			}
+			if (want > (first - t->written_until) / 32) {
+				want = (first - t->written_until) / 32;
+			}
+			if (want) {
+				memcpy(t->scratch, t->hist + (t->hist_n - want) * t->n_channels,
+					want * t->n_channels * sizeof(uint32_t));
+				add_segment(t, segs, &n_segs, t->scratch, want, first - 32 * want);
+			}
+		}
+
+		size_t start_g = start > first ? (start - first) / 32 : 0;
+		uint64_t end_g = ceil_div(f + 1 + t->cfg.post - first, 32);
+		size_t end_in = end_g < n ? end_g : n;
+		if (start_g < from) {
+			start_g = from;
+		}
+		if (end_in > start_g) {
+			add_segment(t, segs, &n_segs, planes + start_g * t->n_channels,
+				end_in - start_g, first + 32 * start_g);
+			from = end_in;
+		}
+		t->record_until = first + 32 * end_g;
+	}
+
+	keep_history(t, planes, n);
+	t->expected = first + 32 * n;
+	t->samples_seen += 32 * n;
+
+	return n_segs;
+}
+
+void
+trigger_print_summary(struct trigger *t)
+{
+	printf("         Trigger: %" PRIu64 " event(s), %" PRIu64 " of %" PRIu64 " samples kept (%.4f%%)\n",
+		t->n_events, t->samples_kept, t->samples_seen,
+		t->samples_seen ? 100.0 * t->samples_kept / t->samples_seen : 0.0);
+}
+
+void
+trigger_destroy(struct trigger *t)
+{
+	free(t->fires);
+	free(t->hist);
+	free(t->scratch);
+	free(t);
+}
@@ -0,0 +1,82 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Trigger engine: instead of the whole capture, only windows of samples
+ * around events are kept, from pre samples before the event to post samples
+ * after it, rounded out to whole groups of 32 samples. The trigger re-arms
+ * once the window is over.
+ *
+ * Triggers are evaluated on packed planes (see bitpack_planes()), 32 samples
+ * per word operation: every kind reduces to finding edges on one line, which
+ * is a trigger channel or, for patterns, the word-wise AND of the channels
+ * compared.
+ */
+
+enum trigger_type {
+	TRIGGER_NONE = 0,
+	TRIGGER_EDGE, /* an edge on one channel */
+	TRIGGER_PATTERN, /* (sample & mask) becoming equal to value */
+	TRIGGER_PULSE, /* a pulse shorter than min or longer than max samples */
+};
+
+enum trigger_edge {
+	TRIGGER_RISING = 1,
+	TRIGGER_FALLING = 2,
+	TRIGGER_BOTH = 3,
+};
+
+struct trigger_config {
+	enum trigger_type type;
+	int channel; /* r31 bit, TRIGGER_EDGE and TRIGGER_PULSE */
+	enum trigger_edge edge;
+	uint32_t mask; /* r31 bits, TRIGGER_PATTERN */
+	uint32_t value;
+	bool pulse_high; /* TRIGGER_PULSE: measure high rather than low pulses */
+	uint64_t min_width;
+	uint64_t max_width; /* 0 for no limit */
+	uint64_t pre;
+	uint64_t post;
+};
+
+/* Parses edge:BIT[:rising|falling|both], pattern:MASK:VALUE or
+ * pulse:BIT:high|low:MIN:MAX into cfg, leaving pre and post alone.
+ */
+bool trigger_parse(struct trigger_config *cfg, const char *spec);
+
+/* A run of groups to store */
+struct trigger_segment {
+	const uint32_t *planes;
+	size_t n_groups;
+	uint64_t first_sample;
+};
+
+struct trigger;
+
+/* max_groups is the most groups trigger_feed() is given at once */
+struct trigger *trigger_create(const struct trigger_config *cfg,
+		uint32_t channel_mask, size_t max_groups);
+
+/* The most segments trigger_feed() can return for n_groups groups */
+size_t trigger_max_segments(size_t n_groups);
+
+/* Most groups a segment can hold: the larger of a block and the pre-trigger
+ * window
+ */
+size_t trigger_max_segment_groups(struct trigger *t, size_t max_groups);
+
+/* Feeds the planes of the next n_groups groups of the capture, in order,
+ * and fills segs with what has to be stored. Returns the number of segments,
+ * which stay valid until the next call.
+ */
+size_t trigger_feed(struct trigger *t, const uint32_t *planes, size_t n_groups,
+		uint64_t first_sample, struct trigger_segment *segs);
+
+void trigger_print_summary(struct trigger *t);
+
+void trigger_destroy(struct trigger *t);
+
+#endif /* TRIGGER_H */
@@ -0,0 +1,777 @@
+#define _GNU_SOURCE /* O_DIRECT, fallocate() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "writer.h"
+#include "log.h"
+
+/* Older kernels and toolchains (the BeagleBone's among them) don't know about
+ * io_uring; there the thread pool is all we have.
+ */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#define WRITER_HIST_BUCKETS 24 /* bucket k counts latencies below 2^k us */
+#define WRITER_STOP UINT64_MAX /* user_data of the request ending the reaper */
+
+struct wbuf {
+	uint8_t *data;
+	size_t len; /* to write */
+	size_t done; /* written so far */
+	uint64_t offset;
+	uint64_t submit_ns;
+	struct iovec iov;
+	struct wbuf *next; /* in the free list or the thread queue */
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+};
+#endif
+
+struct writer {
+	struct writer_config cfg;
+	enum writer_backend backend;
+	bool seekable;
+	struct wbuf *bufs;
+
+	/* Appending side */
+	struct wbuf *cur;
+	uint64_t offset; /* of cur in the file */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wbuf *free_list;
+	struct wbuf *queue_head; /* WRITER_THREADS */
+	struct wbuf *queue_tail;
+	int in_flight;
+	bool stopping;
+	int failed;
+
+	pthread_t *threads;
+	int n_threads;
+
+#ifdef HAVE_IO_URING
+	struct uring ring;
+	pthread_mutex_t sq_lock; /* the reaper resubmits short writes */
+#endif
+
+	/* Under lock */
+	uint64_t n_writes;
+	uint64_t bytes_written;
+	uint64_t bytes_in_flight;
+	uint64_t short_writes;
+	uint64_t waits;
+	uint64_t hist[WRITER_HIST_BUCKETS];
+	uint64_t max_latency_ns;
+};
+
+static uint64_t
+writer_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+writer_fail(struct writer *w)
+{
+	__atomic_store_n(&w->failed, 1, __ATOMIC_RELEASE);
+}
+
+bool
+writer_failed(struct writer *w)
+{
+	return __atomic_load_n(&w->failed, __ATOMIC_ACQUIRE);
+}
+
+/* A write is over, successfully or not. Called with the lock held. */
+static void
+writer_complete(struct writer *w, struct wbuf *b)
+{
+	uint64_t latency = writer_now() - b->submit_ns;
+	uint64_t us = latency / 1000;
+	int k = 0;
+
+	while (k < WRITER_HIST_BUCKETS - 1 && us >= (1ull << k)) {
+		k++;
+	}
+	w->hist[k]++;
+	if (latency > w->max_latency_ns) {
+		w->max_latency_ns = latency;
+	}
+	w->n_writes++;
+	w->bytes_written += b->done;
+	w->bytes_in_flight -= b->len;
+
+	b->next = w->free_list;
+	w->free_list = b;
+	w->in_flight--;
+	pthread_cond_broadcast(&w->cond);
+}
+
+static void *
+writer_thread(void *arg)
+{
+	struct writer *w = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->queue_head == NULL && !w->stopping) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		struct wbuf *b = w->queue_head;
+		if (b == NULL) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		w->queue_head = b->next;
+		if (w->queue_head == NULL) {
+			w->queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		uint64_t short_writes = 0;
+		while (b->done < b->len && !writer_failed(w)) {
+			ssize_t result;
+			if (w->seekable) {
+				result = pwrite(w->cfg.fd, b->data + b->done, b->len - b->done,
+					b->offset + b->done);
+			} else {
+				result = write(w->cfg.fd, b->data + b->done, b->len - b->done);
+			}
+
+			if (result == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("write");
+				writer_fail(w);
+			} else if (result == 0) {
+				ERROR("write() wrote nothing");
+				writer_fail(w);
+			} else {
+				b->done += result;
+				if (b->done < b->len) {
+					short_writes++;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&w->lock);
+		w->short_writes += short_writes;
+		writer_complete(w, b);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static bool
+uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1) {
+		return false;
+	}
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len) {
+			r->sq_len = r->cq_len;
+		}
+		r->cq_len = 0;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		close(r->fd);
+		return false;
+	}
+
+	r->cq_ptr = r->sq_ptr;
+	if (r->cq_len) {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			munmap(r->sq_ptr, r->sq_len);
+			close(r->fd);
+			return false;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		if (r->cq_len) {
+			munmap(r->cq_ptr, r->cq_len);
+		}
+		munmap(r->sq_ptr, r->sq_len);
+		close(r->fd);
+		return false;
+	}
+
+	uint8_t *sq = r->sq_ptr;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+	uint8_t *cq = r->cq_ptr;
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return true;
+}
+
+static void
+uring_destroy(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_len) {
+		munmap(r->cq_ptr, r->cq_len);
+	}
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+}
+
+/* Queues the rest of b, or a request that stops the reaper if b is NULL */
+static int
+uring_submit(struct writer *w, struct wbuf *b)
+{
+	struct uring *r = &w->ring;
+	int result;
+
+	pthread_mutex_lock(&w->sq_lock);
+
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (b == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = WRITER_STOP;
+	} else {
+		/* WRITEV rather than WRITE, which needs 5.6 */
+		b->iov.iov_base = b->data + b->done;
+		b->iov.iov_len = b->len - b->done;
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = w->cfg.fd;
+		sqe->addr = (uintptr_t) &b->iov;
+		sqe->len = 1;
+		sqe->off = b->offset + b->done;
+		sqe->user_data = (uintptr_t) b;
+	}
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		result = uring_enter(r->fd, 1, 0, 0);
+	} while (result == -1 && errno == EINTR);
+
+	pthread_mutex_unlock(&w->sq_lock);
+
+	if (result == -1) {
+		perror("io_uring_enter");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *
+uring_reaper(void *arg)
+{
+	struct writer *w = arg;
+	struct uring *r = &w->ring;
+
+	for (;;) {
+		unsigned head = *r->cq_head;
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1
+				&& errno != EINTR)
+			{
+				perror("io_uring_enter");
+				writer_fail(w);
+				break;
+			}
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		uint64_t user_data = cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (user_data == WRITER_STOP) {
+			break;
+		}
+
+		struct wbuf *b = (struct wbuf *) (uintptr_t) user_data;
+		if (res < 0) {
+			ERROR("write failed: %s", strerror(-res));
+			writer_fail(w);
+		} else if (res == 0) {
+			ERROR("write() wrote nothing");
+			writer_fail(w);
+		} else {
+			b->done += res;
+			if (b->done < b->len) {
+				pthread_mutex_lock(&w->lock);
+				w->short_writes++;
+				pthread_mutex_unlock(&w->lock);
+				if (uring_submit(w, b) == 0) {
+					continue;
+				}
+				writer_fail(w);
+			}
+		}
+
+		pthread_mutex_lock(&w->lock);
+		writer_complete(w, b);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_IO_URING */
+
+static int
+writer_start_backend(struct writer *w)
+{
+	int i;
+
+#ifdef HAVE_IO_URING
+	if (w->cfg.backend != WRITER_THREADS && w->seekable) {
+		/* One entry per buffer and one for the stop request */
+		if (uring_init(&w->ring, w->cfg.n_buffers + 1)) {
+			w->backend = WRITER_URING;
+			pthread_mutex_init(&w->sq_lock, NULL);
+			w->threads = calloc(1, sizeof(w->threads[0]));
+			if (w->threads == NULL) {
+				ERROR("out of memory");
+				return -1;
+			}
+			if (pthread_create(&w->threads[0], NULL, uring_reaper, w) != 0) {
+				ERROR("failed to start the io_uring reaper");
+				return -1;
+			}
+			w->n_threads = 1;
+			return 0;
+		}
+		if (w->cfg.backend == WRITER_URING) {
+			perror("io_uring_setup");
+			return -1;
+		}
+	}
+#endif
+	if (w->cfg.backend == WRITER_URING) {
+		ERROR("io_uring isn't available%s", w->seekable ? "" : " on unseekable outputs");
+		return -1;
+	}
+
+	w->backend = WRITER_THREADS;
+
+	/* Writes to pipes have to stay in order */
+	int n_threads = w->seekable ? w->cfg.n_threads : 1;
+	w->threads = calloc(n_threads, sizeof(w->threads[0]));
+	if (w->threads == NULL) {
+		ERROR("out of memory");
+		return -1;
+	}
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&w->threads[i], NULL, writer_thread, w) != 0) {
+			ERROR("failed to start writer thread");
+			return -1;
+		}
+		w->n_threads++;
+	}
+
+	return 0;
+}
+
+struct writer *
+writer_create(const struct writer_config *cfg)
+{
+	int i;
+
+	if (cfg->n_buffers < 1 || cfg->buffer_size == 0
+		|| cfg->buffer_size % WRITER_ALIGN || cfg->n_threads < 1)
+	{
+		ERROR("need a writer thread and buffers, sized in multiples of %d bytes",
+			WRITER_ALIGN);
+		return NULL;
+	}
+
+	struct writer *w = malloc(sizeof(*w));
+	if (w == NULL) {
+		ERROR("out of memory");
+		return NULL;
+	}
+
+	memset(w, 0, sizeof(*w));
+	w->cfg = *cfg;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	off_t start = lseek(cfg->fd, 0, SEEK_CUR);
+	w->seekable = start != (off_t) -1;
+	w->offset = w->seekable ? start : 0;
+
+	if (cfg->direct) {
+		int flags = fcntl(cfg->fd, F_GETFL);
+		if (!w->seekable || flags == -1
+			|| fcntl(cfg->fd, F_SETFL, flags | O_DIRECT) == -1)
+		{
+			ERROR("can't use O_DIRECT on this output");
+			writer_destroy(w);
+			return NULL;
+		}
+	}
+
+	if (cfg->preallocate && w->seekable) {
+		/* Only reserves blocks, the file keeps its size */
+		if (fallocate(cfg->fd, FALLOC_FL_KEEP_SIZE, w->offset, cfg->preallocate) == -1) {
+			ERROR("failed to preallocate %" PRIu64 " bytes (%s), going on without",
+				cfg->preallocate, strerror(errno));
+		}
+	}
+
+	w->bufs = calloc(cfg->n_buffers, sizeof(w->bufs[0]));
+	if (w->bufs == NULL) {
+		ERROR("out of memory");
+		writer_destroy(w);
+		return NULL;
+	}
+	for (i = 0; i < cfg->n_buffers; i++) {
+		w->bufs[i].data = aligned_alloc(WRITER_ALIGN, cfg->buffer_size);
+		if (w->bufs[i].data == NULL) {
+			ERROR("out of memory");
+			writer_destroy(w);
+			return NULL;
+		}
+		w->bufs[i].next = w->free_list;
+		w->free_list = &w->bufs[i];
+	}
+
+	if (writer_start_backend(w) == -1) {
+		writer_destroy(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+/* Waits for a buffer to come back if they are all in flight */
+static struct wbuf *
+writer_get_buffer(struct writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->free_list == NULL) {
+		w->waits++;
+	}
+	while (w->free_list == NULL) {
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	struct wbuf *b = w->free_list;
+	w->free_list = b->next;
+	pthread_mutex_unlock(&w->lock);
+
+	b->len = 0;
+	b->done = 0;
+	b->offset = w->offset;
+
+	return b;
+}
+
+static int
+writer_submit(struct writer *w, struct wbuf *b)
+{
+	b->submit_ns = writer_now();
+
+	pthread_mutex_lock(&w->lock);
+	w->in_flight++;
+	w->bytes_in_flight += b->len;
+	if (w->backend == WRITER_THREADS) {
+		b->next = NULL;
+		if (w->queue_tail) {
+			w->queue_tail->next = b;
+		} else {
+			w->queue_head = b;
+		}
+		w->queue_tail = b;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+#ifdef HAVE_IO_URING
+	if (w->backend == WRITER_URING && uring_submit(w, b) == -1) {
+		writer_fail(w);
+		pthread_mutex_lock(&w->lock);
+		writer_complete(w, b);
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+int
+writer_append(struct writer *w, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len) {
+		if (writer_failed(w)) {
+			return -1;
+		}
+
+		if (w->cur == NULL) {
+			w->cur = writer_get_buffer(w);
+		}
+
+		size_t n = w->cfg.buffer_size - w->cur->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->cur->data + w->cur->len, p, n);
+		w->cur->len += n;
+		p += n;
+		len -= n;
+
+		if (w->cur->len == w->cfg.buffer_size) {
+			struct wbuf *b = w->cur;
+			w->cur = NULL;
+			w->offset += b->len;
+			if (writer_submit(w, b) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	return writer_failed(w) ? -1 : 0;
+}
+
+static void
+writer_stop(struct writer *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->in_flight) {
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	w->stopping = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+#ifdef HAVE_IO_URING
+	if (w->backend == WRITER_URING && w->n_threads && uring_submit(w, NULL) == -1) {
+		/* The reaper would never see the request */
+		pthread_cancel(w->threads[0]);
+	}
+#endif
+
+	for (i = 0; i < w->n_threads; i++) {
+		pthread_join(w->threads[i], NULL);
+	}
+	w->n_threads = 0;
+}
+
+/* Submits the partial buffer. With O_DIRECT it is padded, which the caller
+ * truncates away once it is written.
+ */
+static void
+writer_flush(struct writer *w)
+{
+	if (w->cur != NULL && w->cur->len && !writer_failed(w)) {
+		struct wbuf *b = w->cur;
+		w->cur = NULL;
+		w->offset += b->len;
+
+		if (w->cfg.direct && b->len % WRITER_ALIGN) {
+			size_t padded = (b->len + WRITER_ALIGN - 1) / WRITER_ALIGN * WRITER_ALIGN;
+			memset(b->data + b->len, 0, padded - b->len);
+			b->len = padded;
+		}
+
+		writer_submit(w, b);
+	}
+}
+
+static void
+writer_truncate(struct writer *w)
+{
+	if (!writer_failed(w) && w->cfg.direct && ftruncate(w->cfg.fd, w->offset) == -1) {
+		perror("ftruncate");
+		writer_fail(w);
+	}
+}
+
+int
+writer_finish(struct writer *w)
+{
+	writer_flush(w);
+	writer_stop(w);
+	writer_truncate(w);
+
+	return writer_failed(w) ? -1 : 0;
+}
+
+int
+writer_switch(struct writer *w, int fd)
+{
+	writer_flush(w);
+
+	/* Every write to the old file has to be over before it can be closed */
+	pthread_mutex_lock(&w->lock);
+	while (w->in_flight) {
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	writer_truncate(w);
+	if (writer_failed(w)) {
+		return -1;
+	}
+
+	w->cfg.fd = fd;
+	w->offset = 0;
+
+	if (w->cfg.direct) {
+		int flags = fcntl(fd, F_GETFL);
+		if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+			ERROR("can't use O_DIRECT on the next file");
+			writer_fail(w);
+			return -1;
+		}
+	}
+	if (w->cfg.preallocate
+		&& fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, w->cfg.preallocate) == -1)
+	{
+		ERROR("failed to preallocate %" PRIu64 " bytes (%s), going on without",
+			w->cfg.preallocate, strerror(errno));
+	}
+
+	return 0;
+}
+
+uint64_t
+writer_backlog(struct writer *w, int *buffers)
+{
+	pthread_mutex_lock(&w->lock);
+	uint64_t bytes = w->bytes_in_flight;
+	*buffers = w->in_flight;
+	pthread_mutex_unlock(&w->lock);
+
+	return bytes;
+}
+
+const char *
+writer_backend_name(struct writer *w)
+{
+	return w->backend == WRITER_URING ? "io_uring" : "pwrite threads";
+}
+
+void
+writer_print_summary(struct writer *w)
+{
+	int k;
+
+	printf("         Writer: %s, %d buffers of %zu bytes%s; %" PRIu64 " writes, %" PRIu64
+		" short, every buffer was in flight %" PRIu64 " times\n",
+		writer_backend_name(w), w->cfg.n_buffers, w->cfg.buffer_size,
+		w->cfg.direct ? ", O_DIRECT" : "", w->n_writes, w->short_writes, w->waits);
+
+	printf("         Write latency (us):");
+	for (k = 0; k < WRITER_HIST_BUCKETS; k++) {
+		if (w->hist[k]) {
+			if (k == WRITER_HIST_BUCKETS - 1) {
+				printf(" >=%llu: %" PRIu64, 1ull << (k - 1), w->hist[k]);
+			} else {
+				printf(" <%llu: %" PRIu64, 1ull << k, w->hist[k]);
+			}
+		}
+	}
+	printf(", %.1f at most\n", w->max_latency_ns / 1000.0);
+}
+
+void
+writer_destroy(struct writer *w)
+{
+	int i;
+
+	if (w->n_threads) {
+		writer_stop(w);
+	}
+
+#ifdef HAVE_IO_URING
+	if (w->backend == WRITER_URING) {
+		uring_destroy(&w->ring);
+		pthread_mutex_destroy(&w->sq_lock);
+	}
+#endif
+
+	if (w->bufs != NULL) {
+		for (i = 0; i < w->cfg.n_buffers; i++) {
+			free(w->bufs[i].data);
+		}
+	}
+	free(w->bufs);
+	free(w->threads);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w);
+}
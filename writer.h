@@ -0,0 +1,66 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Writes the output file in the background. Appended data is copied into
+ * one of n_buffers large aligned buffers; full buffers are handed to the
+ * kernel through io_uring, or to a pool of threads calling pwrite(), while the
+ * next one fills. Appending only blocks when every buffer is in flight.
+ */
+
+enum writer_backend {
+	WRITER_AUTO = 0, /* io_uring when the kernel has it, threads otherwise */
+	WRITER_URING,
+	WRITER_THREADS,
+};
+
+struct writer_config {
+	int fd;
+	enum writer_backend backend;
+	int n_buffers;
+	size_t buffer_size; /* a multiple of WRITER_ALIGN */
+	int n_threads; /* WRITER_THREADS only */
+	bool direct; /* bypass the page cache with O_DIRECT */
+	uint64_t preallocate; /* bytes to reserve on disk up front, 0 for none */
+};
+
+/* Buffer alignment, which is also what O_DIRECT needs for sizes and offsets */
+#define WRITER_ALIGN 4096
+
+struct writer;
+
+struct writer *writer_create(const struct writer_config *cfg);
+
+/* Appends len bytes to the file. Not thread safe: callers take turns. */
+int writer_append(struct writer *w, const void *data, size_t len);
+
+/* Writes what is left and waits for every write to complete. With O_DIRECT
+ * the last buffer is padded, then the file is truncated back to its length.
+ */
+int writer_finish(struct writer *w);
+
+/* Writes what is left, waits for it, and goes on with fd, a new regular file,
+ * from its start. The old file can be closed once this returns. The threads
+ * or the ring keep running.
+ */
+int writer_switch(struct writer *w, int fd);
+
+/* True once a write has failed */
+bool writer_failed(struct writer *w);
+
+/* Bytes handed to the kernel or the threads and not written yet, and the
+ * number of buffers they fill. Safe from any thread.
+ */
+uint64_t writer_backlog(struct writer *w, int *buffers);
+
+/* Name of the backend in use, for display purposes */
+const char *writer_backend_name(struct writer *w);
+
+void writer_print_summary(struct writer *w);
+
+void writer_destroy(struct writer *w);
+
+#endif /* WRITER_H */